@@ -6,341 +6,4839 @@
 #include <vector>
 #include <string.h>
 #include <thread>
+#include <memory>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <iomanip>
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <iterator>
+#include <bitset>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <new>
+#include <cstdlib>
+#if defined(_M_X64) || defined(_M_ARM64)
+#include <intrin.h>
+#endif
+// The stream runtime is built on coroutines, which Visual Studio 2017 offers
+// as an experiment with /await.
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+namespace coro = std;
+#else
+#include <experimental/coroutine>
+namespace coro = std::experimental;
+#endif
 #include<ws2tcpip.h>
+#include <mstcpip.h>
+#include <mswsock.h>
+#include <dwmapi.h>
 #include "opencv2/core/core.hpp"
 #include "opencv2/opencv.hpp"
 
 #pragma comment(lib,"ws2_32.lib")
+#pragma comment(lib,"dwmapi.lib")
 
 //#pragma once
 // This is the maximum UDP packet size, and the buffer will be allocated for
 // the max amount.
 constexpr int kMaxPacketBufferSize = 65535;
 
-class ProtocolData {
+// Set to true when the sender and receiver run on the same machine. Frames are
+// then read from a shared-memory ring instead of a UDP socket. This must match
+// the setting in sender.cpp.
+constexpr bool kUseSharedMemoryTransport = false;
+
+// The shared-memory ring holds this many frame slots. Each slot can hold a
+// frame of up to kSharedMemorySlotSize bytes.
+constexpr int kSharedMemorySlotCount = 8;
+constexpr int kSharedMemorySlotSize = 4 * 1024 * 1024;
+
+// The socket's receive buffer is enlarged to this size, so that the bursts of
+// fragments of several frames fit into it.
+constexpr int kReceiveBufferSize = 1024 * 1024;
+
+// Set to true to have the kernel timestamp packets as they arrive, where the
+// system supports it (SIO_TIMESTAMPING). Packet arrival times then leave out
+// the time a packet waited in the socket before it was read, which is
+// recorded as the socket stage instead. Otherwise packets are timestamped
+// when they are read.
+constexpr bool kUseKernelTimestamps = true;
+
+// Set to true for latency-critical streams, such as teleoperation feeds. The
+// receiving thread then gets a core of its own, starting at
+// kBusyPollFirstCore, and spins on its non-blocking socket instead of
+// sleeping in select() until the next packet wakes it up. It spins as long as
+// the last packet arrived less than kBusyPollSpinUs ago, and only blocks once
+// the stream has gone quiet.
+constexpr bool kUseBusyPoll = false;
+constexpr long long kBusyPollSpinUs = 50000;
+constexpr int kBusyPollFirstCore = 2;
+
+// Frames that are still missing fragments are given up on once this many
+// newer frames are being collected.
+constexpr size_t kMaxPendingFrames = 4;
+
+// A feedback report is sent to the sender at least this often while packets
+// are arriving.
+constexpr long long kFeedbackIntervalUs = 100000;
+
+// A receiver report (see ReceiverReport) is sent along with the feedback at
+// most this often.
+constexpr long long kReceiverReportIntervalUs = 1000000;
+
+// Packets that arrive ahead of a missing one are held back for at most this
+// many packets or this long, in case the missing one was only reordered.
+constexpr size_t kReorderWindowPackets = 32;
+constexpr long long kMaxReorderDelayUs = 5000;
+
+// The number of recent sequence numbers that duplicates are detected among.
+constexpr size_t kSequenceWindow = 1024;
+
+// Set to true to show frames at a steady cadence instead of as soon as they
+// are decoded. Each frame is then due at its capture time plus a playout
+// delay, and is shown at the first display refresh after that. Frames that
+// miss their refresh are skipped. The playout delay follows the delays of
+// recent frames, starting at kInitialPlayoutDelayUs and never going above
+// kMaxPlayoutDelayUs.
+constexpr bool kUsePresentationScheduler = true;
+constexpr long long kInitialPlayoutDelayUs = 20000;
+constexpr long long kMaxPlayoutDelayUs = 200000;
+
+// Set to true to keep the recent frames of the streams that receive() shows as
+// JPEGs in a ring of kTimeShiftRingBytes, in a memory-mapped file per stream.
+// The ring indexes one frame per kTimeShiftBytesPerFrame of its size. The
+// operator can then pause and resume the stream ('p'), rewind it by
+// kRewindStepUs ('r'), return to live ('l') and export the kExportClipUs up
+// to the shown frame as an MJPEG clip ('e'), which the sender can replay (see
+// kReplayFileName in sender.cpp). The streams of the StreamRuntime only keep a
+// ring if they are given a size (see StreamRuntime::AddStream()).
+constexpr bool kUseTimeShift = false;
+constexpr size_t kTimeShiftRingBytes = 64 * 1024 * 1024;
+constexpr size_t kTimeShiftBytesPerFrame = 4096;
+constexpr long long kRewindStepUs = 10000000;
+constexpr long long kExportClipUs = 30000000;
+
+// Set to true to subscribe to the low-resolution, low-rate previews of the
+// streams instead of the streams themselves, e.g. for a wall of many cameras.
+// The sender then encodes and sends nothing else, which saves most of the
+// network and decoding load.
+constexpr bool kReceivePreviewsOnly = false;
+
+// Set to true to let the operator pan and zoom into a stream from its window:
+// '+' and '-' zoom in and out by a factor of two, up to kMaxZoom, 'w', 'a',
+// 's' and 'd' move by a quarter of the shown region, and '0' shows the whole
+// frame again. The sender then sends only the region, cut out of its frames
+// before they are resized, so that it gets the pixels that the whole frame
+// had (see PrepareFrame() in sender.cpp).
+constexpr bool kUseDigitalZoom = true;
+constexpr int kMaxZoom = 16;
+
+// The file that the trace is written to on Ctrl+Break when ENABLE_TRACING is
+// defined.
+const char* const kTraceFileName = "receiver_trace.json";
+
+// Set to false to leave the placement of threads and frame memory to the
+// system. Otherwise each stream stays on the cores and the memory of one NUMA
+// node.
+constexpr bool kUseNumaPlacement = true;
+
+// Set to true to receive the streams as coroutines on a few event-loop threads
+// instead of on a thread each, which takes a stream only kilobytes besides
+// its last image. Frames are decoded and displayed on a task pool with a
+// worker per core, so that the event loops never wait for them.
+constexpr bool kUseStreamRuntime = false;
+constexpr int kEventLoopThreads = 2;
+
+// Set to true to decode the frames of all streams in the order in which they
+// are due to be shown, rather than in the order in which they arrived, and to
+// drop the frames that could no longer be decoded in time. With the stream
+// runtime, this decides which frames the task pool decodes first when it
+// cannot keep up; streams can be weighted (see StreamRuntime::AddStream()).
+constexpr bool kUseDeadlineScheduling = true;
+
+// A stream waits this long for a packet before it stops waiting for missing
+// ones, like the select() timeout of ReceiverSocket::GetPacket().
+constexpr long long kStreamIdleTimeoutUs = 1000000;
+
+// The largest payload put into a single UDP packet. Frames are split into
+// fragments of this size so that each packet fits into one Ethernet frame.
+constexpr size_t kMaxFragmentPayloadSize = 1200;
+
+// Packet types, stored in the first byte of every packet.
+//  - kPacketTypeFrame: a fragment of an encoded video frame.
+//  - kPacketTypePadding: a bandwidth probe. The payload is meaningless.
+//  - kPacketTypeFeedback: an arrival report sent back by the receiver.
+//  - kPacketTypeTables: JPEG tables that abbreviated frames refer to. The
+//    payload is the table id followed by the DQT and DHT marker segments.
+//  - kPacketTypePreview: a fragment of a preview frame, laid out like a frame
+//    fragment. Previews are numbered apart from the frames, and their JPEGs
+//    are always complete.
+//  - kPacketTypeSubscription: sent back by the receiver along with its
+//    feedback. The payload is a single byte, kSubscribeFull or
+//    kSubscribePreview, optionally followed by the FrameRegion to send.
+//  - kPacketTypeReceiverReport: reception statistics sent back by the
+//    receiver (see ReceiverReport).
+constexpr unsigned char kPacketTypeFrame = 1;
+constexpr unsigned char kPacketTypePadding = 2;
+constexpr unsigned char kPacketTypeFeedback = 3;
+constexpr unsigned char kPacketTypeTables = 4;
+constexpr unsigned char kPacketTypePreview = 5;
+constexpr unsigned char kPacketTypeSubscription = 6;
+constexpr unsigned char kPacketTypeReceiverReport = 7;
+
+// What a receiver subscribes to: the full stream, with the previews on the
+// side, or only the previews.
+constexpr unsigned char kSubscribeFull = 0;
+constexpr unsigned char kSubscribePreview = 1;
+
+// Frames refer to the tables that were stripped from their JPEG by id (see
+// FragmentInfo). kNoTableId means the JPEG is complete.
+constexpr unsigned char kNoTableId = 0;
+
+// Every packet starts with this header. It is written to the wire in network
+// byte order by WritePacketHeader(), and takes kPacketHeaderSize bytes. The
+// last four of them hold the CRC32C of the whole packet (see SealPacket()).
+struct PacketHeader {
+	unsigned char type;
+
+	// The probe cluster this packet belongs to, or 0 for ordinary packets.
+	unsigned char probe_cluster;
+
+	// The position of this fragment in its frame, and the number of fragments
+	// that the frame was split into.
+	unsigned short fragment_index;
+	unsigned short fragment_count;
+
+	// The per-stream packet number. Frame and padding packets share it.
+	unsigned int sequence;
+
+	// The per-stream frame number.
+	unsigned int frame_id;
+
+	// The sender's clock, in microseconds, when the packet left. This wraps
+	// around, so only differences between two values are meaningful.
+	unsigned int send_time_us;
+};
+constexpr size_t kPacketChecksumOffset = 18;
+constexpr size_t kPacketHeaderSize = 22;
+
+// Helpers to read and write big-endian integers in packet buffers.
+void WriteUint16(unsigned char* buffer, const unsigned short value) {
+	buffer[0] = static_cast<unsigned char>(value >> 8);
+	buffer[1] = static_cast<unsigned char>(value);
+}
+
+void WriteUint32(unsigned char* buffer, const unsigned int value) {
+	buffer[0] = static_cast<unsigned char>(value >> 24);
+	buffer[1] = static_cast<unsigned char>(value >> 16);
+	buffer[2] = static_cast<unsigned char>(value >> 8);
+	buffer[3] = static_cast<unsigned char>(value);
+}
+
+unsigned short ReadUint16(const unsigned char* buffer) {
+	return static_cast<unsigned short>((buffer[0] << 8) | buffer[1]);
+}
+
+unsigned int ReadUint32(const unsigned char* buffer) {
+	return (static_cast<unsigned int>(buffer[0]) << 24) |
+		(static_cast<unsigned int>(buffer[1]) << 16) |
+		(static_cast<unsigned int>(buffer[2]) << 8) |
+		static_cast<unsigned int>(buffer[3]);
+}
+
+// Writes the header into the first kPacketHeaderSize bytes of the buffer.
+void WritePacketHeader(const PacketHeader& header, unsigned char* buffer) {
+	buffer[0] = header.type;
+	buffer[1] = header.probe_cluster;
+	WriteUint16(buffer + 2, header.fragment_index);
+	WriteUint16(buffer + 4, header.fragment_count);
+	WriteUint32(buffer + 6, header.sequence);
+	WriteUint32(buffer + 10, header.frame_id);
+	WriteUint32(buffer + 14, header.send_time_us);
+	// The checksum is only filled in by SealPacket().
+	WriteUint32(buffer + kPacketChecksumOffset, 0);
+}
+
+// Reads the header at the start of a packet. Returns false if the packet is
+// too short to contain one.
+bool ReadPacketHeader(
+	const unsigned char* data, const size_t size, PacketHeader* header) {
+
+	if (size < kPacketHeaderSize) {
+		return false;
+	}
+	header->type = data[0];
+	header->probe_cluster = data[1];
+	header->fragment_index = ReadUint16(data + 2);
+	header->fragment_count = ReadUint16(data + 4);
+	header->sequence = ReadUint32(data + 6);
+	header->frame_id = ReadUint32(data + 10);
+	header->send_time_us = ReadUint32(data + 14);
+	return true;
+}
+
+// CRC32C (Castagnoli) checksums of packets. The crc32 instructions of SSE4.2
+// and ARMv8 compute it at several bytes per cycle; on processors without
+// them, a table is used.
+bool HasCrc32cInstructions() {
+#if defined(_M_X64)
+	static const bool has_sse42 = [] {
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 20)) != 0;
+	}();
+	return has_sse42;
+#elif defined(_M_ARM64)
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Continues the CRC32C state crc over the given bytes. The state starts as
+// 0xFFFFFFFF, and the checksum is the final state inverted.
+unsigned int UpdateCrc32c(
+	unsigned int crc, const unsigned char* data, size_t size) {
+
+#if defined(_M_X64) || defined(_M_ARM64)
+	if (HasCrc32cInstructions()) {
+		for (; size >= 8; data += 8, size -= 8) {
+			unsigned long long word;
+			memcpy(&word, data, sizeof(word));
+#if defined(_M_X64)
+			crc = static_cast<unsigned int>(_mm_crc32_u64(crc, word));
+#else
+			crc = __crc32cd(crc, word);
+#endif
+		}
+		for (; size > 0; ++data, --size) {
+#if defined(_M_X64)
+			crc = _mm_crc32_u8(crc, *data);
+#else
+			crc = __crc32cb(crc, *data);
+#endif
+		}
+		return crc;
+	}
+#endif
+	static const std::vector<unsigned int> table = [] {
+		std::vector<unsigned int> table(256);
+		for (unsigned int i = 0; i < 256; ++i) {
+			unsigned int value = i;
+			for (int bit = 0; bit < 8; ++bit) {
+				value = (value & 1) ? (value >> 1) ^ 0x82F63B78 : value >> 1;
+			}
+			table[i] = value;
+		}
+		return table;
+	}();
+	for (; size > 0; ++data, --size) {
+		crc = table[(crc ^ *data) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+// Returns the CRC32C of the packet, with its checksum field taken as zero.
+unsigned int PacketChecksum(const unsigned char* packet, const size_t size) {
+	static const unsigned char kZeros[4] = {};
+	unsigned int crc = 0xFFFFFFFF;
+	crc = UpdateCrc32c(crc, packet, kPacketChecksumOffset);
+	crc = UpdateCrc32c(crc, kZeros, sizeof(kZeros));
+	crc = UpdateCrc32c(
+		crc, packet + kPacketHeaderSize, size - kPacketHeaderSize);
+	return ~crc;
+}
+
+// Stores the packet's checksum in its header. This must be the last change to
+// the packet before it is sent.
+void SealPacket(unsigned char* packet, const size_t size) {
+	WriteUint32(packet + kPacketChecksumOffset, PacketChecksum(packet, size));
+}
+
+// Returns true if the packet has a header and its checksum matches, which
+// rules out packets that were damaged on the way and stray datagrams that
+// were never sent by this protocol.
+bool IsPacketIntact(const unsigned char* packet, const size_t size) {
+	return size >= kPacketHeaderSize &&
+		ReadUint32(packet + kPacketChecksumOffset) == PacketChecksum(packet, size);
+}
+
+// Returns a monotonic clock reading in microseconds.
+long long NowMicroseconds() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Converts a QueryPerformanceCounter() value, which is what kernel packet
+// timestamps are, to the clock of NowMicroseconds(). The steady_clock of
+// Visual Studio counts QueryPerformanceCounter() ticks as well.
+long long QpcToMicroseconds(const unsigned long long qpc) {
+	static const unsigned long long frequency = [] {
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		return static_cast<unsigned long long>(frequency.QuadPart);
+	}();
+	return static_cast<long long>(
+		qpc / frequency * 1000000 + qpc % frequency * 1000000 / frequency);
+}
+
+// The feedback report sent by the receiver is a kPacketTypeFeedback header
+// followed by a 16-bit entry count and that many (sequence, arrival time)
+// pairs of 32-bit values. Arrival times are the receiver's clock in
+// microseconds.
+constexpr size_t kFeedbackEntrySize = 8;
+constexpr size_t kMaxFeedbackEntries =
+	(kMaxFragmentPayloadSize - 2) / kFeedbackEntrySize;
+
+// Along with its feedback, the receiver regularly sends a report modeled on
+// the receiver reports of RTCP. The kPacketTypeReceiverReport header is
+// followed by a ReceiverReport, written by WriteReceiverReport() in
+// kReceiverReportSize bytes.
+struct ReceiverReport {
+	// The highest packet sequence number received.
+	unsigned int highest_sequence;
+
+	// The number of packets missing since the stream started, and the fraction
+	// of the packets expected since the previous report that went missing, in
+	// 1/256ths.
+	unsigned int cumulative_lost;
+	unsigned char fraction_lost;
+
+	// How much the spacing of the packets on arrival differed from their
+	// spacing on sending, smoothed as in RFC 3550.
+	unsigned int jitter_us;
+
+	// How long the receiver took to decode and to display a frame, on average
+	// recently.
+	unsigned int decode_time_us;
+	unsigned int render_time_us;
+
+	// The send time of the newest packet received, on the sender's clock, and
+	// how long after that packet arrived the report was sent. Whatever else
+	// passed until the report arrived is the round-trip time.
+	unsigned int last_send_time_us;
+	unsigned int delay_since_last_us;
+};
+constexpr size_t kReceiverReportSize = 29;
+
+void WriteReceiverReport(const ReceiverReport& report, unsigned char* buffer) {
+	WriteUint32(buffer, report.highest_sequence);
+	WriteUint32(buffer + 4, report.cumulative_lost);
+	buffer[8] = report.fraction_lost;
+	WriteUint32(buffer + 9, report.jitter_us);
+	WriteUint32(buffer + 13, report.decode_time_us);
+	WriteUint32(buffer + 17, report.render_time_us);
+	WriteUint32(buffer + 21, report.last_send_time_us);
+	WriteUint32(buffer + 25, report.delay_since_last_us);
+}
+
+bool ReadReceiverReport(
+	const unsigned char* data, const size_t size, ReceiverReport* report) {
+
+	if (size < kReceiverReportSize) {
+		return false;
+	}
+	report->highest_sequence = ReadUint32(data);
+	report->cumulative_lost = ReadUint32(data + 4);
+	report->fraction_lost = data[8];
+	report->jitter_us = ReadUint32(data + 9);
+	report->decode_time_us = ReadUint32(data + 13);
+	report->render_time_us = ReadUint32(data + 17);
+	report->last_send_time_us = ReadUint32(data + 21);
+	report->delay_since_last_us = ReadUint32(data + 25);
+	return true;
+}
+
+// The stages that every frame passes through, in order. The durations of
+// each stage are collected per stream in a StreamLatencyStats.
+//  - capture: grabbing the image from the camera.
+//  - resize, overlay, encode, packetize: the sender's processing steps.
+//  - send: from the end of packetizing until the last fragment left.
+//  - receive: the network delay of the last fragment. The two clocks are not
+//    synchronized, so this is the delay above the smallest one seen recently,
+//    i.e. the queueing delay along the path.
+//  - socket: how long a packet spent in the socket layer, from the send call
+//    until the kernel sent it, or from the kernel receiving it until it was
+//    read. This is recorded per packet, and only where the system timestamps
+//    packets (see kUseKernelTimestamps).
+//  - reassemble: from the first to the last fragment of the frame arriving.
+//  - decode, display: the receiver's processing steps. Display includes the
+//    waitKey() delay, and the wait for the frame's presentation time (see
+//    kUsePresentationScheduler).
+enum PipelineStage {
+	kStageCapture = 0,
+	kStageResize,
+	kStageOverlay,
+	kStageEncode,
+	kStagePacketize,
+	kStageSend,
+	kStageReceive,
+	kStageSocket,
+	kStageReassemble,
+	kStageDecode,
+	kStageDisplay,
+	kNumPipelineStages
+};
+
+static const char* const kPipelineStageNames[kNumPipelineStages] = {
+	"capture", "resize", "overlay", "encode", "packetize",
+	"send", "receive", "socket", "reassemble", "decode", "display",
+};
+
+// The stages up to and including kStagePacketize happen before the frame is
+// sent, so their end times travel with the frame in its FrameTrace.
+constexpr int kNumTracedStages = kStagePacketize + 1;
+
+// The stage timestamps of one frame. It is sent in front of the encoded frame
+// bytes, as kFrameTraceSize bytes in network byte order.
+struct FrameTrace {
+	// The sender's clock, in microseconds, when the capture started. This is
+	// the same clock as PacketHeader::send_time_us.
+	unsigned int capture_start_us;
+
+	// The time at which each traced stage ended, in microseconds after
+	// capture_start_us.
+	unsigned int stage_end_us[kNumTracedStages];
+};
+constexpr size_t kFrameTraceSize = 4 + 4 * kNumTracedStages;
+
+void WriteFrameTrace(const FrameTrace& trace, unsigned char* buffer) {
+	WriteUint32(buffer, trace.capture_start_us);
+	for (int i = 0; i < kNumTracedStages; ++i) {
+		WriteUint32(buffer + 4 + 4 * i, trace.stage_end_us[i]);
+	}
+}
+
+bool ReadFrameTrace(
+	const unsigned char* data, const size_t size, FrameTrace* trace) {
+
+	if (size < kFrameTraceSize) {
+		return false;
+	}
+	trace->capture_start_us = ReadUint32(data);
+	for (int i = 0; i < kNumTracedStages; ++i) {
+		trace->stage_end_us[i] = ReadUint32(data + 4 + 4 * i);
+	}
+	return true;
+}
+
+// Frames are encoded with one restart interval per row of MCUs, so that each
+// row ("stripe") of the JPEG scan can be decoded on its own. Every frame
+// fragment starts with kFragmentInfoSize bytes that say which part of the
+// scan it carries:
+//  - the id of the tables stripped from the frame's JPEG, or kNoTableId.
+//  - the stripe that the fragment's data starts in, as 16 bits. The fragment
+//    starts exactly at the beginning of the stripe unless
+//    kFragmentContinuesStripe is set. kUnknownStripe means the sender did
+//    not find the stripes, so the frame can only be decoded as a whole.
+// Fragment 0 continues with the FrameTrace and then the JPEG header, which
+// counts as part of stripe 0. The other fragments hold only scan data.
+struct FragmentInfo {
+	unsigned char table_id;
+	unsigned short stripe;
+};
+constexpr size_t kFragmentInfoSize = 3;
+constexpr unsigned short kFragmentContinuesStripe = 0x8000;
+constexpr unsigned short kUnknownStripe = 0xFFFF;
+
+void WriteFragmentInfo(const FragmentInfo& info, unsigned char* buffer) {
+	buffer[0] = info.table_id;
+	WriteUint16(buffer + 1, info.stripe);
+}
+
+bool ReadFragmentInfo(
+	const unsigned char* data, const size_t size, FragmentInfo* info) {
+
+	if (size < kFragmentInfoSize) {
+		return false;
+	}
+	info->table_id = data[0];
+	info->stripe = ReadUint16(data + 1);
+	return true;
+}
+
+// A region of the frames that a receiver subscribes to, for digital pan and
+// zoom. The coordinates are in 1/65536ths of the frame's width and height, so
+// that the receiver need not know the sender's resolution. A region of zero
+// width or height stands for the whole frame. It takes kFrameRegionSize bytes
+// after the subscription byte of a kPacketTypeSubscription packet.
+struct FrameRegion {
+	unsigned short x;
+	unsigned short y;
+	unsigned short width;
+	unsigned short height;
+
+	bool IsWholeFrame() const {
+		return width == 0 || height == 0;
+	}
+};
+constexpr size_t kFrameRegionSize = 8;
+
+void WriteFrameRegion(const FrameRegion& region, unsigned char* buffer) {
+	WriteUint16(buffer, region.x);
+	WriteUint16(buffer + 2, region.y);
+	WriteUint16(buffer + 4, region.width);
+	WriteUint16(buffer + 6, region.height);
+}
+
+bool ReadFrameRegion(
+	const unsigned char* data, const size_t size, FrameRegion* region) {
+
+	if (size < kFrameRegionSize) {
+		return false;
+	}
+	region->x = ReadUint16(data);
+	region->y = ReadUint16(data + 2);
+	region->width = ReadUint16(data + 4);
+	region->height = ReadUint16(data + 6);
+	return true;
+}
+
+// JPEG marker codes, each following a 0xFF byte.
+constexpr unsigned char kJpegMarkerSOI = 0xD8;
+constexpr unsigned char kJpegMarkerEOI = 0xD9;
+constexpr unsigned char kJpegMarkerSOS = 0xDA;
+constexpr unsigned char kJpegMarkerRST0 = 0xD0;
+constexpr unsigned char kJpegMarkerRST7 = 0xD7;
+
+// Returns true if the marker ends a stripe of the scan: a restart marker, or
+// EOI after the last stripe.
+bool IsStripeEndMarker(const unsigned char marker) {
+	return (marker >= kJpegMarkerRST0 && marker <= kJpegMarkerRST7) ||
+		marker == kJpegMarkerEOI;
+}
+
+// Returns the size of the JPEG header, from SOI up to and including the SOS
+// segment, which is where the scan data starts. Returns 0 if the header is not
+// all there.
+size_t FindJpegScanStart(const unsigned char* jpeg, const size_t size) {
+	if (size < 4 || jpeg[0] != 0xFF || jpeg[1] != kJpegMarkerSOI) {
+		return 0;
+	}
+	size_t position = 2;
+	while (position + 4 <= size) {
+		if (jpeg[position] != 0xFF) {
+			return 0;
+		}
+		if (jpeg[position + 1] == 0xFF) {
+			// A fill byte in front of the marker.
+			++position;
+			continue;
+		}
+		const size_t end = position + 2 + ReadUint16(jpeg + position + 2);
+		if (end > size) {
+			return 0;
+		}
+		if (jpeg[position + 1] == kJpegMarkerSOS) {
+			return end;
+		}
+		position = end;
+	}
+	return 0;
+}
+
+// Checks the structure of a JPEG, which takes a fraction of the time decoding
+// it would: it must start with SOI, every marker segment must fit, a frame
+// header must come before the first scan, and the last scan must be followed
+// by EOI. Truncated and garbled frames are rejected this way instead of being
+// decoded into a corrupt image. Bytes after EOI are ignored.
+bool IsWellFormedJPEG(const unsigned char* jpeg, const size_t size) {
+	if (size < 4 || jpeg[0] != 0xFF || jpeg[1] != kJpegMarkerSOI) {
+		return false;
+	}
+	const unsigned char* const end = jpeg + size;
+	const unsigned char* position = jpeg + 2;
+	bool has_frame_header = false;
+	while (true) {
+		// The marker segments up to the next scan.
+		if (end - position < 4 || position[0] != 0xFF) {
+			return false;
+		}
+		const unsigned char marker = position[1];
+		if (marker == 0xFF) {
+			// A fill byte in front of the marker.
+			++position;
+			continue;
+		}
+		const size_t length = ReadUint16(position + 2);
+		if (length < 2 || length > static_cast<size_t>(end - position - 2)) {
+			return false;
+		}
+		// SOF0 to SOF15, which are the markers from 0xC0 to 0xCF except for
+		// DHT (0xC4), JPG (0xC8) and DAC (0xCC).
+		if ((marker & 0xF0) == 0xC0 &&
+			marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+			has_frame_header = true;
+		}
+		position += 2 + length;
+		if (marker != kJpegMarkerSOS) {
+			continue;
+		}
+		if (!has_frame_header) {
+			return false;
+		}
+		// The scan data, up to the first marker that is neither a stuffed
+		// zero, a restart marker nor a fill byte.
+		while (true) {
+			position = static_cast<const unsigned char*>(
+				memchr(position, 0xFF, end - position));
+			if (position == nullptr || end - position < 2) {
+				return false;
+			}
+			const unsigned char next = position[1];
+			if (next == 0xFF) {
+				++position;
+			} else if (next == 0x00 ||
+				(next >= kJpegMarkerRST0 && next <= kJpegMarkerRST7)) {
+				position += 2;
+			} else {
+				break;
+			}
+		}
+		// More segments follow unless this was the last scan.
+		if (position[1] == kJpegMarkerEOI) {
+			return true;
+		}
+	}
+}
+
+// A histogram of durations in microseconds, in the style of HdrHistogram:
+// values below kExactValues are counted exactly, and every power-of-two range
+// above that is split into kExactValues / 2 buckets, so each value is
+// recorded with a relative error below 1.6% from 1us up to 2^36us.
+class LatencyHistogram {
 public:
-	// Puts all of the relevant variables into a raw byte buffer which is
-	// returned, ready to be sent as a packet over the network.
-	virtual std::vector<unsigned char> PackageData() const = 0;
+	LatencyHistogram();
 
-	// Unpacks a received data buffer into the appropriate variables, in
-	// accordance to the specific protocol being implemented.
-	virtual void UnpackData(
-		const std::vector<unsigned char>& raw_bytes) = 0;
+	// Counts one value. Negative values are counted as 0.
+	void Record(long long value_us);
+
+	// Returns the number of recorded values.
+	unsigned long long Count() const { return count_; }
+
+	// Returns the largest recorded value.
+	long long Max() const { return max_; }
+
+	// Returns the value below which the given percentage (0-100) of the
+	// recorded values fall, within the precision of the histogram.
+	long long ValueAtPercentile(const double percentile) const;
+
+private:
+	static const int kExactValues = 128;
+	static const int kSubBuckets = kExactValues / 2;
+	static const int kMaxShift = 30;
+
+	// Returns the bucket that the value is counted in.
+	static int BucketIndex(const long long value_us);
+
+	// Returns the highest value that is counted in the given bucket.
+	static long long BucketValue(const int index);
+
+	std::vector<unsigned long long> counts_;
+	unsigned long long count_;
+	long long max_;
+};  // LatencyHistogram
+
+LatencyHistogram::LatencyHistogram()
+	: counts_(kExactValues + kMaxShift * kSubBuckets, 0), count_(0), max_(0) {}
+
+int LatencyHistogram::BucketIndex(const long long value_us) {
+	if (value_us < kExactValues) {
+		return static_cast<int>(value_us);
+	}
+	// Shift the value down until it falls into [kSubBuckets, kExactValues).
+	int shift = 0;
+	while ((value_us >> shift) >= kExactValues && shift < kMaxShift) {
+		++shift;
+	}
+	const long long sub_bucket =
+		std::min<long long>(value_us >> shift, kExactValues - 1) - kSubBuckets;
+	return kExactValues + (shift - 1) * kSubBuckets + static_cast<int>(sub_bucket);
+}
+
+long long LatencyHistogram::BucketValue(const int index) {
+	if (index < kExactValues) {
+		return index;
+	}
+	const int shift = (index - kExactValues) / kSubBuckets + 1;
+	const long long sub_bucket = (index - kExactValues) % kSubBuckets;
+	return ((kSubBuckets + sub_bucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(long long value_us) {
+	if (value_us < 0) {
+		value_us = 0;
+	}
+	++counts_[BucketIndex(value_us)];
+	++count_;
+	if (value_us > max_) {
+		max_ = value_us;
+	}
+}
+
+long long LatencyHistogram::ValueAtPercentile(const double percentile) const {
+	if (count_ == 0) {
+		return 0;
+	}
+	const unsigned long long target = std::max<unsigned long long>(1,
+		static_cast<unsigned long long>(percentile / 100.0 * count_ + 0.5));
+	unsigned long long seen = 0;
+	for (size_t i = 0; i < counts_.size(); ++i) {
+		seen += counts_[i];
+		if (seen >= target) {
+			return std::min(BucketValue(static_cast<int>(i)), max_);
+		}
+	}
+	return max_;
+}
+
+// The per-stage latency histograms of one stream. Instances register
+// themselves, so that DumpLatencyStats() can print all of them on demand.
+class StreamLatencyStats {
+public:
+	explicit StreamLatencyStats(const std::string& name);
+
+	~StreamLatencyStats();
+
+	// Records how long the given stage took for one frame.
+	void Record(const PipelineStage stage, const long long duration_us);
+
+	// Sets a counter of the stream, such as the number of lost packets, which
+	// is printed along with the histograms.
+	void SetCount(const std::string& counter, const long long value);
+
+	// Prints a percentile table of every stage that has values, followed by
+	// the counters.
+	void Print(std::ostream& out) const;
+
+private:
+	const std::string name_;
+	LatencyHistogram histograms_[kNumPipelineStages];
+	std::map<std::string, long long> counts_;
+	mutable std::mutex mutex_;
+};  // StreamLatencyStats
+
+// All live StreamLatencyStats, guarded by the mutex.
+std::mutex latency_stats_mutex;
+std::vector<const StreamLatencyStats*> latency_stats;
+
+StreamLatencyStats::StreamLatencyStats(const std::string& name) : name_(name) {
+	std::lock_guard<std::mutex> lock(latency_stats_mutex);
+	latency_stats.push_back(this);
+}
+
+StreamLatencyStats::~StreamLatencyStats() {
+	std::lock_guard<std::mutex> lock(latency_stats_mutex);
+	latency_stats.erase(
+		std::remove(latency_stats.begin(), latency_stats.end(), this),
+		latency_stats.end());
+}
+
+void StreamLatencyStats::Record(
+	const PipelineStage stage, const long long duration_us) {
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	histograms_[stage].Record(duration_us);
+}
+
+void StreamLatencyStats::SetCount(
+	const std::string& counter, const long long value) {
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	counts_[counter] = value;
+}
+
+void StreamLatencyStats::Print(std::ostream& out) const {
+	static const double kPercentiles[] = { 50, 90, 99, 99.9 };
+	std::lock_guard<std::mutex> lock(mutex_);
+	out << "Latency of " << name_ << " in microseconds:" << std::endl;
+	out << "  stage           count      p50      p90      p99    p99.9      max"
+		<< std::endl;
+	for (int stage = 0; stage < kNumPipelineStages; ++stage) {
+		const LatencyHistogram& histogram = histograms_[stage];
+		if (histogram.Count() == 0) {
+			continue;
+		}
+		out << "  " << std::left << std::setw(12) << kPipelineStageNames[stage]
+			<< std::right << std::setw(9) << histogram.Count();
+		for (const double percentile : kPercentiles) {
+			out << std::setw(9) << histogram.ValueAtPercentile(percentile);
+		}
+		out << std::setw(9) << histogram.Max() << std::endl;
+	}
+	for (const auto& count : counts_) {
+		out << "  " << count.first << ": " << count.second << std::endl;
+	}
+}
+
+// Prints the latency histograms of all streams to stdout.
+void DumpLatencyStats() {
+	std::lock_guard<std::mutex> lock(latency_stats_mutex);
+	for (const StreamLatencyStats* stats : latency_stats) {
+		stats->Print(std::cout);
+	}
+}
+
+// Define ENABLE_TRACING (e.g. in the project's preprocessor definitions) to
+// record the begin and end of the hot functions of every thread. Without it,
+// the TRACE_* macros compile to nothing. The events are written as Chrome
+// trace-event JSON, which can be opened in Perfetto or chrome://tracing.
+#ifdef ENABLE_TRACING
+
+// Each thread records into its own buffer of this many events. Once it is
+// full, the oldest events are overwritten.
+constexpr size_t kTraceBufferEvents = 65536;
+
+// One complete ("X") trace event. The name must be a string literal.
+struct TraceEvent {
+	// 2 * (n + 1) once event n has been written into the slot, odd while the
+	// writer is filling it in.
+	std::atomic<unsigned long long> sequence;
+	const char* name;
+	long long start_us;
+	long long duration_us;
 };
 
-class ReceiverSocket {
+// The events of one thread. Only the owning thread writes to it, so writing
+// needs no lock; readers detect slots that are overwritten while they copy
+// them through the slot's sequence number.
+class TraceBuffer {
 public:
-	// Creates a new socket and stores the handle.
-	explicit ReceiverSocket(const int port_number);
+	explicit TraceBuffer(const unsigned long thread_id)
+		: events_(kTraceBufferEvents), thread_id_(thread_id), next_event_(0) {}
 
-	// Attempts to bind the socket on the port number provided to listen to
-	// incoming UDP packets. If the socket could not be created (in the
-	// constructor) or if the binding process fails, an error message will be
-	// printed to stderr. The method returns true on success, false otherwise.
-	const bool BindSocketToListen() const;
+	// Records an event. Only called by the owning thread.
+	void Add(const char* name, const long long start_us, const long long duration_us);
 
-	// Waits for the next packet on the given port, and returns vector of bytes
-	// (stored as unsigned chars) that contains the raw packet data.
-	const std::vector<unsigned char> GetPacket(std::string kWindowName) const;
+	// Sets the name shown for the thread. Only called by the owning thread,
+	// before it records any events.
+	void SetThreadName(const std::string& name) {
+		thread_name_ = name;
+	}
+
+	// Appends the thread's events to the JSON array being written.
+	void WriteJSON(std::ostream& out, const unsigned long process_id, bool* first) const;
 
 private:
-	// This buffer will be used to collect incoming packet data. It is only used
-	// in the GetPacket() method.
-	char buffer_[kMaxPacketBufferSize];
+	std::vector<TraceEvent> events_;
+	const unsigned long thread_id_;
+	std::string thread_name_;
 
-	// The port number that the socket will listen for packets on.
-	const int port_;
+	// The number of events recorded so far.
+	std::atomic<unsigned long long> next_event_;
+};  // TraceBuffer
 
-	// The socket identifier (handle).
-	int socket_handle_;
-};  // ReceiverSocket
+void TraceBuffer::Add(
+	const char* name, const long long start_us, const long long duration_us) {
 
-class VideoFrame {
+	const unsigned long long n = next_event_.load(std::memory_order_relaxed);
+	TraceEvent& event = events_[n % kTraceBufferEvents];
+	event.sequence.store(2 * n + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	event.name = name;
+	event.start_us = start_us;
+	event.duration_us = duration_us;
+	event.sequence.store(2 * n + 2, std::memory_order_release);
+	next_event_.store(n + 1, std::memory_order_release);
+}
+
+void TraceBuffer::WriteJSON(
+	std::ostream& out, const unsigned long process_id, bool* first) const {
+
+	if (!thread_name_.empty()) {
+		out << (*first ? "" : ",\n")
+			<< "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << process_id
+			<< ",\"tid\":" << thread_id_
+			<< ",\"args\":{\"name\":\"" << thread_name_ << "\"}}";
+		*first = false;
+	}
+	const unsigned long long end = next_event_.load(std::memory_order_acquire);
+	const unsigned long long begin =
+		end > kTraceBufferEvents ? end - kTraceBufferEvents : 0;
+	for (unsigned long long n = begin; n < end; ++n) {
+		const TraceEvent& event = events_[n % kTraceBufferEvents];
+		const unsigned long long sequence =
+			event.sequence.load(std::memory_order_acquire);
+		const char* name = event.name;
+		const long long start_us = event.start_us;
+		const long long duration_us = event.duration_us;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		// Skip the event if the writer has started to overwrite it.
+		if (sequence != 2 * n + 2 ||
+			event.sequence.load(std::memory_order_relaxed) != sequence) {
+			continue;
+		}
+		out << (*first ? "" : ",\n")
+			<< "{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":" << process_id
+			<< ",\"tid\":" << thread_id_ << ",\"ts\":" << start_us
+			<< ",\"dur\":" << duration_us << "}";
+		*first = false;
+	}
+}
+
+// The buffers of all threads that recorded events, guarded by the mutex. The
+// buffers are never freed, so events of finished threads can still be written.
+std::mutex trace_buffers_mutex;
+std::vector<TraceBuffer*> trace_buffers;
+
+// Returns the calling thread's buffer, creating it on first use.
+TraceBuffer* GetThreadTraceBuffer() {
+	thread_local TraceBuffer* buffer = nullptr;
+	if (buffer == nullptr) {
+		buffer = new TraceBuffer(GetCurrentThreadId());
+		std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+		trace_buffers.push_back(buffer);
+	}
+	return buffer;
+}
+
+// Records the time between its construction and destruction as one event.
+class TraceScope {
 public:
-	// Default constructor (required) just makes an empty image.
-	VideoFrame() {}
+	explicit TraceScope(const char* name)
+		: name_(name), start_us_(NowMicroseconds()) {}
 
-	// Initialize the video frame from an existing cv::Mat image.
-	explicit VideoFrame(const cv::Mat& image) : frame_image_(image) {}
+	~TraceScope() {
+		GetThreadTraceBuffer()->Add(name_, start_us_, NowMicroseconds() - start_us_);
+	}
 
-	// Initialize the video frame (image) from a buffer of raw bytes.
-	explicit VideoFrame(const std::vector<unsigned char> frame_bytes);
+private:
+	const char* name_;
+	const long long start_us_;
+};  // TraceScope
 
-	// Uses the underlying video/image/gui library to display the frame on the
-	// user's screen. Only one frame can be displayed at a time, as all frames
-	// will share the same GUI window.
-	void Display(std::string kWindowName);
+// Writes the events of all threads to the given file as Chrome trace-event
+// JSON.
+void WriteChromeTrace(const std::string& file_name) {
+	std::ofstream out(file_name.c_str());
+	if (!out) {
+		std::cerr << "Could not write trace to " << file_name << "." << std::endl;
+		return;
+	}
+	out << "{\"traceEvents\":[\n";
+	bool first = true;
+	{
+		std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+		for (const TraceBuffer* buffer : trace_buffers) {
+			buffer->WriteJSON(out, GetCurrentProcessId(), &first);
+		}
+	}
+	out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+	std::cout << "Trace written to " << file_name << "." << std::endl;
+}
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+// Records the rest of the enclosing scope as an event with the given name.
+#define TRACE_SCOPE(name) \
+	TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+// Names the calling thread in the trace.
+#define TRACE_THREAD_NAME(name) GetThreadTraceBuffer()->SetThreadName(name)
+
+// Writes all events recorded so far to the given file.
+#define TRACE_WRITE(file_name) WriteChromeTrace(file_name)
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_THREAD_NAME(name)
+#define TRACE_WRITE(file_name)
+
+#endif  // ENABLE_TRACING
+
+// Dumps the latency histograms, and the trace if tracing is enabled, when
+// Ctrl+Break is pressed in the console. Other events keep their default
+// handling.
+BOOL WINAPI OnConsoleControl(DWORD control_type) {
+	if (control_type == CTRL_BREAK_EVENT) {
+		DumpLatencyStats();
+		TRACE_WRITE(kTraceFileName);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+// Records the durations of the stages whose end times are in the trace.
+void RecordTracedStages(const FrameTrace& trace, StreamLatencyStats* stats) {
+	unsigned int stage_start_us = 0;
+	for (int stage = 0; stage < kNumTracedStages; ++stage) {
+		stats->Record(
+			static_cast<PipelineStage>(stage),
+			static_cast<int>(trace.stage_end_us[stage] - stage_start_us));
+		stage_start_us = trace.stage_end_us[stage];
+	}
+}
+
+// On machines with several NUMA nodes, the threads of a stream are kept on the
+// cores of one node, and its frames are allocated from that node's memory, so
+// that neither threads nor frames move across the nodes between the stages.
+
+// Returns the number of NUMA nodes, which is 1 unless kUseNumaPlacement is set.
+int NumaNodeCount() {
+	ULONG highest_node = 0;
+	if (!kUseNumaPlacement || !GetNumaHighestNodeNumber(&highest_node)) {
+		return 1;
+	}
+	return static_cast<int>(highest_node) + 1;
+}
+
+// Restricts the calling thread to the cores of the given node.
+void PinThreadToNode(const int node) {
+	if (!kUseNumaPlacement) {
+		return;
+	}
+	GROUP_AFFINITY affinity = {};
+	if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &affinity) ||
+		affinity.Mask == 0) {
+		return;
+	}
+	SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+}
+
+// Returns the node of the core that the calling thread is running on.
+int CurrentNumaNode() {
+	PROCESSOR_NUMBER processor;
+	GetCurrentProcessorNumberEx(&processor);
+	USHORT node = 0;
+	if (!GetNumaProcessorNodeEx(&processor, &node)) {
+		return 0;
+	}
+	return node;
+}
+
+// Freed frame buffers of up to this many bytes in total are kept per node for
+// the next frames, instead of being given back to the system.
+constexpr size_t kMaxPooledFrameBytes = 64 * 1024 * 1024;
+
+// Buffers are allocated in multiples of this, so that frames of about the same
+// size can reuse each other's buffers.
+constexpr size_t kFrameBufferGranularity = 64 * 1024;
+
+// Allocates the pixels of cv::Mat images from the memory of one NUMA node.
+// Set it as the allocator of a cv::Mat before the image is created in it.
+// Freed buffers are pooled, so that a stream's frames keep reusing the same
+// node-local pages.
+class NumaFrameAllocator : public cv::MatAllocator {
+public:
+	explicit NumaFrameAllocator(const int node) : node_(node), pooled_bytes_(0) {}
+
+	cv::UMatData* allocate(
+		int dims,
+		const int* sizes,
+		int type,
+		void* data,
+		size_t* step,
+		int flags,
+		cv::UMatUsageFlags usage_flags) const override;
+
+	bool allocate(
+		cv::UMatData* data, int access_flags, cv::UMatUsageFlags usage_flags) const override;
+
+	void deallocate(cv::UMatData* data) const override;
+
+private:
+	const int node_;
+
+	// The freed buffers by size, guarded by the mutex.
+	mutable std::mutex mutex_;
+	mutable std::multimap<size_t, void*> free_buffers_;
+	mutable size_t pooled_bytes_;
+};  // NumaFrameAllocator
+
+cv::UMatData* NumaFrameAllocator::allocate(
+	int dims,
+	const int* sizes,
+	int type,
+	void* data,
+	size_t* step,
+	int /* flags */,
+	cv::UMatUsageFlags /* usage_flags */) const {
+
+	// Compute the steps the way the default allocator does.
+	size_t total = CV_ELEM_SIZE(type);
+	for (int i = dims - 1; i >= 0; --i) {
+		if (step) {
+			if (data && step[i] != CV_AUTOSTEP) {
+				total = step[i];
+			} else {
+				step[i] = total;
+			}
+		}
+		total *= sizes[i];
+	}
+	cv::UMatData* u = new cv::UMatData(this);
+	u->size = total;
+	if (data) {
+		u->data = u->origdata = static_cast<unsigned char*>(data);
+		u->flags |= cv::UMatData::USER_ALLOCATED;
+		return u;
+	}
+	const size_t buffer_size = (total + kFrameBufferGranularity - 1) /
+		kFrameBufferGranularity * kFrameBufferGranularity;
+	void* buffer = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		const auto pooled = free_buffers_.find(buffer_size);
+		if (pooled != free_buffers_.end()) {
+			buffer = pooled->second;
+			free_buffers_.erase(pooled);
+			pooled_bytes_ -= buffer_size;
+		}
+	}
+	if (!buffer) {
+		buffer = VirtualAllocExNuma(
+			GetCurrentProcess(), nullptr, buffer_size,
+			MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, static_cast<DWORD>(node_));
+	}
+	if (!buffer) {
+		// The node is out of memory, so take it from anywhere.
+		buffer = VirtualAlloc(nullptr, buffer_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	}
+	if (!buffer) {
+		delete u;
+		throw std::bad_alloc();
+	}
+	u->data = u->origdata = static_cast<unsigned char*>(buffer);
+	return u;
+}
+
+bool NumaFrameAllocator::allocate(
+	cv::UMatData* data, int /* access_flags */, cv::UMatUsageFlags /* usage_flags */) const {
+	return data != nullptr;
+}
+
+void NumaFrameAllocator::deallocate(cv::UMatData* data) const {
+	if (!data) {
+		return;
+	}
+	if (!(data->flags & cv::UMatData::USER_ALLOCATED)) {
+		const size_t buffer_size = (data->size + kFrameBufferGranularity - 1) /
+			kFrameBufferGranularity * kFrameBufferGranularity;
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (pooled_bytes_ + buffer_size <= kMaxPooledFrameBytes) {
+			free_buffers_.insert(std::make_pair(buffer_size, data->origdata));
+			pooled_bytes_ += buffer_size;
+		} else {
+			lock.unlock();
+			VirtualFree(data->origdata, 0, MEM_RELEASE);
+		}
+	}
+	delete data;
+}
+
+// Returns the frame allocator of the node that the calling thread is running
+// on, or nullptr for the default allocator if kUseNumaPlacement is not set.
+cv::MatAllocator* GetLocalFrameAllocator() {
+	static std::vector<std::unique_ptr<NumaFrameAllocator>>* allocators = [] {
+		std::vector<std::unique_ptr<NumaFrameAllocator>>* allocators =
+			new std::vector<std::unique_ptr<NumaFrameAllocator>>();
+		for (int node = 0; node < NumaNodeCount(); ++node) {
+			allocators->push_back(
+				std::unique_ptr<NumaFrameAllocator>(new NumaFrameAllocator(node)));
+		}
+		return allocators;
+	}();
+	if (!kUseNumaPlacement) {
+		return nullptr;
+	}
+	const size_t node = static_cast<size_t>(CurrentNumaNode());
+	return node < allocators->size() ? (*allocators)[node].get() : nullptr;
+}
+
+class ProtocolData {
+public:
+	// Puts all of the relevant variables into a raw byte buffer which is
+	// returned, ready to be sent as a packet over the network.
+	virtual std::vector<unsigned char> PackageData() const = 0;
+
+	// Unpacks a received data buffer into the appropriate variables, in
+	// accordance to the specific protocol being implemented.
+	virtual void UnpackData(
+		const std::vector<unsigned char>& raw_bytes) = 0;
+};
+
+// The interface that every transport implements, so the receiving loop does
+// not need to know whether frames arrive through a UDP socket or a
+// shared-memory ring.
+class PacketReceiver {
+public:
+	virtual ~PacketReceiver() {}
+
+	// Prepares the transport for receiving. Returns true on success.
+	virtual const bool BindSocketToListen() const = 0;
+
+	// Waits for the next packet, and returns vector of bytes (stored as
+	// unsigned chars) that contains the raw packet data. If nothing arrives in
+	// time, the idle picture is shown in the given window, unless its name is
+	// empty, and the returned vector is empty.
+	virtual const std::vector<unsigned char> GetPacket(
+		std::string kWindowName) const = 0;
+};
+
+class ReceiverSocket : public PacketReceiver {
+public:
+	// Creates a new socket and stores the handle.
+	explicit ReceiverSocket(const int port_number);
+
+	// Attempts to bind the socket on the port number provided to listen to
+	// incoming UDP packets. If the socket could not be created (in the
+	// constructor) or if the binding process fails, an error message will be
+	// printed to stderr. The method returns true on success, false otherwise.
+	const bool BindSocketToListen() const override;
+
+	// Waits for the next packet on the given port, and returns vector of bytes
+	// (stored as unsigned chars) that contains the raw packet data.
+	//
+	// With kUseBusyPoll, it spins for the packet before it waits for it.
+	const std::vector<unsigned char> GetPacket(
+		std::string kWindowName) const override;
+
+	// Returns the next packet if one is waiting, without waiting for it, or an
+	// empty vector otherwise. The packet is received into the given buffer,
+	// which must hold kMaxPacketBufferSize bytes, so that sockets that are
+	// only read this way need no buffer of their own.
+	std::vector<unsigned char> TryGetPacket(char* buffer) const;
+
+	// Returns when the kernel received the packet that was returned last, on
+	// the NowMicroseconds() clock, or 0 if that is not known.
+	long long KernelArrivalTimeUs() const {
+		return kernel_arrival_time_us_;
+	}
+
+	// Returns the socket handle, e.g. to wait for it to become readable.
+	SOCKET handle() const {
+		return socket_handle_;
+	}
+
+	// Sends a feedback report back to the address that the last packet came
+	// from. Does nothing until a packet has been received.
+	void SendFeedback(const std::vector<unsigned char>& report) const;
+
+private:
+	// Receives the next packet into the given buffer and stores the address it
+	// came from. Returns the packet size, or a value <= 0 if there was none.
+	int Receive(char* buffer, sockaddr_in* remote_addr) const;
+
+	// The address of the sender of the last packet, where feedback goes.
+	mutable sockaddr_in sender_addr_;
+	mutable bool has_sender_addr_;
+
+	// When GetPacket() last returned a packet. Busy polling goes on until
+	// kBusyPollSpinUs after it.
+	mutable long long last_packet_time_us_;
+
+	// The kernel timestamp of the last packet, see KernelArrivalTimeUs().
+	mutable long long kernel_arrival_time_us_;
+
+#ifdef SIO_TIMESTAMPING
+	// WSARecvMsg(), which also receives the kernel timestamps. This is only set
+	// once BindSocketToListen() has turned the timestamps on.
+	mutable LPFN_WSARECVMSG receive_message_;
+#endif
+
+	// This buffer will be used to collect incoming packet data. It is only used
+	// in the GetPacket() method, and allocated when that is first called.
+	mutable std::vector<char> buffer_;
+
+	// The port number that the socket will listen for packets on.
+	const int port_;
+
+	// The socket identifier (handle).
+	int socket_handle_;
+};  // ReceiverSocket
+
+class VideoFrame {
+public:
+	// Default constructor (required) just makes an empty image.
+	VideoFrame() {}
+
+	// Initialize the video frame from an existing cv::Mat image.
+	explicit VideoFrame(const cv::Mat& image) : frame_image_(image) {}
+
+	// Initialize the video frame (image) from a buffer of raw bytes.
+	explicit VideoFrame(const std::vector<unsigned char> frame_bytes);
+
+	// Initialize the video frame (image) by decoding the raw bytes in place,
+	// without copying them first.
+	VideoFrame(const unsigned char* frame_bytes, const size_t num_bytes);
+
+	// Uses the underlying video/image/gui library to display the frame on the
+	// user's screen. Only one frame can be displayed at a time, as all frames
+	// will share the same GUI window. Returns the key that was pressed while
+	// the window processed its events, or -1.
+	int Display(std::string kWindowName);
+
+	// Like Display(), but gives the window only delay_ms to process its events.
+	int Display(std::string kWindowName, const int delay_ms);
 
 	// Returns the raw byte representation of the given video frame. Singe image
 	// compression to JPEG is also handled here to minimize the frame size.
 	std::vector<unsigned char> GetJPEG() const;
 
-private:
-	cv::Mat frame_image_;
+	// Returns the decoded image, which is empty if decoding failed.
+	const cv::Mat& GetImage() const {
+		return frame_image_;
+	}
+
+private:
+	cv::Mat frame_image_;
+};
+
+class VideoCapture {
+public:
+	// Initializes the OpenCV VideoCapture object by selecting the default
+	// camera. If no camera is provided it will not be possile to read any video
+	// frames.
+	//
+	// Specify whether or not the video being sent is displayed in a window, and
+	// the scale = (0, 1] which will affect the size of the data.
+	VideoCapture(const bool show_video, const float scale);
+
+	// Captures and returns a frame from the available video camera.
+	//
+	// If the show_video option was set to true, the frame will be displayed.
+	//
+	// NOTE: This method cannot be const, since the cv::VideoCapture object is
+	// modified through a non-const method when getting a new frame from the
+	// camera.
+	VideoFrame GetFrameFromCamera();
+
+private:
+	// The OpenCV camera capture object. This is used to interface with a
+	// connected camera and extract frames from it.
+	cv::VideoCapture capture_;
+
+	// The image scale should be between (0 and 1]. The image will be
+	// downsampled by the given amount to reduce cost of sending the data.
+	const float scale_;
+
+	// Set to true to show the video.
+	const bool show_video_;
+};
+
+VideoCapture::VideoCapture(const bool show_video, const float scale)
+	: show_video_(show_video), scale_(scale), capture_(cv::VideoCapture(0)) {
+
+	// TODO: Verify that the scale is in the appropriate range.
+}
+
+
+
+// The name of the window in which all frames will be displayed. If a new frame
+// is displayed, it will replace the previous frame displayed in that window.
+std::string kWindowName_id1 = "Streaming Video";
+std::string kWindowName_id2 = "Streaming Video";
+std::string kWindowName_id3 = "Streaming Video";
+
+// Delays thread execution for this amount of time after a frame is displayed.
+// This prevents the window from being refreshed too often, which can cause
+// display issues.
+constexpr int kDisplayDelayTimeMS = 15;
+
+// JPEG compression values.
+static const std::string kJPEGExtension = ".jpg";
+constexpr int kJPEGQuality = 90;
+
+
+VideoFrame::VideoFrame(const std::vector<unsigned char> frame_bytes) {
+	TRACE_SCOPE("decode JPEG");
+	if (!IsWellFormedJPEG(frame_bytes.data(), frame_bytes.size())) {
+		return;
+	}
+	frame_image_.allocator = GetLocalFrameAllocator();
+	cv::imdecode(frame_bytes, cv::IMREAD_COLOR, &frame_image_);
+}
+
+VideoFrame::VideoFrame(
+	const unsigned char* frame_bytes, const size_t num_bytes) {
+
+	TRACE_SCOPE("decode JPEG");
+	if (!IsWellFormedJPEG(frame_bytes, num_bytes)) {
+		return;
+	}
+	// The cv::Mat only wraps the bytes, so nothing is copied before decoding.
+	const cv::Mat encoded(
+		1,
+		static_cast<int>(num_bytes),
+		CV_8UC1,
+		const_cast<unsigned char*>(frame_bytes));
+	frame_image_.allocator = GetLocalFrameAllocator();
+	cv::imdecode(encoded, cv::IMREAD_COLOR, &frame_image_);
+}
+
+int VideoFrame::Display(std::string kWindowName)  {
+	return Display(kWindowName, kDisplayDelayTimeMS);
+}
+
+int VideoFrame::Display(std::string kWindowName, const int delay_ms) {
+	TRACE_SCOPE("display");
+	// Do nothing for empty images.
+	if (frame_image_.empty()) {
+		return -1;
+	}
+
+	cv::namedWindow(kWindowName, CV_WINDOW_NORMAL);
+
+	SYSTEMTIME sys;	GetLocalTime(&sys);
+
+	std::string hour = std::to_string(sys.wHour);
+	std::string min = std::to_string(sys.wMinute);
+	std::string sec = std::to_string(sys.wSecond);
+	std::string ms = std::to_string(sys.wMilliseconds);
+	std::string text = hour + ":" + min + ":" + sec + "." + ms;
+	cv::putText(frame_image_, text, cv::Point2f(16, 40), cv::FONT_HERSHEY_COMPLEX_SMALL, 1.6, cv::Scalar(0, 0, 255), 2);
+	cv::imshow(kWindowName, frame_image_);
+	return cv::waitKey(delay_ms);
+}
+
+std::vector<unsigned char> VideoFrame::GetJPEG() const {
+	const std::vector<int> compression_params = {
+		cv::IMWRITE_JPEG_QUALITY,
+		kJPEGQuality
+	};
+	std::vector<unsigned char> data_buffer;
+	cv::imencode(kJPEGExtension, frame_image_, data_buffer, compression_params);
+	return data_buffer;
+}
+
+class BasicProtocolData : public ProtocolData {
+public:
+	std::vector<unsigned char> PackageData() const;
+
+	void UnpackData(
+		const std::vector<unsigned char>& raw_bytes) override;
+
+	// Sets the next video frame.
+	void SetImage(const VideoFrame& image) {
+		video_frame_ = image;
+	}
+
+	// Returns the video frame image.
+	VideoFrame GetImage() const {
+		return video_frame_;
+	}
+
+private:
+	// The video frame received from the packet is stored here.
+	VideoFrame video_frame_;
+};
+
+std::vector<unsigned char> BasicProtocolData::PackageData() const {
+	return video_frame_.GetJPEG();
+}
+
+void BasicProtocolData::UnpackData(
+	const std::vector<unsigned char>& raw_bytes) {
+	if (!raw_bytes.empty())
+	{
+		video_frame_ = VideoFrame(raw_bytes);
+	}
+	else
+	{
+		video_frame_ = VideoFrame();
+	}
+}
+
+ReceiverSocket::ReceiverSocket(const int port_number)
+	: has_sender_addr_(false), last_packet_time_us_(0),
+	  kernel_arrival_time_us_(0), port_(port_number) {
+	socket_handle_ = socket(AF_INET, SOCK_DGRAM, 0);
+#ifdef SIO_TIMESTAMPING
+	receive_message_ = nullptr;
+#endif
+}
+
+const bool ReceiverSocket::BindSocketToListen() const {
+	if (socket_handle_ == INVALID_SOCKET) {
+		std::cerr << "Binding failed. Socket was not initialized." << std::endl;
+		return false;
+	}
+
+	//设置为非阻塞模式  
+	int imode = 1;
+	int rev = 0;
+
+	rev = ioctlsocket(socket_handle_, FIONBIO, (u_long *)&imode);//设置为非阻塞模式
+	if (rev == SOCKET_ERROR)
+	{
+		printf("ioctlsocket failed!");
+		closesocket(socket_handle_);
+		WSACleanup();
+		exit(-1);
+	}
+
+	// Frames arrive as bursts of fragments, which must not overflow the
+	// default receive buffer.
+	const int receive_buffer_size = kReceiveBufferSize;
+	setsockopt(
+		socket_handle_, SOL_SOCKET, SO_RCVBUF,
+		reinterpret_cast<const char*>(&receive_buffer_size),
+		sizeof(receive_buffer_size));
+
+#ifdef SO_BUSY_POLL
+	// Where the system supports it, the kernel polls the device queue too
+	// while the socket is read, instead of waiting for the interrupt.
+	if (kUseBusyPoll) {
+		const int busy_poll_us = static_cast<int>(kBusyPollSpinUs);
+		setsockopt(
+			socket_handle_, SOL_SOCKET, SO_BUSY_POLL,
+			reinterpret_cast<const char*>(&busy_poll_us), sizeof(busy_poll_us));
+	}
+#endif
+
+#ifdef SIO_TIMESTAMPING
+	// The timestamps come with the packets as control data, which only
+	// WSARecvMsg() can receive. Without it, the packets are read as usual.
+	if (kUseKernelTimestamps) {
+		TIMESTAMPING_CONFIG config = {};
+		config.Flags = TIMESTAMPING_FLAG_RX;
+		GUID receive_message_id = WSAID_WSARECVMSG;
+		LPFN_WSARECVMSG receive_message = nullptr;
+		DWORD num_bytes = 0;
+		if (WSAIoctl(
+				socket_handle_, SIO_GET_EXTENSION_FUNCTION_POINTER,
+				&receive_message_id, sizeof(receive_message_id),
+				&receive_message, sizeof(receive_message),
+				&num_bytes, nullptr, nullptr) == 0 &&
+			WSAIoctl(
+				socket_handle_, SIO_TIMESTAMPING, &config, sizeof(config),
+				nullptr, 0, &num_bytes, nullptr, nullptr) == 0) {
+			receive_message_ = receive_message;
+		}
+	}
+#endif
+
+	// Bind socket's address to INADDR_ANY because it's only receiving data, and
+	// does not need a valid address.
+	sockaddr_in socket_addr;
+	memset(reinterpret_cast<char*>(&socket_addr), 0, sizeof(socket_addr));
+	socket_addr.sin_family = AF_INET;
+	socket_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	// Bind the socket to the port that will be listened on.
+	socket_addr.sin_port = htons(port_);
+	const int bind_status = bind(
+		socket_handle_,
+		reinterpret_cast<sockaddr*>(&socket_addr),
+		sizeof(socket_addr));
+	if (bind_status < 0) {
+		std::cerr << "Binding failed. Could not bind the socket." << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+// Shows the default wallpaper picture in the given window. This is used while
+// no video data is arriving.
+void ShowIdlePicture(const std::string& kWindowName) {
+	cv::Mat picture = cv::imread("our_team.jpg");
+	cv::namedWindow(kWindowName, CV_WINDOW_NORMAL);
+
+	cv::imshow(kWindowName, picture);
+	cv::waitKey(kDisplayDelayTimeMS);
+}
+
+const std::vector<unsigned char> ReceiverSocket::GetPacket(std::string kWindowName) const {
+	TRACE_SCOPE("receive packet");
+	buffer_.resize(kMaxPacketBufferSize);
+	if (kUseBusyPoll) {
+		TRACE_SCOPE("busy poll");
+		while (NowMicroseconds() - last_packet_time_us_ < kBusyPollSpinUs) {
+			std::vector<unsigned char> data = TryGetPacket(buffer_.data());
+			if (!data.empty()) {
+				last_packet_time_us_ = NowMicroseconds();
+				return data;
+			}
+			YieldProcessor();
+		}
+	}
+	// Get the data from the next incoming packet.
+	fd_set rfd;                       //描述符集 这个将用来测试有没有一个可用的连接
+	struct timeval timeout;			 //设置select等待时间
+	timeout.tv_sec = 1;               //select需要用到这个
+	timeout.tv_usec = 0;              //timeout设置为0，可以理解为非阻塞
+	int SelectRcv;
+
+	//UDP数据接收
+	FD_ZERO(&rfd);					//总是这样先清空一个描述符集
+	FD_SET(socket_handle_, &rfd);		//把sock放入要测试的描述符集
+	SelectRcv = select(socket_handle_ + 1, &rfd, 0, 0, &timeout); //检查该套接字是否可读
+	if (FD_ISSET(socket_handle_, &rfd))//如果套接字句柄还在fd_set里，说明客户端已经有connect的请求发过来了，马上可以accept成功
+	{
+		std::vector<unsigned char> data = TryGetPacket(buffer_.data());
+		if (!data.empty()) {
+			last_packet_time_us_ = NowMicroseconds();
+		}
+		return data;
+	}
+		else
+		{
+			if (!kWindowName.empty()) {
+				ShowIdlePicture(kWindowName);
+			}
+
+			std::vector<unsigned char> data;
+
+			data.clear();
+			//frame_image_.clear();
+
+			return data;
+		}
+	
+
+}
+
+int ReceiverSocket::Receive(char* buffer, sockaddr_in* remote_addr) const {
+#ifdef SIO_TIMESTAMPING
+	if (receive_message_ != nullptr) {
+		WSABUF data_buffer;
+		data_buffer.buf = buffer;
+		data_buffer.len = kMaxPacketBufferSize;
+		alignas(WSACMSGHDR) char control[WSA_CMSG_SPACE(sizeof(UINT64))];
+		WSAMSG message = {};
+		message.name = reinterpret_cast<LPSOCKADDR>(remote_addr);
+		message.namelen = sizeof(*remote_addr);
+		message.lpBuffers = &data_buffer;
+		message.dwBufferCount = 1;
+		message.Control.buf = control;
+		message.Control.len = sizeof(control);
+		DWORD num_bytes = 0;
+		if (receive_message_(
+				socket_handle_, &message, &num_bytes, nullptr, nullptr) != 0) {
+			return -1;
+		}
+		for (WSACMSGHDR* header = WSA_CMSG_FIRSTHDR(&message);
+			header != nullptr; header = WSA_CMSG_NXTHDR(&message, header)) {
+			if (header->cmsg_level == SOL_SOCKET &&
+				header->cmsg_type == SO_TIMESTAMP) {
+				UINT64 timestamp;
+				memcpy(&timestamp, WSA_CMSG_DATA(header), sizeof(timestamp));
+				kernel_arrival_time_us_ = QpcToMicroseconds(timestamp);
+			}
+		}
+		return static_cast<int>(num_bytes);
+	}
+#endif
+	socklen_t addrlen = sizeof(*remote_addr);
+	return recvfrom(
+		socket_handle_,
+		buffer,
+		kMaxPacketBufferSize,
+		0,
+		reinterpret_cast<sockaddr*>(remote_addr),
+		&addrlen);
+}
+
+std::vector<unsigned char> ReceiverSocket::TryGetPacket(char* buffer) const {
+	sockaddr_in remote_addr;
+	kernel_arrival_time_us_ = 0;
+	const int num_bytes = Receive(buffer, &remote_addr);
+	// Copy the data (if any) into the data vector.
+	std::vector<unsigned char> data;
+	if (num_bytes > 0) {
+		data.insert(data.end(), &buffer[0], &buffer[num_bytes]);
+		sender_addr_ = remote_addr;
+		has_sender_addr_ = true;
+	}
+	return data;
+}
+
+void ReceiverSocket::SendFeedback(
+	const std::vector<unsigned char>& report) const {
+
+	TRACE_SCOPE("send feedback");
+	if (!has_sender_addr_) {
+		return;
+	}
+	sendto(
+		socket_handle_,
+		reinterpret_cast<const char*>(report.data()),
+		static_cast<int>(report.size()),
+		0,
+		reinterpret_cast<const sockaddr*>(&sender_addr_),
+		sizeof(sender_addr_));
+}
+
+// The layout of the shared-memory ring. The same layout is declared in
+// sender.cpp, and both sides must agree on it.
+struct SharedMemoryRingHeader {
+	// Number of frames published so far. Frame n lives in slot
+	// n % kSharedMemorySlotCount.
+	volatile LONG64 write_count;
+};
+
+struct SharedMemorySlotHeader {
+	// Odd while the slot is being written, 2 * (n + 1) once frame n has been
+	// completely written. Readers check it before and after reading the slot
+	// to detect frames that were overwritten underneath them.
+	volatile LONG64 sequence;
+
+	// Number of valid frame bytes that follow this header.
+	volatile LONG size;
+};
+
+constexpr size_t kSharedMemorySlotStride =
+	sizeof(SharedMemorySlotHeader) + kSharedMemorySlotSize;
+constexpr size_t kSharedMemoryRingSize =
+	sizeof(SharedMemoryRingHeader) + kSharedMemorySlotCount * kSharedMemorySlotStride;
+
+// Returns the name of the shared-memory section (or of its event, if a suffix
+// is given) used for the stream on the given port.
+std::string SharedMemoryName(const int port, const std::string &suffix) {
+	return "Local\\streaming-udp-video-" + std::to_string(port) + suffix;
+}
+
+// Receives frames from a sender running on the same machine through the
+// shared-memory ring written by the SharedMemorySender in sender.cpp. Only
+// the newest frame is of interest, so frames that were overwritten before they
+// could be read are skipped.
+class SharedMemoryReceiver : public PacketReceiver {
+public:
+	// Stores the port number. The ring is opened in BindSocketToListen().
+	explicit SharedMemoryReceiver(const int port_number);
+
+	~SharedMemoryReceiver();
+
+	// Creates (or opens, if the sender was started first) the ring and its
+	// notification event. Returns true on success.
+	const bool BindSocketToListen() const override;
+
+	// Waits for the next frame and copies it out of the ring.
+	const std::vector<unsigned char> GetPacket(
+		std::string kWindowName) const override;
+
+	// Waits for the next frame and decodes it directly from the ring, without
+	// copying the encoded bytes. Returns an empty frame on timeout, or if the
+	// sender overwrote the slot while it was being decoded. The sender's stages
+	// and the decode stage are recorded in the latency stats.
+	VideoFrame GetFrame(
+		std::string kWindowName, StreamLatencyStats* latency_stats) const;
+
+private:
+	// Waits up to a second for a complete frame, and returns a pointer to its
+	// slot. Returns nullptr (after showing the idle picture) on timeout.
+	const SharedMemorySlotHeader* WaitForSlot(
+		std::string kWindowName, LONG64* sequence) const;
+
+	// The port number identifying the stream's ring.
+	const int port_;
+
+	// Handles to the shared-memory section and the notification event. These
+	// are set up in BindSocketToListen().
+	mutable HANDLE mapping_handle_;
+	mutable HANDLE event_handle_;
+
+	// The start of the mapped ring.
+	mutable unsigned char* ring_;
+
+	// The number of the next frame to read.
+	mutable LONG64 read_count_;
+};  // SharedMemoryReceiver
+
+SharedMemoryReceiver::SharedMemoryReceiver(const int port_number)
+	: port_(port_number), mapping_handle_(NULL), event_handle_(NULL),
+	ring_(nullptr), read_count_(0) {}
+
+SharedMemoryReceiver::~SharedMemoryReceiver() {
+	if (ring_ != nullptr) {
+		UnmapViewOfFile(ring_);
+	}
+	if (event_handle_ != NULL) {
+		CloseHandle(event_handle_);
+	}
+	if (mapping_handle_ != NULL) {
+		CloseHandle(mapping_handle_);
+	}
+}
+
+const bool SharedMemoryReceiver::BindSocketToListen() const {
+	mapping_handle_ = CreateFileMapping(
+		INVALID_HANDLE_VALUE,
+		NULL,
+		PAGE_READWRITE,
+		0,
+		static_cast<DWORD>(kSharedMemoryRingSize),
+		SharedMemoryName(port_, "").c_str());
+	event_handle_ = CreateEvent(
+		NULL, FALSE, FALSE, SharedMemoryName(port_, "-event").c_str());
+	if (mapping_handle_ == NULL || event_handle_ == NULL) {
+		std::cerr << "Binding failed. Could not create the shared-memory ring."
+			<< std::endl;
+		return false;
+	}
+	ring_ = static_cast<unsigned char*>(MapViewOfFile(
+		mapping_handle_, FILE_MAP_ALL_ACCESS, 0, 0, kSharedMemoryRingSize));
+	if (ring_ == nullptr) {
+		std::cerr << "Binding failed. Could not map the shared-memory ring."
+			<< std::endl;
+		return false;
+	}
+	// Start with the newest frame, not with whatever is left in the ring.
+	read_count_ =
+		reinterpret_cast<SharedMemoryRingHeader*>(ring_)->write_count;
+	return true;
+}
+
+const SharedMemorySlotHeader* SharedMemoryReceiver::WaitForSlot(
+	std::string kWindowName, LONG64* sequence) const {
+
+	TRACE_SCOPE("wait for slot");
+	const SharedMemoryRingHeader* ring_header =
+		reinterpret_cast<const SharedMemoryRingHeader*>(ring_);
+	while (true) {
+		const LONG64 write_count = ring_header->write_count;
+		if (read_count_ >= write_count) {
+			// Nothing new yet, so wait for the sender's notification.
+			if (WaitForSingleObject(event_handle_, 1000) == WAIT_TIMEOUT) {
+				ShowIdlePicture(kWindowName);
+				return nullptr;
+			}
+			continue;
+		}
+		// Skip straight to the newest frame if the reader fell behind.
+		read_count_ = write_count - 1;
+		const SharedMemorySlotHeader* slot =
+			reinterpret_cast<const SharedMemorySlotHeader*>(
+				ring_ + sizeof(SharedMemoryRingHeader) +
+				(read_count_ % kSharedMemorySlotCount) * kSharedMemorySlotStride);
+		*sequence = slot->sequence;
+		++read_count_;
+		if (*sequence == 2 * (read_count_ - 1) + 2) {
+			return slot;
+		}
+	}
+}
+
+const std::vector<unsigned char> SharedMemoryReceiver::GetPacket(
+	std::string kWindowName) const {
+
+	std::vector<unsigned char> data;
+	LONG64 sequence = 0;
+	const SharedMemorySlotHeader* slot = WaitForSlot(kWindowName, &sequence);
+	if (slot == nullptr) {
+		return data;
+	}
+	// The sender may be rewriting the slot, so its size is read only once,
+	// and only trusted as far as the slot reaches.
+	const LONG size = slot->size;
+	if (size < static_cast<LONG>(kPacketHeaderSize) || size > kSharedMemorySlotSize) {
+		return data;
+	}
+	const unsigned char* frame_bytes =
+		reinterpret_cast<const unsigned char*>(slot + 1);
+	data.insert(data.end(), frame_bytes, frame_bytes + size);
+	// Drop the copy if the sender reused the slot while it was being copied.
+	if (slot->sequence != sequence) {
+		data.clear();
+	}
+	return data;
+}
+
+VideoFrame SharedMemoryReceiver::GetFrame(
+	std::string kWindowName, StreamLatencyStats* latency_stats) const {
+
+	LONG64 sequence = 0;
+	const SharedMemorySlotHeader* slot = WaitForSlot(kWindowName, &sequence);
+	if (slot == nullptr) {
+		return VideoFrame();
+	}
+	// Frames are never fragmented in the ring, so the frame bytes follow the
+	// packet header directly. Frames in the ring are never abbreviated, so
+	// only the fragment info and the trace come between.
+	const size_t header_size = kPacketHeaderSize + kFragmentInfoSize + kFrameTraceSize;
+	// The sender may be rewriting the slot, so its size is read only once,
+	// and only trusted as far as the slot reaches.
+	const LONG slot_size = slot->size;
+	if (slot_size < static_cast<LONG>(header_size) || slot_size > kSharedMemorySlotSize) {
+		return VideoFrame();
+	}
+	const size_t size = static_cast<size_t>(slot_size);
+	const unsigned char* packet =
+		reinterpret_cast<const unsigned char*>(slot + 1);
+	PacketHeader header;
+	FrameTrace trace;
+	if (!ReadPacketHeader(packet, size, &header) ||
+		header.type != kPacketTypeFrame || header.fragment_count != 1 ||
+		!ReadFrameTrace(
+			packet + kPacketHeaderSize + kFragmentInfoSize,
+			size - kPacketHeaderSize - kFragmentInfoSize,
+			&trace)) {
+		return VideoFrame();
+	}
+	// Do not decode a frame that was overwritten already.
+	if (slot->sequence != sequence) {
+		return VideoFrame();
+	}
+	const long long decode_start_us = NowMicroseconds();
+	const VideoFrame video_frame(packet + header_size, size - header_size);
+	// Drop the frame if the sender reused the slot while it was being decoded.
+	if (slot->sequence != sequence) {
+		return VideoFrame();
+	}
+	RecordTracedStages(trace, latency_stats);
+	latency_stats->Record(kStageSend, static_cast<int>(header.send_time_us -
+		(trace.capture_start_us + trace.stage_end_us[kStagePacketize])));
+	latency_stats->Record(kStageDecode, NowMicroseconds() - decode_start_us);
+	return video_frame;
+}
+
+// A packet that arrived, with its parsed header.
+struct SequencedPacket {
+	PacketHeader header;
+	std::vector<unsigned char> data;
+	long long arrival_time_us;
+};
+
+// What the PacketSequencer made of an arriving packet.
+enum class SequenceVerdict {
+	// The packet is new, and is or will be handed out in sequence order.
+	kAccepted,
+	// The packet arrived before, so it is dropped.
+	kDuplicate,
+	// The packets after it were handed out already, so it is dropped.
+	kTooLate,
+	// The sequence numbers jumped so far that the sender must have restarted.
+	// Everything before was forgotten, and the packet is accepted.
+	kRestarted,
+};
+
+// Puts the packets of one stream back into sequence order. A packet that
+// arrives ahead of a missing one is held until the gap is filled, or until
+// kReorderWindowPackets packets are held or the oldest has waited for
+// kMaxReorderDelayUs, at which point the missing packets count as lost.
+// Duplicates are recognized with a bitmap of the last kSequenceWindow
+// sequence numbers.
+class PacketSequencer {
+public:
+	PacketSequencer() {
+		Reset();
+	}
+
+	// Takes a packet that just arrived, and appends the packets that are now
+	// in order to ready. That can be none, if an earlier one is missing.
+	SequenceVerdict AddPacket(
+		SequencedPacket packet, std::vector<SequencedPacket>* ready);
+
+	// Gives up waiting for missing packets if the held ones have waited long
+	// enough, and appends them to ready. Call this when no packet arrives.
+	void Flush(const long long now_us, std::vector<SequencedPacket>* ready);
+
+	// Puts the loss and reordering counters into the stream's stats.
+	void ReportStats(StreamLatencyStats* stats) const;
+
+private:
+	void Reset();
+
+	// Hands out the held packets that are next in sequence.
+	void Release(std::vector<SequencedPacket>* ready);
+
+	// Skips the gap in front of the oldest held packet, counting it as lost,
+	// and hands out the packets that are then in sequence.
+	void SkipGap(std::vector<SequencedPacket>* ready);
+
+	bool started_;
+
+	// The highest sequence number seen, and the next one to hand out.
+	unsigned int highest_sequence_;
+	unsigned int next_sequence_;
+
+	// Bit (sequence % kSequenceWindow) is set if that sequence number, within
+	// the window that ends at highest_sequence_, has arrived.
+	std::bitset<kSequenceWindow> received_;
+
+	// Packets that arrived ahead of a missing one, by sequence number.
+	std::map<unsigned int, SequencedPacket> held_;
+
+	long long num_received_ = 0;
+	long long num_lost_ = 0;
+	long long num_duplicates_ = 0;
+	long long num_reordered_ = 0;
+	long long num_too_late_ = 0;
+};  // PacketSequencer
+
+void PacketSequencer::Reset() {
+	started_ = false;
+	highest_sequence_ = 0;
+	next_sequence_ = 0;
+	received_.reset();
+	held_.clear();
+}
+
+SequenceVerdict PacketSequencer::AddPacket(
+	SequencedPacket packet, std::vector<SequencedPacket>* ready) {
+
+	const unsigned int sequence = packet.header.sequence;
+	SequenceVerdict verdict = SequenceVerdict::kAccepted;
+	const int ahead = static_cast<int>(sequence - highest_sequence_);
+	if (started_ && (ahead >= static_cast<int>(kSequenceWindow) ||
+		ahead <= -static_cast<int>(kSequenceWindow))) {
+		Reset();
+		verdict = SequenceVerdict::kRestarted;
+	}
+	if (!started_) {
+		started_ = true;
+		highest_sequence_ = sequence;
+		next_sequence_ = sequence;
+	} else if (ahead > 0) {
+		// Forget the sequence numbers that slide out of the window.
+		for (unsigned int i = highest_sequence_ + 1; i != sequence + 1; ++i) {
+			received_.reset(i % kSequenceWindow);
+		}
+		highest_sequence_ = sequence;
+	} else if (received_.test(sequence % kSequenceWindow)) {
+		++num_duplicates_;
+		return SequenceVerdict::kDuplicate;
+	}
+	received_.set(sequence % kSequenceWindow);
+	if (static_cast<int>(sequence - next_sequence_) < 0) {
+		// Its gap was given up on already.
+		++num_too_late_;
+		return SequenceVerdict::kTooLate;
+	}
+	++num_received_;
+	if (ahead < 0) {
+		++num_reordered_;
+	}
+	held_.insert(std::make_pair(sequence, std::move(packet)));
+	Release(ready);
+	if (held_.size() > kReorderWindowPackets) {
+		SkipGap(ready);
+	}
+	return verdict;
+}
+
+void PacketSequencer::Flush(
+	const long long now_us, std::vector<SequencedPacket>* ready) {
+
+	while (!held_.empty()) {
+		// The oldest held packet has waited the longest, whatever its number.
+		long long oldest_arrival_us = now_us;
+		for (const auto& held : held_) {
+			oldest_arrival_us = std::min(oldest_arrival_us, held.second.arrival_time_us);
+		}
+		if (now_us - oldest_arrival_us < kMaxReorderDelayUs) {
+			return;
+		}
+		SkipGap(ready);
+	}
+}
+
+void PacketSequencer::Release(std::vector<SequencedPacket>* ready) {
+	while (!held_.empty()) {
+		// The map is ordered by plain number, so look the next one up rather
+		// than taking the first, which may be past a wraparound.
+		const auto next = held_.find(next_sequence_);
+		if (next == held_.end()) {
+			return;
+		}
+		ready->push_back(std::move(next->second));
+		held_.erase(next);
+		++next_sequence_;
+	}
+}
+
+void PacketSequencer::SkipGap(std::vector<SequencedPacket>* ready) {
+	// Find the held packet that follows the gap.
+	unsigned int oldest = 0;
+	int oldest_distance = -1;
+	for (const auto& held : held_) {
+		const int distance = static_cast<int>(held.first - next_sequence_);
+		if (oldest_distance < 0 || distance < oldest_distance) {
+			oldest = held.first;
+			oldest_distance = distance;
+		}
+	}
+	if (oldest_distance < 0) {
+		return;
+	}
+	num_lost_ += oldest_distance;
+	next_sequence_ = oldest;
+	Release(ready);
+}
+
+void PacketSequencer::ReportStats(StreamLatencyStats* stats) const {
+	stats->SetCount("packets received", num_received_);
+	stats->SetCount("packets lost", num_lost_);
+	stats->SetCount("packets reordered", num_reordered_);
+	stats->SetCount("duplicate packets", num_duplicates_);
+	stats->SetCount("packets too late", num_too_late_);
+}
+
+// When the fragments of a complete frame left the sender and arrived.
+struct FrameArrival {
+	// The receiver's clock when the first and the last fragment arrived.
+	long long first_arrival_us;
+	long long last_arrival_us;
+
+	// The sender's clock when the last fragment left.
+	unsigned int last_send_time_us;
+};
+
+// The fragments of one frame, as collected by the FrameAssembler.
+struct AssembledFrame {
+	unsigned int frame_id;
+
+	// The payload of each fragment, after the packet header. Fragments that
+	// did not arrive are empty.
+	std::vector<std::vector<unsigned char>> fragments;
+	std::vector<bool> received;
+	size_t num_received;
+
+	FrameArrival arrival;
+
+	bool IsComplete() const {
+		return num_received == fragments.size();
+	}
+};
+
+// Collects the fragments of the frames of one stream, and hands out each frame
+// once all of its fragments have arrived. A frame that is still incomplete
+// when the first fragment of a newer frame arrives is handed out with the
+// fragments it has, since waiting longer would only delay the newer frame.
+// Frames older than the last one handed out are never handed out.
+class FrameAssembler {
+public:
+	FrameAssembler() : has_handed_out_frame_(false), last_handed_out_frame_id_(0) {}
+
+	// Adds a frame fragment that arrived at the given time. Returns true and
+	// fills in the frame if this fragment completed it, or if it gave up on
+	// waiting for the rest of an older frame.
+	bool AddFragment(
+		const PacketHeader& header,
+		const unsigned char* payload,
+		const size_t payload_size,
+		const long long arrival_time_us,
+		AssembledFrame* frame);
+
+private:
+	// Hands out the pending frame and forgets it and all older frames.
+	void HandOut(
+		std::map<unsigned int, AssembledFrame>::iterator pending,
+		AssembledFrame* frame);
+
+	// Frames that are still missing fragments, by frame id.
+	std::map<unsigned int, AssembledFrame> pending_frames_;
+
+	bool has_handed_out_frame_;
+	unsigned int last_handed_out_frame_id_;
+};  // FrameAssembler
+
+bool FrameAssembler::AddFragment(
+	const PacketHeader& header,
+	const unsigned char* payload,
+	const size_t payload_size,
+	const long long arrival_time_us,
+	AssembledFrame* frame) {
+
+	TRACE_SCOPE("reassemble");
+	if (header.fragment_count == 0 ||
+		header.fragment_index >= header.fragment_count) {
+		return false;
+	}
+	if (has_handed_out_frame_ &&
+		static_cast<int>(header.frame_id - last_handed_out_frame_id_) <= 0) {
+		return false;
+	}
+	const auto pending = pending_frames_.insert(
+		std::make_pair(header.frame_id, AssembledFrame())).first;
+	AssembledFrame& partial = pending->second;
+	const bool first_fragment = partial.fragments.empty();
+	if (first_fragment) {
+		partial.frame_id = header.frame_id;
+		partial.fragments.resize(header.fragment_count);
+		partial.received.resize(header.fragment_count, false);
+		partial.num_received = 0;
+		partial.arrival.first_arrival_us = arrival_time_us;
+		partial.arrival.last_send_time_us = header.send_time_us;
+	}
+	if (header.fragment_count != partial.fragments.size() ||
+		partial.received[header.fragment_index]) {
+		return false;
+	}
+	partial.fragments[header.fragment_index].assign(
+		payload, payload + payload_size);
+	partial.received[header.fragment_index] = true;
+	++partial.num_received;
+	partial.arrival.last_arrival_us = arrival_time_us;
+	if (static_cast<int>(
+		header.send_time_us - partial.arrival.last_send_time_us) > 0) {
+		partial.arrival.last_send_time_us = header.send_time_us;
+	}
+
+	if (partial.IsComplete()) {
+		HandOut(pending, frame);
+		return true;
+	}
+	if (first_fragment && pending != pending_frames_.begin()) {
+		// A newer frame has started, so stop waiting for the older ones. Only
+		// the newest of them is still worth showing.
+		HandOut(std::prev(pending), frame);
+		return true;
+	}
+	// Give up on the oldest frames if too many are incomplete.
+	while (pending_frames_.size() > kMaxPendingFrames) {
+		pending_frames_.erase(pending_frames_.begin());
+	}
+	return false;
+}
+
+void FrameAssembler::HandOut(
+	std::map<unsigned int, AssembledFrame>::iterator pending,
+	AssembledFrame* frame) {
+
+	*frame = std::move(pending->second);
+	has_handed_out_frame_ = true;
+	last_handed_out_frame_id_ = frame->frame_id;
+	pending_frames_.erase(pending_frames_.begin(), std::next(pending));
+}
+
+// Keeps the JPEG tables that the sender of one stream stripped from its
+// frames, and puts them back so that the frames can be decoded.
+class JpegTableContext {
+public:
+	// Stores the tables from the payload of a kPacketTypeTables packet,
+	// replacing any earlier tables with the same id.
+	void SetTables(const unsigned char* payload, const size_t payload_size);
+
+	// Puts the tables with the given id back into an abbreviated JPEG. Returns
+	// false if they have not arrived yet. JPEGs with kNoTableId are complete
+	// already and are left as they are.
+	bool RestoreTables(
+		const unsigned char table_id, std::vector<unsigned char>* jpeg) const;
+
+private:
+	std::map<unsigned char, std::vector<unsigned char>> tables_;
+};  // JpegTableContext
+
+void JpegTableContext::SetTables(
+	const unsigned char* payload, const size_t payload_size) {
+
+	if (payload_size < 1 || payload[0] == kNoTableId) {
+		return;
+	}
+	tables_[payload[0]].assign(payload + 1, payload + payload_size);
+}
+
+bool JpegTableContext::RestoreTables(
+	const unsigned char table_id, std::vector<unsigned char>* jpeg) const {
+
+	if (table_id == kNoTableId) {
+		return true;
+	}
+	const auto found = tables_.find(table_id);
+	// The tables go right after the SOI marker.
+	if (found == tables_.end() || jpeg->size() < 2) {
+		return false;
+	}
+	jpeg->insert(jpeg->begin() + 2, found->second.begin(), found->second.end());
+	return true;
+}
+
+// More JPEG marker codes, for the segments that describe the frame.
+constexpr unsigned char kJpegMarkerSOF0 = 0xC0;
+constexpr unsigned char kJpegMarkerSOF2 = 0xC2;
+constexpr unsigned char kJpegMarkerDRI = 0xDD;
+
+// The layout of a JPEG's scan, as far as decoding it stripe by stripe is
+// concerned.
+struct JpegGeometry {
+	int width;
+	int height;
+
+	// The height of a row of MCUs, which is the height of a stripe.
+	int stripe_height;
+
+	// Where the SOF segment starts in the header.
+	size_t sof_offset;
+};
+
+// Reads the geometry from a JPEG header (see FindJpegScanStart). Returns
+// false unless every restart interval is exactly one row of MCUs.
+bool ReadJpegGeometry(
+	const std::vector<unsigned char>& header, JpegGeometry* geometry) {
+
+	size_t position = 2;
+	int mcu_width = 0;
+	int restart_interval = 0;
+	geometry->stripe_height = 0;
+	while (position + 4 <= header.size()) {
+		const unsigned char marker = header[position + 1];
+		const size_t length = ReadUint16(header.data() + position + 2);
+		const unsigned char* segment = header.data() + position + 4;
+		if (position + 2 + length > header.size()) {
+			return false;
+		}
+		if (marker >= kJpegMarkerSOF0 && marker <= kJpegMarkerSOF2 && length >= 8) {
+			geometry->sof_offset = position;
+			geometry->height = ReadUint16(segment + 1);
+			geometry->width = ReadUint16(segment + 3);
+			const int num_components = segment[5];
+			if (length < 8 + 3 * static_cast<size_t>(num_components)) {
+				return false;
+			}
+			// The MCU spans the largest sampling factors of all components.
+			for (int i = 0; i < num_components; ++i) {
+				const unsigned char sampling = segment[6 + 3 * i + 1];
+				mcu_width = std::max(mcu_width, 8 * (sampling >> 4));
+				geometry->stripe_height =
+					std::max(geometry->stripe_height, 8 * (sampling & 0x0F));
+			}
+		} else if (marker == kJpegMarkerDRI && length >= 4) {
+			restart_interval = ReadUint16(segment);
+		}
+		position += 2 + length;
+	}
+	return mcu_width > 0 && geometry->stripe_height > 0 &&
+		restart_interval == (geometry->width + mcu_width - 1) / mcu_width;
+}
+
+// Decodes the frames of one stream from their fragments. Complete frames are
+// decoded as a whole. When fragments were lost, each run of stripes that
+// arrived in full is turned into a JPEG of its own and decoded, and pasted
+// over the previous frame, so that the lost stripes keep showing what was
+// there before. If fragment 0 with the JPEG header was lost, the header of the
+// previous frame is used.
+class StripeDecoder {
+public:
+	// Decodes the frame. Returns false if none of it could be decoded. If the
+	// frame's trace arrived, it is put into trace and has_trace is set. If the
+	// frame was complete, its JPEG, with its tables, is left in jpeg;
+	// otherwise jpeg is emptied.
+	bool Decode(
+		const AssembledFrame& frame,
+		const JpegTableContext& table_context,
+		VideoFrame* video_frame,
+		FrameTrace* trace,
+		bool* has_trace,
+		std::vector<unsigned char>* jpeg);
+
+private:
+	// Decodes the stripes of an incomplete frame.
+	bool DecodeStripes(
+		const AssembledFrame& frame,
+		const JpegTableContext& table_context,
+		VideoFrame* video_frame,
+		FrameTrace* trace,
+		bool* has_trace);
+
+	// The JPEG header of the last frame whose fragment 0 arrived.
+	std::vector<unsigned char> header_;
+
+	// The last image that was decoded.
+	cv::Mat last_image_;
+};  // StripeDecoder
+
+bool StripeDecoder::Decode(
+	const AssembledFrame& frame,
+	const JpegTableContext& table_context,
+	VideoFrame* video_frame,
+	FrameTrace* trace,
+	bool* has_trace,
+	std::vector<unsigned char>* jpeg) {
+
+	*has_trace = false;
+	jpeg->clear();
+	if (!frame.IsComplete()) {
+		return DecodeStripes(frame, table_context, video_frame, trace, has_trace);
+	}
+	FragmentInfo info;
+	for (size_t i = 0; i < frame.fragments.size(); ++i) {
+		const std::vector<unsigned char>& fragment = frame.fragments[i];
+		const size_t prefix_size =
+			kFragmentInfoSize + (i == 0 ? kFrameTraceSize : 0);
+		if (!ReadFragmentInfo(fragment.data(), fragment.size(), &info) ||
+			fragment.size() < prefix_size) {
+			return false;
+		}
+		jpeg->insert(jpeg->end(), fragment.begin() + prefix_size, fragment.end());
+	}
+	// The frame starts with the sender's stage timestamps.
+	*has_trace = ReadFrameTrace(
+		frame.fragments[0].data() + kFragmentInfoSize, kFrameTraceSize, trace);
+	const size_t header_size = FindJpegScanStart(jpeg->data(), jpeg->size());
+	if (header_size != 0) {
+		header_.assign(jpeg->begin(), jpeg->begin() + header_size);
+	}
+	if (!table_context.RestoreTables(info.table_id, jpeg)) {
+		return false;
+	}
+	*video_frame = VideoFrame(*jpeg);
+	if (video_frame->GetImage().empty()) {
+		return false;
+	}
+	last_image_ = video_frame->GetImage();
+	return true;
+}
+
+bool StripeDecoder::DecodeStripes(
+	const AssembledFrame& frame,
+	const JpegTableContext& table_context,
+	VideoFrame* video_frame,
+	FrameTrace* trace,
+	bool* has_trace) {
+
+	// Collect the scan data of every stripe that arrived in full, without its
+	// trailing marker.
+	std::map<int, std::vector<unsigned char>> stripes;
+	unsigned char table_id = kNoTableId;
+	int stripe = 0;
+	bool collecting = false;
+	std::vector<unsigned char> current;
+	for (size_t i = 0; i < frame.fragments.size(); ++i) {
+		if (!frame.received[i]) {
+			collecting = false;
+			continue;
+		}
+		const std::vector<unsigned char>& fragment = frame.fragments[i];
+		FragmentInfo info;
+		if (!ReadFragmentInfo(fragment.data(), fragment.size(), &info) ||
+			info.stripe == kUnknownStripe) {
+			return false;
+		}
+		table_id = info.table_id;
+		size_t begin = kFragmentInfoSize;
+		if (i == 0) {
+			if (!ReadFrameTrace(
+				fragment.data() + begin, fragment.size() - begin, trace)) {
+				return false;
+			}
+			*has_trace = true;
+			begin += kFrameTraceSize;
+			const size_t header_size =
+				FindJpegScanStart(fragment.data() + begin, fragment.size() - begin);
+			if (header_size != 0) {
+				header_.assign(
+					fragment.begin() + begin, fragment.begin() + begin + header_size);
+			}
+			begin += header_size;
+		}
+		const int first_stripe = info.stripe & ~kFragmentContinuesStripe;
+		if ((info.stripe & kFragmentContinuesStripe) == 0) {
+			collecting = true;
+			current.clear();
+		} else if (stripe != first_stripe) {
+			// The start of the stripe was lost with an earlier fragment.
+			collecting = false;
+		}
+		stripe = first_stripe;
+		for (size_t j = begin; j + 1 < fragment.size(); ++j) {
+			if (fragment[j] != 0xFF) {
+				continue;
+			}
+			if (IsStripeEndMarker(fragment[j + 1])) {
+				if (collecting) {
+					current.insert(
+						current.end(), fragment.begin() + begin, fragment.begin() + j);
+					stripes[stripe] = std::move(current);
+					current.clear();
+				}
+				collecting = true;
+				++stripe;
+				begin = j + 2;
+			}
+			++j;
+		}
+		if (collecting) {
+			current.insert(current.end(), fragment.begin() + begin, fragment.end());
+		}
+	}
+
+	// The tables are the same for every run, so they are put back once.
+	std::vector<unsigned char> header(header_);
+	JpegGeometry geometry;
+	if (stripes.empty() || header.empty() ||
+		!table_context.RestoreTables(table_id, &header) ||
+		!ReadJpegGeometry(header, &geometry)) {
+		return false;
+	}
+	cv::Mat image;
+	if (last_image_.rows == geometry.height && last_image_.cols == geometry.width) {
+		image = last_image_.clone();
+	} else {
+		image = cv::Mat::zeros(geometry.height, geometry.width, CV_8UC3);
+	}
+	// Decode each run of consecutive stripes as a JPEG of its own: the header
+	// with the height of the run, and the run's stripes with their restart
+	// markers numbered from 0 again.
+	bool decoded_any = false;
+	auto run_begin = stripes.begin();
+	while (run_begin != stripes.end()) {
+		auto run_end = std::next(run_begin);
+		while (run_end != stripes.end() &&
+			run_end->first == std::prev(run_end)->first + 1) {
+			++run_end;
+		}
+		const int top = run_begin->first * geometry.stripe_height;
+		const int bottom = std::min(
+			(std::prev(run_end)->first + 1) * geometry.stripe_height, geometry.height);
+		if (top >= bottom) {
+			// The run lies below the frame, so it is not worth decoding.
+			run_begin = run_end;
+			continue;
+		}
+		std::vector<unsigned char> jpeg(header);
+		WriteUint16(jpeg.data() + geometry.sof_offset + 5,
+			static_cast<unsigned short>(bottom - top));
+		int interval = 0;
+		for (auto it = run_begin; it != run_end; ++it, ++interval) {
+			jpeg.insert(jpeg.end(), it->second.begin(), it->second.end());
+			jpeg.push_back(0xFF);
+			jpeg.push_back(std::next(it) == run_end ? kJpegMarkerEOI :
+				static_cast<unsigned char>(kJpegMarkerRST0 + interval % 8));
+		}
+		run_begin = run_end;
+		const VideoFrame run(jpeg);
+		const cv::Mat& decoded = run.GetImage();
+		if (decoded.cols != geometry.width || decoded.rows != bottom - top ||
+			decoded.type() != image.type()) {
+			continue;
+		}
+		decoded.copyTo(image(cv::Rect(0, top, geometry.width, bottom - top)));
+		decoded_any = true;
+	}
+	if (!decoded_any) {
+		return false;
+	}
+	last_image_ = image;
+	*video_frame = VideoFrame(image);
+	return true;
+}
+
+// Records when the packets of one stream arrived, and builds the feedback
+// reports that let the sender estimate the available bandwidth, as well as
+// the receiver reports.
+class FeedbackReporter {
+public:
+	FeedbackReporter()
+		: last_report_time_us_(0), report_number_(0), has_sequence_(false),
+		first_sequence_(0), highest_sequence_(0), num_received_(0),
+		expected_at_last_report_(0), received_at_last_report_(0), jitter_us_(0),
+		last_transit_us_(0), last_send_time_us_(0), last_arrival_time_us_(0),
+		last_receiver_report_time_us_(0) {}
+
+	// Records the arrival of a packet.
+	void OnPacketArrived(
+		const PacketHeader& header, const long long arrival_time_us);
+
+	// Returns true and fills in the report if one is due, either because the
+	// report interval has passed or because a report is full.
+	bool TakeReport(const long long now_us, std::vector<unsigned char>* report);
+
+	// Fills in the subscription that is sent along with each report, so that
+	// the sender learns it even if some are lost.
+	void MakeSubscription(
+		const unsigned char subscription,
+		const FrameRegion& region,
+		std::vector<unsigned char>* packet);
+
+	// Returns true and fills in a receiver report if one is due. The decode
+	// and render times are the stream's.
+	bool TakeReceiverReport(
+		const long long now_us,
+		const long long decode_time_us,
+		const long long render_time_us,
+		std::vector<unsigned char>* packet);
+
+private:
+	// The (sequence, arrival time) pairs not yet reported.
+	std::vector<std::pair<unsigned int, unsigned int>> arrivals_;
+
+	long long last_report_time_us_;
+	unsigned int report_number_;
+
+	// The reception statistics of the receiver reports: the lowest and the
+	// highest sequence number received, the number of packets received, and
+	// how many were expected and received as of the last receiver report.
+	bool has_sequence_;
+	unsigned int first_sequence_;
+	unsigned int highest_sequence_;
+	long long num_received_;
+	long long expected_at_last_report_;
+	long long received_at_last_report_;
+
+	// The jitter, and the transit time (arrival minus send time, on clocks
+	// with an unknown offset) of the last packet that it was updated with.
+	double jitter_us_;
+	int last_transit_us_;
+
+	// When the newest packet left the sender and arrived.
+	unsigned int last_send_time_us_;
+	long long last_arrival_time_us_;
+
+	long long last_receiver_report_time_us_;
+};  // FeedbackReporter
+
+void FeedbackReporter::OnPacketArrived(
+	const PacketHeader& header, const long long arrival_time_us) {
+
+	arrivals_.push_back(std::make_pair(
+		header.sequence, static_cast<unsigned int>(arrival_time_us)));
+	++num_received_;
+	const int transit_us = static_cast<int>(
+		static_cast<unsigned int>(arrival_time_us) - header.send_time_us);
+	if (!has_sequence_) {
+		has_sequence_ = true;
+		first_sequence_ = header.sequence;
+		highest_sequence_ = header.sequence;
+		last_transit_us_ = transit_us;
+		last_send_time_us_ = header.send_time_us;
+		last_arrival_time_us_ = arrival_time_us;
+		return;
+	}
+	// The jitter is taken over the packets in the order they arrived (6.4.1
+	// of RFC 3550).
+	const int difference_us = transit_us - last_transit_us_;
+	last_transit_us_ = transit_us;
+	jitter_us_ += (std::abs(difference_us) - jitter_us_) / 16;
+	if (static_cast<int>(header.sequence - first_sequence_) < 0) {
+		first_sequence_ = header.sequence;
+	}
+	if (static_cast<int>(header.sequence - highest_sequence_) > 0) {
+		highest_sequence_ = header.sequence;
+		last_send_time_us_ = header.send_time_us;
+		last_arrival_time_us_ = arrival_time_us;
+	}
+}
+
+bool FeedbackReporter::TakeReport(
+	const long long now_us, std::vector<unsigned char>* report) {
+
+	if (arrivals_.empty()) {
+		return false;
+	}
+	if (arrivals_.size() < kMaxFeedbackEntries &&
+		now_us - last_report_time_us_ < kFeedbackIntervalUs) {
+		return false;
+	}
+	const size_t num_entries = std::min(arrivals_.size(), kMaxFeedbackEntries);
+	report->assign(kPacketHeaderSize + 2 + num_entries * kFeedbackEntrySize, 0);
+	PacketHeader header;
+	header.type = kPacketTypeFeedback;
+	header.probe_cluster = 0;
+	header.fragment_index = 0;
+	header.fragment_count = 0;
+	header.sequence = report_number_++;
+	header.frame_id = 0;
+	header.send_time_us = static_cast<unsigned int>(now_us);
+	WritePacketHeader(header, report->data());
+	WriteUint16(
+		report->data() + kPacketHeaderSize, static_cast<unsigned short>(num_entries));
+	for (size_t i = 0; i < num_entries; ++i) {
+		unsigned char* entry =
+			report->data() + kPacketHeaderSize + 2 + i * kFeedbackEntrySize;
+		WriteUint32(entry, arrivals_[i].first);
+		WriteUint32(entry + 4, arrivals_[i].second);
+	}
+	SealPacket(report->data(), report->size());
+	arrivals_.erase(arrivals_.begin(), arrivals_.begin() + num_entries);
+	last_report_time_us_ = now_us;
+	return true;
+}
+
+void FeedbackReporter::MakeSubscription(
+	const unsigned char subscription,
+	const FrameRegion& region,
+	std::vector<unsigned char>* packet) {
+
+	packet->assign(kPacketHeaderSize + 1 + kFrameRegionSize, 0);
+	PacketHeader header;
+	header.type = kPacketTypeSubscription;
+	header.probe_cluster = 0;
+	header.fragment_index = 0;
+	header.fragment_count = 0;
+	header.sequence = report_number_;
+	header.frame_id = 0;
+	header.send_time_us = static_cast<unsigned int>(last_report_time_us_);
+	WritePacketHeader(header, packet->data());
+	(*packet)[kPacketHeaderSize] = subscription;
+	WriteFrameRegion(region, packet->data() + kPacketHeaderSize + 1);
+	SealPacket(packet->data(), packet->size());
+}
+
+bool FeedbackReporter::TakeReceiverReport(
+	const long long now_us,
+	const long long decode_time_us,
+	const long long render_time_us,
+	std::vector<unsigned char>* packet) {
+
+	if (!has_sequence_ ||
+		now_us - last_receiver_report_time_us_ < kReceiverReportIntervalUs) {
+		return false;
+	}
+	last_receiver_report_time_us_ = now_us;
+	const long long expected =
+		static_cast<long long>(highest_sequence_ - first_sequence_) + 1;
+	const long long expected_since_report = expected - expected_at_last_report_;
+	const long long lost_since_report =
+		expected_since_report - (num_received_ - received_at_last_report_);
+	expected_at_last_report_ = expected;
+	received_at_last_report_ = num_received_;
+
+	ReceiverReport report;
+	report.highest_sequence = highest_sequence_;
+	report.cumulative_lost =
+		static_cast<unsigned int>(std::max(expected - num_received_, 0LL));
+	report.fraction_lost = expected_since_report <= 0 || lost_since_report <= 0 ?
+		0 : static_cast<unsigned char>(std::min(
+			lost_since_report * 256 / expected_since_report, 255LL));
+	report.jitter_us = static_cast<unsigned int>(jitter_us_);
+	report.decode_time_us = static_cast<unsigned int>(decode_time_us);
+	report.render_time_us = static_cast<unsigned int>(render_time_us);
+	report.last_send_time_us = last_send_time_us_;
+	report.delay_since_last_us =
+		static_cast<unsigned int>(now_us - last_arrival_time_us_);
+
+	packet->assign(kPacketHeaderSize + kReceiverReportSize, 0);
+	PacketHeader header;
+	header.type = kPacketTypeReceiverReport;
+	header.probe_cluster = 0;
+	header.fragment_index = 0;
+	header.fragment_count = 0;
+	header.sequence = report_number_;
+	header.frame_id = 0;
+	header.send_time_us = static_cast<unsigned int>(now_us);
+	WritePacketHeader(header, packet->data());
+	WriteReceiverReport(report, packet->data() + kPacketHeaderSize);
+	SealPacket(packet->data(), packet->size());
+	return true;
+}
+
+// Separates the queueing delay of packets from the unknown offset between the
+// sender's and the receiver's clock. The smallest raw delay seen recently is
+// taken as the offset plus the path's propagation delay; anything above it is
+// queueing. Only the last two windows are considered, so that clock drift does
+// not accumulate.
+class QueueingDelayFilter {
+public:
+	QueueingDelayFilter()
+		: window_start_us_(0), has_minimum_(false),
+		current_minimum_(0), previous_minimum_(0) {}
+
+	// Returns the queueing delay of a packet that left at the given sender
+	// time and arrived at the given receiver time.
+	long long Update(const long long arrival_time_us, const unsigned int send_time_us);
+
+	// Returns the receiver time at which something that happened at the given
+	// sender time would have arrived without queueing, i.e. the sender time
+	// moved by the clock offset and the propagation delay. The sender's clock
+	// wraps around, so the result is the time closest to now_us.
+	long long ToReceiverTime(
+		const unsigned int sender_time_us, const long long now_us) const;
+
+private:
+	// Returns the smallest raw delay of the last two windows.
+	unsigned int Minimum() const;
+
+	// A window lasts this long.
+	static const long long kWindowUs = 10000000;
+
+	long long window_start_us_;
+	bool has_minimum_;
+
+	// Raw delays, i.e. arrival minus send time in wrapping 32-bit arithmetic.
+	unsigned int current_minimum_;
+	unsigned int previous_minimum_;
+};  // QueueingDelayFilter
+
+long long QueueingDelayFilter::Update(
+	const long long arrival_time_us, const unsigned int send_time_us) {
+
+	const unsigned int raw_delay =
+		static_cast<unsigned int>(arrival_time_us) - send_time_us;
+	if (!has_minimum_) {
+		has_minimum_ = true;
+		window_start_us_ = arrival_time_us;
+		current_minimum_ = raw_delay;
+		previous_minimum_ = raw_delay;
+	}
+	if (arrival_time_us - window_start_us_ >= kWindowUs) {
+		window_start_us_ = arrival_time_us;
+		previous_minimum_ = current_minimum_;
+		current_minimum_ = raw_delay;
+	}
+	if (static_cast<int>(raw_delay - current_minimum_) < 0) {
+		current_minimum_ = raw_delay;
+	}
+	return static_cast<int>(raw_delay - Minimum());
+}
+
+long long QueueingDelayFilter::ToReceiverTime(
+	const unsigned int sender_time_us, const long long now_us) const {
+
+	const unsigned int receiver_time_us = sender_time_us + Minimum();
+	return now_us + static_cast<int>(
+		receiver_time_us - static_cast<unsigned int>(now_us));
+}
+
+unsigned int QueueingDelayFilter::Minimum() const {
+	return static_cast<int>(current_minimum_ - previous_minimum_) < 0 ?
+		current_minimum_ : previous_minimum_;
+}
+
+// Returns the time of the first display refresh at or after the given time,
+// on the NowMicroseconds() clock. The desktop compositor tells when the last
+// refresh was; without it, refreshes are assumed at the display's rate from
+// time 0.
+long long NextDisplayRefreshUs(const long long time_us) {
+	static const long long fallback_period_us = [] {
+		DEVMODE mode = {};
+		mode.dmSize = sizeof(mode);
+		// Rates of 0 and 1 stand for the hardware's default.
+		if (EnumDisplaySettings(nullptr, ENUM_CURRENT_SETTINGS, &mode) &&
+			mode.dmDisplayFrequency > 1) {
+			return 1000000LL / mode.dmDisplayFrequency;
+		}
+		return 1000000LL / 60;
+	}();
+	long long refresh_us = 0;
+	long long period_us = fallback_period_us;
+	DWM_TIMING_INFO timing = {};
+	timing.cbSize = sizeof(timing);
+	if (SUCCEEDED(DwmGetCompositionTimingInfo(NULL, &timing)) &&
+		timing.qpcRefreshPeriod != 0) {
+		refresh_us = QpcToMicroseconds(timing.qpcVBlank);
+		period_us = QpcToMicroseconds(timing.qpcRefreshPeriod);
+	}
+	long long phase_us = (time_us - refresh_us) % period_us;
+	if (phase_us < 0) {
+		phase_us += period_us;
+	}
+	return phase_us == 0 ? time_us : time_us + period_us - phase_us;
+}
+
+class PresentationScheduler;
+
+// The one thread that shows the frames of all PresentationSchedulers, so that
+// streams do not take a thread each, and every window is only ever touched by
+// this thread (see GetPresentationThread()).
+class PresentationThread {
+public:
+	PresentationThread();
+
+	// Adds a scheduler whose frames are to be shown.
+	void Add(PresentationScheduler* scheduler);
+
+	// Removes the scheduler. None of its frames is being shown once this
+	// returns.
+	void Remove(PresentationScheduler* scheduler);
+
+	// Has the thread look at the schedulers' frames again, because one was
+	// scheduled.
+	void Wake();
+
+private:
+	// The presenting thread's loop.
+	void Run();
+
+	std::vector<PresentationScheduler*> schedulers_;
+
+	// Set by Wake(), and while the thread shows frames without the mutex.
+	bool woken_;
+	bool presenting_;
+
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::condition_variable presented_;
+	std::thread thread_;
+};  // PresentationThread
+
+// Returns the presentation thread, starting it on first use. It runs until
+// the process exits.
+PresentationThread& GetPresentationThread() {
+	static PresentationThread* presentation_thread = new PresentationThread();
+	return *presentation_thread;
+}
+
+// Shows the decoded frames of one stream at a steady cadence, on the
+// presentation thread so that neither the receiving thread nor the decoding
+// workers wait for the display. Frames are shown in the order they are
+// scheduled.
+class PresentationScheduler {
+public:
+	PresentationScheduler(
+		const std::string& window_name, StreamLatencyStats* latency_stats);
+
+	// Frames that are still scheduled are not shown.
+	~PresentationScheduler();
+
+	// Hands over a frame that finished decoding at decoded_time_us and was
+	// captured at capture_time_us, on the receiver's clock. Frames with an
+	// unknown capture time (0) are shown at the next refresh.
+	void Schedule(
+		VideoFrame frame,
+		const long long capture_time_us,
+		const long long decoded_time_us);
+
+	// Returns the time by which a frame captured at capture_time_us has to be
+	// decoded to be shown, with the current playout delay.
+	long long DeadlineUs(const long long capture_time_us);
+
+	// Lets the playout delay follow a frame that was dropped because it would
+	// only have been decoded at decoded_time_us, too late to be shown.
+	void OnFrameDropped(
+		const long long capture_time_us, const long long decoded_time_us);
+
+	// Returns the last key that was pressed in the window since the previous
+	// call, or -1.
+	int TakeKey() {
+		return pressed_key_.exchange(-1);
+	}
+
+	// Returns how long showing a frame takes, on average recently.
+	long long RenderTimeUs() const {
+		return render_time_us_;
+	}
+
+	// Returns when the next frame is to be shown, or kNoFrameDue if none is
+	// scheduled.
+	long long NextPresentTimeUs();
+	static const long long kNoFrameDue = 0x7FFFFFFFFFFFFFFFLL;
+
+	// Shows the frame that is due at now_us, if there is one. Only the
+	// presentation thread calls this.
+	void PresentDue(const long long now_us);
+
+private:
+	struct ScheduledFrame {
+		VideoFrame frame;
+		long long present_time_us;
+		long long decoded_time_us;
+	};
+
+	// Adapts the playout delay to a frame that took delay_us from capture to
+	// the end of decoding. The mutex must be held.
+	void AdaptPlayoutDelay(const long long delay_us);
+
+	// Counts a frame that was skipped because it was late.
+	void SkipLateFrame();
+
+	const std::string window_name_;
+	StreamLatencyStats* const latency_stats_;
+
+	// The delay between capture and presentation that frames are given.
+	long long playout_delay_us_;
+
+	long long late_frames_;
+	std::atomic<int> pressed_key_;
+	std::atomic<long long> render_time_us_;
+	std::deque<ScheduledFrame> frames_;
+	std::mutex mutex_;
+};  // PresentationScheduler
+
+PresentationThread::PresentationThread() : woken_(false), presenting_(false) {
+	thread_ = std::thread([this] {
+		Run();
+	});
+}
+
+void PresentationThread::Add(PresentationScheduler* scheduler) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	schedulers_.push_back(scheduler);
+}
+
+void PresentationThread::Remove(PresentationScheduler* scheduler) {
+	std::unique_lock<std::mutex> lock(mutex_);
+	schedulers_.erase(
+		std::remove(schedulers_.begin(), schedulers_.end(), scheduler),
+		schedulers_.end());
+	presented_.wait(lock, [this] {
+		return !presenting_;
+	});
+}
+
+void PresentationThread::Wake() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		woken_ = true;
+	}
+	wake_.notify_one();
+}
+
+void PresentationThread::Run() {
+	TRACE_THREAD_NAME("present");
+	std::vector<PresentationScheduler*> schedulers;
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true) {
+		{
+			TRACE_SCOPE("wait for presentation");
+			long long next_us = PresentationScheduler::kNoFrameDue;
+			for (PresentationScheduler* scheduler : schedulers_) {
+				next_us = std::min(next_us, scheduler->NextPresentTimeUs());
+			}
+			if (next_us == PresentationScheduler::kNoFrameDue) {
+				wake_.wait(lock, [this] {
+					return woken_;
+				});
+			} else {
+				const std::chrono::steady_clock::time_point present_time =
+					std::chrono::steady_clock::time_point(
+						std::chrono::microseconds(next_us));
+				wake_.wait_until(lock, present_time, [this] {
+					return woken_;
+				});
+			}
+			woken_ = false;
+		}
+		// The frames are shown without the mutex, so that scheduling frames
+		// never waits for the display. Remove() waits for them instead.
+		schedulers = schedulers_;
+		presenting_ = true;
+		lock.unlock();
+		const long long now_us = NowMicroseconds();
+		for (PresentationScheduler* scheduler : schedulers) {
+			scheduler->PresentDue(now_us);
+		}
+		lock.lock();
+		presenting_ = false;
+		presented_.notify_all();
+	}
+}
+
+PresentationScheduler::PresentationScheduler(
+	const std::string& window_name, StreamLatencyStats* latency_stats)
+	: window_name_(window_name), latency_stats_(latency_stats),
+	playout_delay_us_(kInitialPlayoutDelayUs), late_frames_(0), pressed_key_(-1),
+	render_time_us_(0) {
+
+	GetPresentationThread().Add(this);
+}
+
+PresentationScheduler::~PresentationScheduler() {
+	GetPresentationThread().Remove(this);
+}
+
+void PresentationScheduler::Schedule(
+	VideoFrame frame,
+	const long long capture_time_us,
+	const long long decoded_time_us) {
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	long long due_time_us = decoded_time_us;
+	if (capture_time_us != 0) {
+		AdaptPlayoutDelay(decoded_time_us - capture_time_us);
+		due_time_us = capture_time_us + playout_delay_us_;
+	}
+	const long long present_time_us = NextDisplayRefreshUs(due_time_us);
+	if (present_time_us < decoded_time_us) {
+		SkipLateFrame();
+		return;
+	}
+	ScheduledFrame scheduled;
+	scheduled.frame = std::move(frame);
+	scheduled.present_time_us = present_time_us;
+	scheduled.decoded_time_us = decoded_time_us;
+	frames_.push_back(std::move(scheduled));
+	lock.unlock();
+	GetPresentationThread().Wake();
+}
+
+long long PresentationScheduler::DeadlineUs(const long long capture_time_us) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return NextDisplayRefreshUs(capture_time_us + playout_delay_us_);
+}
+
+void PresentationScheduler::OnFrameDropped(
+	const long long capture_time_us, const long long decoded_time_us) {
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	AdaptPlayoutDelay(decoded_time_us - capture_time_us);
+}
+
+void PresentationScheduler::AdaptPlayoutDelay(const long long delay_us) {
+	// The playout delay rises quickly when frames take longer, so that few
+	// are skipped, and falls slowly, so that a single fast frame does not
+	// make the next ones late.
+	if (delay_us > playout_delay_us_) {
+		playout_delay_us_ += (delay_us - playout_delay_us_) / 4;
+	} else {
+		playout_delay_us_ -= (playout_delay_us_ - delay_us) / 64;
+	}
+	playout_delay_us_ =
+		std::min(std::max(playout_delay_us_, 0LL), kMaxPlayoutDelayUs);
+}
+
+void PresentationScheduler::SkipLateFrame() {
+	++late_frames_;
+	latency_stats_->SetCount("late frames", late_frames_);
+}
+
+long long PresentationScheduler::NextPresentTimeUs() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (frames_.empty()) {
+		return kNoFrameDue;
+	}
+	return frames_.front().present_time_us;
+}
+
+void PresentationScheduler::PresentDue(const long long now_us) {
+	ScheduledFrame scheduled;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (frames_.empty() || frames_.front().present_time_us > now_us) {
+			return;
+		}
+		// A frame whose successor is due as well would only be shown late.
+		while (frames_.size() > 1 && frames_[1].present_time_us <= now_us) {
+			frames_.pop_front();
+			SkipLateFrame();
+		}
+		scheduled = std::move(frames_.front());
+		frames_.pop_front();
+	}
+	// The refresh has been waited for already, so waitKey() only lets the
+	// window process its events.
+	const long long render_start_us = NowMicroseconds();
+	const int key = scheduled.frame.Display(window_name_, 1);
+	if (key >= 0) {
+		pressed_key_ = key;
+	}
+	const long long render_end_us = NowMicroseconds();
+	render_time_us_ = render_time_us_ +
+		(render_end_us - render_start_us - render_time_us_) / 8;
+	latency_stats_->Record(
+		kStageDisplay, render_end_us - scheduled.decoded_time_us);
+}
+
+// The layout of a time-shift ring file: this header, index_entries index
+// entries, and then ring_bytes of frame data that wraps around.
+struct TimeShiftRingHeader {
+	// The size of the ring, which is fixed when the file is created.
+	LONG64 ring_bytes;
+	LONG64 index_entries;
+
+	// Number of frames written so far. Frame n is described by index entry
+	// n % index_entries.
+	volatile LONG64 write_count;
+
+	// Number of frame bytes written so far, including those of the frame that
+	// is being written. Byte b is kept at b % ring_bytes of the frame data,
+	// until this grows past b + ring_bytes.
+	volatile LONG64 write_offset;
+};
+
+struct TimeShiftIndexEntry {
+	// Odd while the entry is being written, 2 * (n + 1) once it describes
+	// frame n, like SharedMemorySlotHeader::sequence.
+	volatile LONG64 sequence;
+
+	// When the frame arrived, on the receiver's NowMicroseconds() clock.
+	volatile LONG64 time_us;
+
+	// The first byte of the frame's JPEG (see write_offset), and its size.
+	volatile LONG64 offset;
+	volatile LONG64 size;
+};
+
+// Keeps the most recent frames of a stream as JPEGs in a ring in a
+// memory-mapped file, indexed by arrival time. One thread appends frames; any
+// number of readers, in this process or in others that map the file, read
+// without locks. A reader checks that the frame was neither being written
+// nor overwritten while it copied it, as with the shared-memory transport.
+class TimeShiftRing {
+public:
+	// Creates the ring file with ring_bytes of frame data, replacing an
+	// earlier one. If that fails, no frames are kept.
+	TimeShiftRing(const std::string& file_name, const size_t ring_bytes);
+
+	~TimeShiftRing();
+
+	// Appends a frame that arrived at the given time. Only one thread may
+	// append frames.
+	void Append(
+		const unsigned char* jpeg, const size_t size, const long long time_us);
+
+	// Returns the number of frames appended so far. The newest one is this
+	// minus one.
+	LONG64 FrameCount() const;
+
+	// Finds the newest kept frame that arrived at or before the given time, or
+	// the oldest kept frame if none is that old. Returns false if no frames are
+	// kept.
+	bool FindFrame(const long long time_us, LONG64* frame_number) const;
+
+	// Sets the arrival time of the given frame. Returns false if the frame is
+	// not kept (anymore).
+	bool FrameTime(const LONG64 frame_number, long long* time_us) const;
+
+	// Copies the JPEG of the given frame into jpeg, reusing its memory, and
+	// sets its arrival time. Returns false if the frame is not kept (anymore).
+	bool ReadFrame(
+		const LONG64 frame_number,
+		std::vector<unsigned char>* jpeg,
+		long long* time_us) const;
+
+private:
+	const TimeShiftRingHeader* Header() const {
+		return reinterpret_cast<const TimeShiftRingHeader*>(ring_);
+	}
+
+	TimeShiftIndexEntry* Entry(const LONG64 frame_number) const {
+		return reinterpret_cast<TimeShiftIndexEntry*>(
+			ring_ + sizeof(TimeShiftRingHeader)) +
+			frame_number % index_entries_;
+	}
+
+	// Reads the index entry of the given frame. Returns false if the entry does
+	// not describe the frame, or if the frame's bytes have been overwritten.
+	bool ReadEntry(
+		const LONG64 frame_number,
+		long long* time_us,
+		LONG64* offset,
+		LONG64* size) const;
+
+	// Returns true if the bytes from offset on have not been overwritten.
+	bool IsKept(const LONG64 offset) const {
+		return Header()->write_offset - offset <=
+			static_cast<LONG64>(ring_bytes_);
+	}
+
+	// The size of the frame data and of the index, and where the frame data
+	// starts in the file.
+	const size_t ring_bytes_;
+	const size_t index_entries_;
+	const size_t data_start_;
+
+	HANDLE file_handle_;
+	HANDLE mapping_handle_;
+
+	// The start of the mapped file, or nullptr if it could not be mapped.
+	unsigned char* ring_;
+};  // TimeShiftRing
+
+TimeShiftRing::TimeShiftRing(const std::string& file_name, const size_t ring_bytes)
+	: ring_bytes_(ring_bytes),
+	  index_entries_(std::max<size_t>(ring_bytes / kTimeShiftBytesPerFrame, 1)),
+	  data_start_(sizeof(TimeShiftRingHeader) +
+		  index_entries_ * sizeof(TimeShiftIndexEntry)),
+	  file_handle_(INVALID_HANDLE_VALUE), mapping_handle_(NULL), ring_(nullptr) {
+
+	// Readers in other processes may open the file while it is written. It is
+	// only a cache, so it need not be written out to the disk.
+	file_handle_ = CreateFile(
+		file_name.c_str(),
+		GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY,
+		NULL);
+	if (file_handle_ == INVALID_HANDLE_VALUE) {
+		std::cerr << "Could not create the time-shift ring " << file_name << "."
+			<< std::endl;
+		return;
+	}
+	// The new file is all zeros, which is an empty ring.
+	const unsigned long long file_size = data_start_ + ring_bytes_;
+	mapping_handle_ = CreateFileMapping(
+		file_handle_,
+		NULL,
+		PAGE_READWRITE,
+		static_cast<DWORD>(file_size >> 32),
+		static_cast<DWORD>(file_size),
+		NULL);
+	if (mapping_handle_ != NULL) {
+		ring_ = static_cast<unsigned char*>(MapViewOfFile(
+			mapping_handle_, FILE_MAP_ALL_ACCESS, 0, 0,
+			static_cast<SIZE_T>(file_size)));
+	}
+	if (ring_ == nullptr) {
+		std::cerr << "Could not map the time-shift ring " << file_name << "."
+			<< std::endl;
+		return;
+	}
+	// Readers in other processes learn the layout from the header.
+	TimeShiftRingHeader* header = reinterpret_cast<TimeShiftRingHeader*>(ring_);
+	header->ring_bytes = static_cast<LONG64>(ring_bytes_);
+	header->index_entries = static_cast<LONG64>(index_entries_);
+}
+
+TimeShiftRing::~TimeShiftRing() {
+	if (ring_ != nullptr) {
+		UnmapViewOfFile(ring_);
+	}
+	if (mapping_handle_ != NULL) {
+		CloseHandle(mapping_handle_);
+	}
+	if (file_handle_ != INVALID_HANDLE_VALUE) {
+		CloseHandle(file_handle_);
+	}
+}
+
+void TimeShiftRing::Append(
+	const unsigned char* jpeg, const size_t size, const long long time_us) {
+
+	if (ring_ == nullptr || size > ring_bytes_) {
+		return;
+	}
+	TRACE_SCOPE("keep frame");
+	TimeShiftRingHeader* header = reinterpret_cast<TimeShiftRingHeader*>(ring_);
+	const LONG64 frame_number = header->write_count;
+	const LONG64 offset = header->write_offset;
+	TimeShiftIndexEntry* entry = Entry(frame_number);
+	InterlockedExchange64(&entry->sequence, 2 * frame_number + 1);
+	// Claim the bytes before overwriting them, so that readers of the frames
+	// that were there notice.
+	InterlockedExchange64(
+		&header->write_offset, offset + static_cast<LONG64>(size));
+	unsigned char* data = ring_ + data_start_;
+	const size_t start = static_cast<size_t>(offset % ring_bytes_);
+	const size_t first_part = std::min(size, ring_bytes_ - start);
+	memcpy(data + start, jpeg, first_part);
+	memcpy(data, jpeg + first_part, size - first_part);
+	entry->time_us = time_us;
+	entry->offset = offset;
+	entry->size = static_cast<LONG64>(size);
+	InterlockedExchange64(&entry->sequence, 2 * frame_number + 2);
+	InterlockedExchange64(&header->write_count, frame_number + 1);
+}
+
+LONG64 TimeShiftRing::FrameCount() const {
+	return ring_ == nullptr ? 0 : Header()->write_count;
+}
+
+bool TimeShiftRing::ReadEntry(
+	const LONG64 frame_number,
+	long long* time_us,
+	LONG64* offset,
+	LONG64* size) const {
+
+	if (ring_ == nullptr || frame_number < 0) {
+		return false;
+	}
+	const TimeShiftIndexEntry* entry = Entry(frame_number);
+	const LONG64 sequence = entry->sequence;
+	MemoryBarrier();
+	*time_us = entry->time_us;
+	*offset = entry->offset;
+	*size = entry->size;
+	MemoryBarrier();
+	return sequence == 2 * frame_number + 2 && entry->sequence == sequence &&
+		IsKept(*offset);
+}
+
+bool TimeShiftRing::FindFrame(
+	const long long time_us, LONG64* frame_number) const {
+
+	const LONG64 count = FrameCount();
+	LONG64 low = std::max<LONG64>(0, count - static_cast<LONG64>(index_entries_));
+	LONG64 high = count - 1;
+	// The newest frame that is not newer than time_us, found by bisection.
+	// Frames whose bytes were overwritten count as too old.
+	LONG64 found = -1;
+	while (low <= high) {
+		const LONG64 middle = low + (high - low) / 2;
+		long long middle_time_us;
+		LONG64 offset;
+		LONG64 size;
+		if (!ReadEntry(middle, &middle_time_us, &offset, &size)) {
+			low = middle + 1;
+		} else if (middle_time_us <= time_us) {
+			found = middle;
+			low = middle + 1;
+		} else {
+			high = middle - 1;
+		}
+	}
+	if (found < 0) {
+		// All kept frames are newer, so the oldest one is the first that is
+		// still there.
+		found = low;
+	}
+	long long found_time_us;
+	if (!FrameTime(found, &found_time_us)) {
+		return false;
+	}
+	*frame_number = found;
+	return true;
+}
+
+bool TimeShiftRing::FrameTime(
+	const LONG64 frame_number, long long* time_us) const {
+
+	LONG64 offset;
+	LONG64 size;
+	return ReadEntry(frame_number, time_us, &offset, &size);
+}
+
+bool TimeShiftRing::ReadFrame(
+	const LONG64 frame_number,
+	std::vector<unsigned char>* jpeg,
+	long long* time_us) const {
+
+	LONG64 offset;
+	LONG64 size;
+	if (!ReadEntry(frame_number, time_us, &offset, &size) ||
+		size < 0 || size > static_cast<LONG64>(ring_bytes_)) {
+		return false;
+	}
+	jpeg->resize(static_cast<size_t>(size));
+	const unsigned char* data = ring_ + data_start_;
+	const size_t start = static_cast<size_t>(offset % ring_bytes_);
+	const size_t first_part =
+		std::min(jpeg->size(), ring_bytes_ - start);
+	memcpy(jpeg->data(), data + start, first_part);
+	memcpy(jpeg->data() + first_part, data, jpeg->size() - first_part);
+	// The copy is only good if the writer did not get to the frame meanwhile.
+	MemoryBarrier();
+	return Entry(frame_number)->sequence == 2 * frame_number + 2 &&
+		IsKept(offset);
+}
+
+// Plays a stream back from its TimeShiftRing when the operator pauses or
+// rewinds it (see kUseTimeShift). The playback advances with the live frames,
+// and returns to live once it catches up with them.
+class TimeShift {
+public:
+	// Keeps the frames in a ring of ring_bytes in the file name + ".timeshift".
+	// Exported clips are named after the stream as well.
+	TimeShift(const std::string& name, const size_t ring_bytes);
+
+	// Keeps a complete frame that arrived at the given time.
+	void Record(const std::vector<unsigned char>& jpeg, const long long time_us) {
+		ring_.Append(jpeg.data(), jpeg.size(), time_us);
+	}
+
+	// Handles a key that the operator pressed in the stream's window. Keys
+	// other than those of kUseTimeShift, and -1 for none, are ignored.
+	void OnKey(const int key, const long long now_us);
+
+	// Returns true while the live frames are to be shown.
+	bool IsLive() const {
+		return live_;
+	}
+
+	// Sets frame to the kept frame that is due at now_us, decoding it unless it
+	// is shown already. The held frame is handed out again while paused, so
+	// that the window keeps being shown and taking keys. Returns false if
+	// there is no frame to show.
+	bool NextFrame(const long long now_us, VideoFrame* frame);
+
+private:
+	// Returns the arrival time of the kept frames that is shown at now_us.
+	long long PositionAt(const long long now_us) const;
+
+	// Writes the kept frames from kExportClipUs before end_us up to end_us to a
+	// new MJPEG file.
+	void ExportClip(const long long end_us);
+
+	const std::string name_;
+	TimeShiftRing ring_;
+	bool live_;
+	bool paused_;
+
+	// The position that was shown at resume_time_us_, or that is shown while
+	// paused.
+	long long position_us_;
+	long long resume_time_us_;
+
+	// The kept frame shown last, or -1 to show the next one in any case, and
+	// its image.
+	LONG64 shown_frame_;
+	VideoFrame shown_image_;
+
+	int num_clips_;
+
+	// Kept frames are read into this buffer.
+	std::vector<unsigned char> jpeg_;
+};  // TimeShift
+
+TimeShift::TimeShift(const std::string& name, const size_t ring_bytes)
+	: name_(name), ring_(name + ".timeshift", ring_bytes), live_(true), paused_(false),
+	  position_us_(0), resume_time_us_(0), shown_frame_(-1), num_clips_(0) {}
+
+long long TimeShift::PositionAt(const long long now_us) const {
+	if (live_) {
+		long long newest_us;
+		return ring_.FrameTime(ring_.FrameCount() - 1, &newest_us) ?
+			newest_us : now_us;
+	}
+	if (paused_) {
+		return position_us_;
+	}
+	return position_us_ + (now_us - resume_time_us_);
+}
+
+void TimeShift::OnKey(const int key, const long long now_us) {
+	if (key < 0) {
+		return;
+	}
+	const long long position_us = PositionAt(now_us);
+	switch (key & 0xFF) {
+	case 'p':
+		if (live_ || !paused_) {
+			position_us_ = position_us;
+			paused_ = true;
+			live_ = false;
+		} else {
+			resume_time_us_ = now_us;
+			paused_ = false;
+		}
+		break;
+	case 'r': {
+		// Not further back than the oldest kept frame.
+		LONG64 oldest;
+		long long oldest_us;
+		position_us_ = position_us - kRewindStepUs;
+		if (ring_.FindFrame(position_us_, &oldest) &&
+			ring_.FrameTime(oldest, &oldest_us)) {
+			position_us_ = std::max(position_us_, oldest_us);
+		}
+		resume_time_us_ = now_us;
+		shown_frame_ = -1;
+		live_ = false;
+		break;
+	}
+	case 'l':
+		live_ = true;
+		paused_ = false;
+		break;
+	case 'e':
+		ExportClip(position_us);
+		break;
+	}
+}
+
+bool TimeShift::NextFrame(const long long now_us, VideoFrame* frame) {
+	LONG64 frame_number;
+	if (!ring_.FindFrame(PositionAt(now_us), &frame_number)) {
+		return false;
+	}
+	if (!paused_ && frame_number == ring_.FrameCount() - 1) {
+		// The playback caught up with the live frames.
+		live_ = true;
+		return false;
+	}
+	if (frame_number != shown_frame_) {
+		long long time_us;
+		if (!ring_.ReadFrame(frame_number, &jpeg_, &time_us)) {
+			return false;
+		}
+		shown_frame_ = frame_number;
+		shown_image_ = VideoFrame(jpeg_);
+	}
+	*frame = shown_image_;
+	return !frame->GetImage().empty();
+}
+
+void TimeShift::ExportClip(const long long end_us) {
+	TRACE_SCOPE("export clip");
+	LONG64 first;
+	LONG64 last;
+	if (!ring_.FindFrame(end_us - kExportClipUs, &first) ||
+		!ring_.FindFrame(end_us, &last)) {
+		return;
+	}
+	const std::string file_name =
+		name_ + "_clip" + std::to_string(++num_clips_) + ".mjpeg";
+	std::ofstream clip(file_name, std::ios::binary);
+	// The JPEGs back to back, which is how the sender replays files.
+	LONG64 num_frames = 0;
+	for (LONG64 i = first; i <= last; ++i) {
+		long long time_us;
+		if (ring_.ReadFrame(i, &jpeg_, &time_us)) {
+			clip.write(
+				reinterpret_cast<const char*>(jpeg_.data()),
+				static_cast<std::streamsize>(jpeg_.size()));
+			++num_frames;
+		}
+	}
+	std::cout << "Exported " << num_frames << " frames to " << file_name << "."
+		<< std::endl;
+}
+
+// Follows the operator's pan and zoom keys (see kUseDigitalZoom), and tells
+// the region of the frames to subscribe to.
+class ZoomControl {
+public:
+	ZoomControl() : x_(0), y_(0), size_(kWholeFrame) {}
+
+	// Handles a key that the operator pressed in the stream's window. Other
+	// keys, and -1 for none, are ignored.
+	void OnKey(const int key);
+
+	// Returns the region to subscribe to.
+	FrameRegion Region() const;
+
+private:
+	// The region is kept in 1/65536ths of the frame, like FrameRegion, but
+	// with room for the whole frame.
+	static const int kWholeFrame = 65536;
+
+	int x_;
+	int y_;
+	int size_;
+};  // ZoomControl
+
+void ZoomControl::OnKey(const int key) {
+	if (key < 0) {
+		return;
+	}
+	switch (key & 0xFF) {
+	case '+':
+	case '=':
+		// Zoom in on the center of the shown region.
+		if (size_ / 2 >= kWholeFrame / kMaxZoom) {
+			x_ += size_ / 4;
+			y_ += size_ / 4;
+			size_ /= 2;
+		}
+		break;
+	case '-':
+		x_ -= size_ / 2;
+		y_ -= size_ / 2;
+		size_ = std::min(size_ * 2, kWholeFrame);
+		break;
+	case 'w':
+		y_ -= size_ / 4;
+		break;
+	case 'a':
+		x_ -= size_ / 4;
+		break;
+	case 's':
+		y_ += size_ / 4;
+		break;
+	case 'd':
+		x_ += size_ / 4;
+		break;
+	case '0':
+		x_ = 0;
+		y_ = 0;
+		size_ = kWholeFrame;
+		break;
+	}
+	// Never beyond the edges of the frame.
+	x_ = std::min(std::max(x_, 0), kWholeFrame - size_);
+	y_ = std::min(std::max(y_, 0), kWholeFrame - size_);
+}
+
+FrameRegion ZoomControl::Region() const {
+	FrameRegion region = {};
+	if (size_ < kWholeFrame) {
+		region.x = static_cast<unsigned short>(x_);
+		region.y = static_cast<unsigned short>(y_);
+		region.width = static_cast<unsigned short>(size_);
+		region.height = static_cast<unsigned short>(size_);
+	}
+	return region;
+}
+
+// Everything that one stream needs between its socket and its window: the
+// packets are put back in order and reported back to the sender, and the
+// frames are reassembled, decoded and displayed. A stream can be received on
+// a thread of its own, or as a coroutine of the StreamRuntime.
+class StreamReceiver {
+public:
+	// Keeps the stream in a time-shift ring of time_shift_bytes, or in none
+	// if that is 0.
+	StreamReceiver(
+		const int port,
+		const std::string& window_name,
+		const size_t time_shift_bytes)
+		: window_name_(window_name), latency_stats_(window_name), next_ready_(0),
+		corrupt_packets_(0), decode_time_us_(0), render_time_us_(0),
+		dropped_frames_(0), pressed_key_(-1) {
+		if (kUsePresentationScheduler) {
+			presenter_.reset(new PresentationScheduler(window_name, &latency_stats_));
+		}
+		if (time_shift_bytes > 0) {
+			time_shift_.reset(new TimeShift(
+				"stream_" + std::to_string(port), time_shift_bytes));
+		}
+	}
+
+	// Takes a packet, or an empty one if nothing arrived for a while, and
+	// sends feedback through the socket when a report is due.
+	void OnPacket(SequencedPacket arrived, const ReceiverSocket& socket);
+
+	// Returns true and hands out the next frame that can be decoded, if the
+	// packets taken so far complete one. Call this until it returns false
+	// before taking the next packet.
+	bool NextFrame(AssembledFrame* frame);
+
+	// Decodes the frame, displays it or schedules it for display, and records
+	// its latencies.
+	void DecodeAndDisplay(const AssembledFrame& frame);
+
+	// Returns the time by which the frame has to be decoded: its presentation
+	// deadline if the presenter_ shows it, or kMaxPlayoutDelayUs after it
+	// arrived otherwise.
+	long long DecodeDeadlineUs(const AssembledFrame& frame);
+
+	// Returns how long decoding a frame of the stream takes, on average
+	// recently. This is 0 until a frame has been decoded.
+	long long ExpectedDecodeUs() const {
+		return decode_time_us_;
+	}
+
+	// Gives up on a frame that would not be decoded by its deadline.
+	void DropFrame(const AssembledFrame& frame, const long long now_us);
+
+	// Shows the idle picture while nothing arrives. With the presenter_, it
+	// is scheduled like a frame, so that only the presentation thread touches
+	// the window and gets its keys.
+	void ShowIdlePicture();
+
+private:
+	// Returns when the frame was captured, on the receiver's clock, or 0 if
+	// that is not known.
+	long long CaptureTimeUs(const AssembledFrame& frame) const;
+
+	const std::string window_name_;
+
+	FrameAssembler frame_assembler_;
+	FeedbackReporter feedback_reporter_;
+	JpegTableContext table_context_;
+	StripeDecoder stripe_decoder_;
+	QueueingDelayFilter queueing_delay_filter_;
+	StreamLatencyStats latency_stats_;
+	PacketSequencer sequencer_;
+
+	// Shows the frames when kUsePresentationScheduler is set, or null.
+	std::unique_ptr<PresentationScheduler> presenter_;
+
+	// Keeps the stream for pausing and rewinding if it was given a ring, or
+	// null.
+	std::unique_ptr<TimeShift> time_shift_;
+
+	// The region of the frames subscribed to, moved with the keys when
+	// kUseDigitalZoom is set.
+	ZoomControl zoom_;
+
+	// The JPEG of the frame decoded last, if it was decoded whole, and the key
+	// pressed when it was displayed without the presenter_.
+	std::vector<unsigned char> frame_jpeg_;
+	int pressed_key_;
+
+	// The packets in sequence order, and the next one to hand to the
+	// frame assembler.
+	std::vector<SequencedPacket> ready_;
+	size_t next_ready_;
+
+	std::vector<unsigned char> report_;
+
+	// The number of packets whose checksum did not match.
+	long long corrupt_packets_;
+
+	// See ExpectedDecodeUs(), how long showing a frame takes without the
+	// presenter_, likewise, and the number of frames dropped by DropFrame().
+	long long decode_time_us_;
+	long long render_time_us_;
+	long long dropped_frames_;
+};  // StreamReceiver
+
+void StreamReceiver::OnPacket(
+	SequencedPacket arrived, const ReceiverSocket& socket) {
+
+	ready_.clear();
+	next_ready_ = 0;
+	const long long kernel_arrival_time_us = socket.KernelArrivalTimeUs();
+	if (!arrived.data.empty() && kernel_arrival_time_us != 0) {
+		// The packet arrived when the kernel received it. The time until it was
+		// read is spent in the socket, not in the network.
+		latency_stats_.Record(
+			kStageSocket,
+			arrived.arrival_time_us - kernel_arrival_time_us);
+		arrived.arrival_time_us = kernel_arrival_time_us;
+	}
+	const long long arrival_time_us = arrived.arrival_time_us;
+	if (!arrived.data.empty() &&
+		!IsPacketIntact(arrived.data.data(), arrived.data.size())) {
+		// Damaged packets and stray datagrams on the port are neither reported
+		// nor reassembled.
+		latency_stats_.SetCount("corrupt packets", ++corrupt_packets_);
+		sequencer_.Flush(arrival_time_us, &ready_);
+		return;
+	}
+	if (!ReadPacketHeader(arrived.data.data(), arrived.data.size(), &arrived.header)) {
+		// Nothing arrived for a while, so stop waiting for missing packets.
+		sequencer_.Flush(arrival_time_us, &ready_);
+		return;
+	}
+	const PacketHeader header = arrived.header;
+	const SequenceVerdict verdict = sequencer_.AddPacket(std::move(arrived), &ready_);
+	if (verdict == SequenceVerdict::kDuplicate) {
+		return;
+	}
+	if (verdict == SequenceVerdict::kRestarted) {
+		frame_assembler_ = FrameAssembler();
+		// The reception statistics start over with the new sequence numbers.
+		feedback_reporter_ = FeedbackReporter();
+	}
+	// Every packet, including probe padding and packets that came too late to
+	// use, is reported back so that the sender can estimate the available
+	// bandwidth.
+	feedback_reporter_.OnPacketArrived(header, arrival_time_us);
+	if (feedback_reporter_.TakeReport(arrival_time_us, &report_)) {
+		socket.SendFeedback(report_);
+		feedback_reporter_.MakeSubscription(
+			kReceivePreviewsOnly ? kSubscribePreview : kSubscribeFull,
+			zoom_.Region(),
+			&report_);
+		socket.SendFeedback(report_);
+		if (feedback_reporter_.TakeReceiverReport(
+			arrival_time_us,
+			decode_time_us_,
+			presenter_ ? presenter_->RenderTimeUs() : render_time_us_,
+			&report_)) {
+			socket.SendFeedback(report_);
+		}
+	}
+	sequencer_.Flush(arrival_time_us, &ready_);
+}
+
+bool StreamReceiver::NextFrame(AssembledFrame* frame) {
+	// The packets are handed over in sequence order, so a frame is never
+	// given up on just because its last fragment was overtaken.
+	while (next_ready_ < ready_.size()) {
+		const SequencedPacket& packet = ready_[next_ready_++];
+		const PacketHeader& header = packet.header;
+		if (header.type == kPacketTypeTables) {
+			table_context_.SetTables(
+				packet.data.data() + kPacketHeaderSize,
+				packet.data.size() - kPacketHeaderSize);
+			continue;
+		}
+		// Previews are numbered apart from the frames, so the assembler only
+		// ever sees one of the two.
+		if (header.type !=
+			(kReceivePreviewsOnly ? kPacketTypePreview : kPacketTypeFrame)) {
+			continue;
+		}
+		if (frame_assembler_.AddFragment(
+			header,
+			packet.data.data() + kPacketHeaderSize,
+			packet.data.size() - kPacketHeaderSize,
+			packet.arrival_time_us,
+			frame)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void StreamReceiver::DecodeAndDisplay(const AssembledFrame& frame) {
+	const long long decode_start_us = NowMicroseconds();
+	VideoFrame video_frame;
+	FrameTrace trace;
+	bool has_trace = false;
+	if (!stripe_decoder_.Decode(
+		frame, table_context_, &video_frame, &trace, &has_trace, &frame_jpeg_)) {
+		return;
+	}
+	const long long display_start_us = NowMicroseconds();
+	// Without fragment 0, the sender's stage timestamps are lost.
+	const FrameArrival& arrival = frame.arrival;
+	if (has_trace) {
+		RecordTracedStages(trace, &latency_stats_);
+		latency_stats_.Record(kStageSend, static_cast<int>(arrival.last_send_time_us -
+			(trace.capture_start_us + trace.stage_end_us[kStagePacketize])));
+	}
+	latency_stats_.Record(kStageReceive, queueing_delay_filter_.Update(
+		arrival.last_arrival_us, arrival.last_send_time_us));
+	latency_stats_.Record(
+		kStageReassemble, arrival.last_arrival_us - arrival.first_arrival_us);
+	latency_stats_.Record(kStageDecode, display_start_us - decode_start_us);
+	// A moving average over the last few frames.
+	decode_time_us_ += (display_start_us - decode_start_us - decode_time_us_) / 8;
+	sequencer_.ReportStats(&latency_stats_);
+	const int key = presenter_ ? presenter_->TakeKey() : pressed_key_;
+	pressed_key_ = -1;
+	if (kUseDigitalZoom) {
+		zoom_.OnKey(key);
+	}
+	if (time_shift_) {
+		if (!frame_jpeg_.empty()) {
+			time_shift_->Record(frame_jpeg_, arrival.last_arrival_us);
+		}
+		time_shift_->OnKey(key, display_start_us);
+		if (!time_shift_->IsLive()) {
+			// Show the kept frame that is due instead, or the held one again,
+			// which also lets the window take the key that resumes.
+			if (!time_shift_->NextFrame(display_start_us, &video_frame)) {
+				return;
+			}
+			has_trace = false;
+		}
+	}
+	if (presenter_) {
+		const long long capture_time_us = has_trace ?
+			queueing_delay_filter_.ToReceiverTime(
+				trace.capture_start_us, display_start_us) : 0;
+		presenter_->Schedule(
+			std::move(video_frame), capture_time_us, display_start_us);
+		return;
+	}
+	pressed_key_ = video_frame.Display(window_name_);
+	const long long render_time_us = NowMicroseconds() - display_start_us;
+	latency_stats_.Record(kStageDisplay, render_time_us);
+	render_time_us_ += (render_time_us - render_time_us_) / 8;
+}
+
+void StreamReceiver::ShowIdlePicture() {
+	if (!presenter_) {
+		::ShowIdlePicture(window_name_);
+		return;
+	}
+	const cv::Mat picture = cv::imread("our_team.jpg");
+	presenter_->Schedule(VideoFrame(picture), 0, NowMicroseconds());
+}
+
+long long StreamReceiver::CaptureTimeUs(const AssembledFrame& frame) const {
+	// Only fragment 0 carries the sender's stage timestamps.
+	FrameTrace trace;
+	if (frame.fragments.empty() || !frame.received[0] ||
+		frame.fragments[0].size() < kFragmentInfoSize ||
+		!ReadFrameTrace(
+			frame.fragments[0].data() + kFragmentInfoSize,
+			frame.fragments[0].size() - kFragmentInfoSize,
+			&trace)) {
+		return 0;
+	}
+	return queueing_delay_filter_.ToReceiverTime(
+		trace.capture_start_us, frame.arrival.last_arrival_us);
+}
+
+long long StreamReceiver::DecodeDeadlineUs(const AssembledFrame& frame) {
+	const long long capture_time_us = CaptureTimeUs(frame);
+	if (presenter_ && capture_time_us != 0) {
+		return presenter_->DeadlineUs(capture_time_us);
+	}
+	return frame.arrival.last_arrival_us + kMaxPlayoutDelayUs;
+}
+
+void StreamReceiver::DropFrame(const AssembledFrame& frame, const long long now_us) {
+	latency_stats_.SetCount("frames dropped before decode", ++dropped_frames_);
+	const long long capture_time_us = CaptureTimeUs(frame);
+	if (presenter_ && capture_time_us != 0) {
+		// Otherwise the playout delay would never grow to fit such frames.
+		presenter_->OnFrameDropped(capture_time_us, now_us + decode_time_us_);
+	}
+}
+
+// Moves the calling thread to the NUMA node, and preferably to the core, on
+// which receive-side scaling processes the socket's packets, so that they are
+// still in that core's cache when they are read. Does nothing if the system
+// does not tell.
+void FollowReceiveQueue(const SOCKET socket) {
+	if (!kUseNumaPlacement) {
+		return;
+	}
+	SOCKET_PROCESSOR_AFFINITY affinity = {};
+	DWORD num_bytes = 0;
+	if (WSAIoctl(
+		socket, SIO_QUERY_RSS_PROCESSOR_INFO, nullptr, 0,
+		&affinity, sizeof(affinity), &num_bytes, nullptr, nullptr) != 0) {
+		return;
+	}
+	PinThreadToNode(affinity.NumaNodeId);
+	SetThreadIdealProcessorEx(GetCurrentThread(), &affinity.Processor, nullptr);
+}
+
+//输入参数：监听的端口号 OpenCV显示窗口的序号
+void receive(int port, std::string kWindowName_id) {
+
+	TRACE_THREAD_NAME("receive on port " + std::to_string(port));
+	WSADATA wsaData;
+	WORD sockVersion = MAKEWORD(2, 2);
+	if (WSAStartup(sockVersion, &wsaData) != 0)
+	{
+		exit(0);
+	}
+
+	if (kUseSharedMemoryTransport) {
+		// Frames from the same machine are decoded straight out of the ring.
+		const SharedMemoryReceiver ring(port);
+		if (!ring.BindSocketToListen()) {
+			std::cerr << "Could not open shared-memory ring." << std::endl;
+			exit(-1);
+		}
+		std::cout << "Listening on shared-memory ring " << port << "." << std::endl;
+		StreamLatencyStats latency_stats(kWindowName_id);
+		while (true) {  // TODO: break out cleanly when done.
+			VideoFrame video_frame = ring.GetFrame(kWindowName_id, &latency_stats);
+			const long long display_start_us = NowMicroseconds();
+			video_frame.Display(kWindowName_id);
+			latency_stats.Record(kStageDisplay, NowMicroseconds() - display_start_us);
+		}
+	}
+
+	const ReceiverSocket socket(port);
+	if (!socket.BindSocketToListen()) {
+		std::cerr << "Could not bind socket." << std::endl;
+		//system("pause");
+		exit(-1);
+	}
+	std::cout << "Listening on port " << port << "." << std::endl;
+	
+	if (kUseBusyPoll) {
+		// The spinning thread takes a core of its own, so that it neither
+		// competes with nor is migrated between the other threads.
+		static std::atomic<int> next_busy_poll_core(kBusyPollFirstCore);
+		const int core = next_busy_poll_core++;
+		SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << core);
+	}
+	StreamReceiver stream(
+		port, kWindowName_id, kUseTimeShift ? kTimeShiftRingBytes : 0);
+	AssembledFrame frame;
+	// A thread that busy polls stays on its own core.
+	bool placed = kUseBusyPoll;
+	while (true) {  // TODO: break out cleanly when done.
+		SequencedPacket arrived;
+		// The stream shows the idle picture itself, see below.
+		arrived.data = socket.GetPacket(std::string());
+		arrived.arrival_time_us = NowMicroseconds();
+		if (arrived.data.empty()) {
+			stream.ShowIdlePicture();
+		}
+		if (!placed && !arrived.data.empty()) {
+			// The receive queue is only known once packets arrive.
+			FollowReceiveQueue(socket.handle());
+			placed = true;
+		}
+		stream.OnPacket(std::move(arrived), socket);
+		while (stream.NextFrame(&frame)) {
+			const long long now_us = NowMicroseconds();
+			if (kUseDeadlineScheduling &&
+				now_us + stream.ExpectedDecodeUs() > stream.DecodeDeadlineUs(frame)) {
+				stream.DropFrame(frame, now_us);
+				continue;
+			}
+			stream.DecodeAndDisplay(frame);
+		}
+	}
+
+}
+
+// The return type of a stream coroutine. The coroutine does not start until
+// it is posted to an event loop, and frees itself when it returns.
+struct StreamTask {
+	struct promise_type {
+		StreamTask get_return_object() {
+			return StreamTask{
+				coro::coroutine_handle<promise_type>::from_promise(*this)};
+		}
+		coro::suspend_always initial_suspend() { return {}; }
+		coro::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	coro::coroutine_handle<promise_type> handle;
 };
 
-class VideoCapture {
+// Runs coroutines on one thread. A coroutine is resumed when a socket it waits
+// for becomes readable, when its deadline passes, or when another thread posts
+// it back, e.g. once its decode task is done. All sockets are waited for with a
+// single WSAPoll(), so one loop serves many streams.
+class EventLoop {
 public:
-	// Initializes the OpenCV VideoCapture object by selecting the default
-	// camera. If no camera is provided it will not be possile to read any video
-	// frames.
-	//
-	// Specify whether or not the video being sent is displayed in a window, and
-	// the scale = (0, 1] which will affect the size of the data.
-	VideoCapture(const bool show_video, const float scale);
+	EventLoop();
 
-	// Captures and returns a frame from the available video camera.
-	//
-	// If the show_video option was set to true, the frame will be displayed.
-	//
-	// NOTE: This method cannot be const, since the cv::VideoCapture object is
-	// modified through a non-const method when getting a new frame from the
-	// camera.
-	VideoFrame GetFrameFromCamera();
+	// Destroys the coroutines that were posted after Run() returned.
+	~EventLoop();
 
-private:
-	// The OpenCV camera capture object. This is used to interface with a
-	// connected camera and extract frames from it.
-	cv::VideoCapture capture_;
+	// Runs the coroutines until Stop() is called. Coroutines still waiting
+	// then are destroyed.
+	void Run();
 
-	// The image scale should be between (0 and 1]. The image will be
-	// downsampled by the given amount to reduce cost of sending the data.
-	const float scale_;
+	// Makes Run() return. Can be called from any thread.
+	void Stop();
 
-	// Set to true to show the video.
-	const bool show_video_;
-};
+	// Resumes the coroutine on the loop. Can be called from any thread.
+	void Post(coro::coroutine_handle<> handle);
 
-VideoCapture::VideoCapture(const bool show_video, const float scale)
-	: show_video_(show_video), scale_(scale), capture_(cv::VideoCapture(0)) {
+	// Suspends the coroutine until the socket is readable, or until the
+	// deadline (on the NowMicroseconds() clock) passes. Evaluates to true if
+	// the socket is readable. Pass INVALID_SOCKET to only wait for the time.
+	class ReadableAwaiter {
+	public:
+		ReadableAwaiter(EventLoop* loop, const SOCKET socket, const long long deadline_us)
+			: loop_(loop), socket_(socket), deadline_us_(deadline_us), readable_(false) {}
 
-	// TODO: Verify that the scale is in the appropriate range.
-}
+		bool await_ready() const { return false; }
+		void await_suspend(coro::coroutine_handle<> handle);
+		bool await_resume() const { return readable_; }
 
+	private:
+		friend class EventLoop;
 
+		EventLoop* const loop_;
+		const SOCKET socket_;
+		const long long deadline_us_;
+		coro::coroutine_handle<> handle_;
+		bool readable_;
+	};
 
-// The name of the window in which all frames will be displayed. If a new frame
-// is displayed, it will replace the previous frame displayed in that window.
-std::string kWindowName_id1 = "Streaming Video";
-std::string kWindowName_id2 = "Streaming Video";
-std::string kWindowName_id3 = "Streaming Video";
+	ReadableAwaiter WaitReadable(const SOCKET socket, const long long deadline_us) {
+		return ReadableAwaiter(this, socket, deadline_us);
+	}
 
-// Delays thread execution for this amount of time after a frame is displayed.
-// This prevents the window from being refreshed too often, which can cause
-// display issues.
-constexpr int kDisplayDelayTimeMS = 15;
+	// The buffer that the streams on the loop receive their packets into. It
+	// is only used between suspensions, so they can all share it.
+	char* receive_buffer() {
+		return receive_buffer_.data();
+	}
 
-// JPEG compression values.
-static const std::string kJPEGExtension = ".jpg";
-constexpr int kJPEGQuality = 90;
+private:
+	// Wakes the loop up from WSAPoll(), by sending a byte to wake_socket_.
+	void Wake();
 
+	// Resumes the coroutines posted by other threads.
+	void ResumePosted();
 
-VideoFrame::VideoFrame(const std::vector<unsigned char> frame_bytes) {
-	frame_image_ = cv::imdecode(frame_bytes, cv::IMREAD_COLOR);
+	// The coroutines waiting for a socket or for their deadline.
+	std::vector<ReadableAwaiter*> waiters_;
+
+	// The sockets of waiters_, preceded by wake_socket_. Rebuilt for each
+	// WSAPoll().
+	std::vector<WSAPOLLFD> poll_fds_;
+
+	// A UDP socket bound to the loopback address, which becomes readable when
+	// another thread posts a coroutine.
+	SOCKET wake_socket_;
+	sockaddr_in wake_addr_;
+	std::atomic<bool> wake_pending_;
+
+	std::mutex posted_mutex_;
+	std::vector<coro::coroutine_handle<>> posted_;
+	std::atomic<bool> stopped_;
+
+	std::vector<char> receive_buffer_;
+};  // EventLoop
+
+EventLoop::EventLoop()
+	: wake_pending_(false), stopped_(false), receive_buffer_(kMaxPacketBufferSize) {
+	wake_socket_ = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(reinterpret_cast<char*>(&wake_addr_), 0, sizeof(wake_addr_));
+	wake_addr_.sin_family = AF_INET;
+	wake_addr_.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	wake_addr_.sin_port = 0;
+	socklen_t addrlen = sizeof(wake_addr_);
+	// Let the system pick the port, and find out which it picked.
+	if (bind(wake_socket_, reinterpret_cast<sockaddr*>(&wake_addr_), sizeof(wake_addr_)) < 0 ||
+		getsockname(wake_socket_, reinterpret_cast<sockaddr*>(&wake_addr_), &addrlen) < 0) {
+		std::cerr << "Could not create the event loop's wake-up socket." << std::endl;
+		exit(-1);
+	}
+	u_long non_blocking = 1;
+	ioctlsocket(wake_socket_, FIONBIO, &non_blocking);
 }
 
-void VideoFrame::Display(std::string kWindowName)  {
-	// Do nothing for empty images.
-	if (frame_image_.empty()) {
-		return;
+EventLoop::~EventLoop() {
+	for (coro::coroutine_handle<> handle : posted_) {
+		handle.destroy();
 	}
+	closesocket(wake_socket_);
+}
 
-	cv::namedWindow(kWindowName, CV_WINDOW_NORMAL);
+void EventLoop::ReadableAwaiter::await_suspend(coro::coroutine_handle<> handle) {
+	handle_ = handle;
+	loop_->waiters_.push_back(this);
+}
 
-	SYSTEMTIME sys;	GetLocalTime(&sys);
+void EventLoop::Post(coro::coroutine_handle<> handle) {
+	{
+		std::lock_guard<std::mutex> lock(posted_mutex_);
+		posted_.push_back(handle);
+	}
+	Wake();
+}
 
-	std::string hour = std::to_string(sys.wHour);
-	std::string min = std::to_string(sys.wMinute);
-	std::string sec = std::to_string(sys.wSecond);
-	std::string ms = std::to_string(sys.wMilliseconds);
-	std::string text = hour + ":" + min + ":" + sec + "." + ms;
-	cv::putText(frame_image_, text, cv::Point2f(16, 40), cv::FONT_HERSHEY_COMPLEX_SMALL, 1.6, cv::Scalar(0, 0, 255), 2);
-	cv::imshow(kWindowName, frame_image_);
-	cv::waitKey(kDisplayDelayTimeMS);
+void EventLoop::Stop() {
+	stopped_ = true;
+	Wake();
 }
 
-std::vector<unsigned char> VideoFrame::GetJPEG() const {
-	const std::vector<int> compression_params = {
-		cv::IMWRITE_JPEG_QUALITY,
-		kJPEGQuality
-	};
-	std::vector<unsigned char> data_buffer;
-	cv::imencode(kJPEGExtension, frame_image_, data_buffer, compression_params);
-	return data_buffer;
+void EventLoop::Wake() {
+	// One byte wakes the loop up, no matter how many coroutines were posted.
+	if (wake_pending_.exchange(true)) {
+		return;
+	}
+	const char wake_byte = 0;
+	sendto(
+		wake_socket_, &wake_byte, 1, 0,
+		reinterpret_cast<const sockaddr*>(&wake_addr_), sizeof(wake_addr_));
 }
 
-class BasicProtocolData : public ProtocolData {
-public:
-	std::vector<unsigned char> PackageData() const;
+void EventLoop::ResumePosted() {
+	std::vector<coro::coroutine_handle<>> posted;
+	{
+		std::lock_guard<std::mutex> lock(posted_mutex_);
+		posted.swap(posted_);
+	}
+	for (coro::coroutine_handle<> handle : posted) {
+		handle.resume();
+	}
+}
 
-	void UnpackData(
-		const std::vector<unsigned char>& raw_bytes) override;
+void EventLoop::Run() {
+	std::vector<ReadableAwaiter*> due;
+	while (!stopped_) {
+		ResumePosted();
 
-	// Sets the next video frame.
-	void SetImage(const VideoFrame& image) {
-		video_frame_ = image;
+		// Wait until a socket is readable or the next deadline passes.
+		const long long now_us = NowMicroseconds();
+		long long timeout_us = -1;
+		poll_fds_.resize(1);
+		poll_fds_[0].fd = wake_socket_;
+		poll_fds_[0].events = POLLRDNORM;
+		for (const ReadableAwaiter* waiter : waiters_) {
+			const long long remaining_us = std::max(waiter->deadline_us_ - now_us, 0LL);
+			if (timeout_us < 0 || remaining_us < timeout_us) {
+				timeout_us = remaining_us;
+			}
+			if (waiter->socket_ != INVALID_SOCKET) {
+				WSAPOLLFD poll_fd;
+				poll_fd.fd = waiter->socket_;
+				poll_fd.events = POLLRDNORM;
+				poll_fds_.push_back(poll_fd);
+			}
+		}
+		{
+			TRACE_SCOPE("poll");
+			// Round the timeout up, so that a deadline is never polled for
+			// over and over just before it passes.
+			WSAPoll(
+				poll_fds_.data(),
+				static_cast<unsigned long>(poll_fds_.size()),
+				timeout_us < 0 ? -1 : static_cast<int>((timeout_us + 999) / 1000));
+		}
+
+		if (poll_fds_[0].revents != 0) {
+			wake_pending_ = false;
+			char wake_bytes[64];
+			while (recv(wake_socket_, wake_bytes, sizeof(wake_bytes), 0) > 0) {
+			}
+		}
+
+		// Take the coroutines that can go on out of waiters_ first, since
+		// resuming them adds to it.
+		const long long poll_end_us = NowMicroseconds();
+		size_t next_fd = 1;
+		size_t num_waiting = 0;
+		for (ReadableAwaiter* waiter : waiters_) {
+			if (waiter->socket_ != INVALID_SOCKET) {
+				waiter->readable_ = poll_fds_[next_fd++].revents != 0;
+			}
+			if (waiter->readable_ || waiter->deadline_us_ <= poll_end_us) {
+				due.push_back(waiter);
+			} else {
+				waiters_[num_waiting++] = waiter;
+			}
+		}
+		waiters_.resize(num_waiting);
+		for (ReadableAwaiter* waiter : due) {
+			waiter->handle_.resume();
+		}
+		due.clear();
 	}
 
-	// Returns the video frame image.
-	VideoFrame GetImage() const {
-		return video_frame_;
+	for (ReadableAwaiter* waiter : waiters_) {
+		waiter->handle_.destroy();
+	}
+	waiters_.clear();
+	std::lock_guard<std::mutex> lock(posted_mutex_);
+	for (coro::coroutine_handle<> handle : posted_) {
+		handle.destroy();
 	}
+	posted_.clear();
+}
+
+// Runs the tasks of all streams on one worker thread per core. Each worker has
+// a deque of its own, which tasks are spread over. A worker takes the oldest
+// task from the front of its deque, and when it runs dry, steals from the back
+// of another worker's deque, so that no core idles while another has tasks
+// queued. Taking the oldest task first, rather than the newest as work
+// stealing usually does, keeps the latency of each frame low.
+//
+// The workers are spread over the NUMA nodes and pinned to them. A task can be
+// submitted to the workers of a node, and workers steal from their own node
+// before they steal across nodes.
+//
+// Tasks may run in parallel and finish in any order. A stream coroutine keeps
+// its frames in order by waiting for each task before it submits the next.
+class TaskPool {
+public:
+	explicit TaskPool(const unsigned int num_workers);
+
+	// Lets the workers run the tasks that are queued, and those that these
+	// queue in turn, and joins them.
+	~TaskPool();
+
+	// Queues the task for a worker of the given node, or of any node if it is
+	// -1. A task submitted from a worker of that node goes to that worker's
+	// deque, since the data it works on is likely still in that core's cache.
+	void Submit(std::function<void()> task, const int node = -1);
 
 private:
-	// The video frame received from the packet is stored here.
-	VideoFrame video_frame_;
-};
+	struct Worker {
+		int node;
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
 
-std::vector<unsigned char> BasicProtocolData::PackageData() const {
-	return video_frame_.GetJPEG();
+	void Work(const size_t index);
+
+	// Takes a task from the worker's deque, or steals one from another.
+	bool TakeTask(const size_t index, std::function<void()>* task);
+
+	// Takes the oldest task of the worker, or steals its newest one.
+	bool TakeTaskFrom(Worker* worker, const bool steal, std::function<void()>* task);
+
+	std::vector<std::unique_ptr<Worker>> workers_;
+
+	// The number of tasks in all deques. Idle workers sleep on task_added_
+	// until it is nonzero.
+	std::atomic<size_t> num_queued_;
+	std::mutex idle_mutex_;
+	std::condition_variable task_added_;
+
+	std::atomic<size_t> next_worker_;
+	std::atomic<bool> stopped_;
+	std::vector<std::thread> threads_;
+};  // TaskPool
+
+// The pool and the index of the worker that the current thread is, if any.
+thread_local const TaskPool* current_task_pool = nullptr;
+thread_local size_t current_worker_index = 0;
+
+TaskPool::TaskPool(const unsigned int num_workers)
+	: num_queued_(0), next_worker_(0), stopped_(false) {
+	const int num_nodes = NumaNodeCount();
+	for (unsigned int i = 0; i < std::max(num_workers, 1u); ++i) {
+		workers_.push_back(std::unique_ptr<Worker>(new Worker()));
+		workers_.back()->node = static_cast<int>(i % num_nodes);
+	}
+	for (size_t i = 0; i < workers_.size(); ++i) {
+		threads_.push_back(std::thread([this, i] {
+			TRACE_THREAD_NAME("task worker " + std::to_string(i));
+			PinThreadToNode(workers_[i]->node);
+			current_task_pool = this;
+			current_worker_index = i;
+			Work(i);
+		}));
+	}
 }
 
-void BasicProtocolData::UnpackData(
-	const std::vector<unsigned char>& raw_bytes) {
-	if (!raw_bytes.empty())
+TaskPool::~TaskPool() {
 	{
-		video_frame_ = VideoFrame(raw_bytes);
+		std::lock_guard<std::mutex> lock(idle_mutex_);
+		stopped_ = true;
 	}
-	else
-	{
-		video_frame_ = VideoFrame();
+	task_added_.notify_all();
+	for (std::thread& thread : threads_) {
+		thread.join();
 	}
 }
 
-ReceiverSocket::ReceiverSocket(const int port_number) : port_(port_number) {
-	socket_handle_ = socket(AF_INET, SOCK_DGRAM, 0);
+void TaskPool::Submit(std::function<void()> task, const int node) {
+	size_t index = current_worker_index;
+	if (current_task_pool != this ||
+		(node >= 0 && workers_[index]->node != node)) {
+		index = next_worker_++ % workers_.size();
+		// Move on to the next worker of the node, if it has any.
+		for (size_t i = 0; node >= 0 && i < workers_.size(); ++i) {
+			const size_t candidate = (index + i) % workers_.size();
+			if (workers_[candidate]->node == node) {
+				index = candidate;
+				break;
+			}
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lock(workers_[index]->mutex);
+		workers_[index]->tasks.push_back(std::move(task));
+	}
+	{
+		// Taking the lock makes sure that a worker about to sleep sees the
+		// task.
+		std::lock_guard<std::mutex> lock(idle_mutex_);
+		++num_queued_;
+	}
+	task_added_.notify_one();
 }
 
-const bool ReceiverSocket::BindSocketToListen() const {
-	if (socket_handle_ == INVALID_SOCKET) {
-		std::cerr << "Binding failed. Socket was not initialized." << std::endl;
-		return false;
+bool TaskPool::TakeTask(const size_t index, std::function<void()>* task) {
+	if (TakeTaskFrom(workers_[index].get(), false, task)) {
+		return true;
+	}
+	const int node = workers_[index]->node;
+	for (const bool same_node : {true, false}) {
+		for (size_t i = 1; i < workers_.size(); ++i) {
+			Worker* victim = workers_[(index + i) % workers_.size()].get();
+			if ((victim->node == node) == same_node &&
+				TakeTaskFrom(victim, true, task)) {
+				return true;
+			}
+		}
 	}
+	return false;
+}
 
-	//Ϊģʽ  
-	int imode = 1;
-	int rev = 0;
+bool TaskPool::TakeTaskFrom(
+	Worker* worker, const bool steal, std::function<void()>* task) {
 
-	rev = ioctlsocket(socket_handle_, FIONBIO, (u_long *)&imode);//Ϊģʽ
-	if (rev == SOCKET_ERROR)
-	{
-		printf("ioctlsocket failed!");
-		closesocket(socket_handle_);
-		WSACleanup();
-		exit(-1);
+	std::lock_guard<std::mutex> lock(worker->mutex);
+	if (worker->tasks.empty()) {
+		return false;
 	}
+	if (steal) {
+		*task = std::move(worker->tasks.back());
+		worker->tasks.pop_back();
+	} else {
+		*task = std::move(worker->tasks.front());
+		worker->tasks.pop_front();
+	}
+	--num_queued_;
+	return true;
+}
 
-	// Bind socket's address to INADDR_ANY because it's only receiving data, and
-	// does not need a valid address.
-	sockaddr_in socket_addr;
-	memset(reinterpret_cast<char*>(&socket_addr), 0, sizeof(socket_addr));
-	socket_addr.sin_family = AF_INET;
-	socket_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	// Bind the socket to the port that will be listened on.
-	socket_addr.sin_port = htons(port_);
-	const int bind_status = bind(
-		socket_handle_,
-		reinterpret_cast<sockaddr*>(&socket_addr),
-		sizeof(socket_addr));
-	if (bind_status < 0) {
-		std::cerr << "Binding failed. Could not bind the socket." << std::endl;
-		return false;
+void TaskPool::Work(const size_t index) {
+	while (true) {
+		std::function<void()> task;
+		if (TakeTask(index, &task)) {
+			task();
+			continue;
+		}
+		if (stopped_) {
+			return;
+		}
+		TRACE_SCOPE("wait for task");
+		std::unique_lock<std::mutex> lock(idle_mutex_);
+		task_added_.wait(lock, [this] { return stopped_ || num_queued_ > 0; });
 	}
+}
 
-	return true;
+// Decides which of the frames that wait for the TaskPool is decoded next:
+// the one that is due first (earliest deadline first). A frame that could not
+// be decoded by its deadline anymore is dropped instead, so that under
+// overload the workers only spend time on frames that will be shown.
+//
+// Streams can be weighted. The deadline of a frame of a stream with weight w
+// is brought forward to a w-th of the time left until it, so that heavier
+// streams go first when frames are due at about the same time. The actual
+// deadline still decides whether a frame is dropped.
+class DecodeScheduler {
+public:
+	explicit DecodeScheduler(TaskPool* pool) : pool_(pool), dropping_(false) {}
+
+	// Queues a frame that is due by deadline_us and is expected to take
+	// decode_us. Either decode or drop is called on a worker of the given node
+	// once it is the frame's turn.
+	void Submit(
+		const long long deadline_us,
+		const double weight,
+		const long long decode_us,
+		std::function<void()> decode,
+		std::function<void()> drop,
+		const int node);
+
+	// Has the jobs that are waiting, and those submitted from now on, dropped
+	// rather than decoded, so that shutting down does not wait for decodes.
+	void DropAll();
+
+private:
+	struct Job {
+		long long deadline_us;
+		long long decode_us;
+		std::function<void()> decode;
+		std::function<void()> drop;
+	};
+
+	// Runs or drops the job that is due first. One of these is submitted to
+	// the pool per job, so that every job is taken by exactly one of them.
+	void RunEarliest();
+
+	TaskPool* const pool_;
+	std::mutex mutex_;
+	bool dropping_;
+
+	// The waiting jobs by weighted deadline. Jobs with the same one keep the
+	// order in which they were submitted.
+	std::multimap<long long, Job> jobs_;
+};  // DecodeScheduler
+
+void DecodeScheduler::Submit(
+	const long long deadline_us,
+	const double weight,
+	const long long decode_us,
+	std::function<void()> decode,
+	std::function<void()> drop,
+	const int node) {
+
+	const long long now_us = NowMicroseconds();
+	const long long priority_us =
+		now_us + static_cast<long long>((deadline_us - now_us) / std::max(weight, 0.01));
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		Job job = { deadline_us, decode_us, std::move(decode), std::move(drop) };
+		jobs_.insert(std::make_pair(priority_us, std::move(job)));
+	}
+	pool_->Submit([this] {
+		RunEarliest();
+	}, node);
 }
 
-const std::vector<unsigned char> ReceiverSocket::GetPacket(std::string kWindowName) const {
-	// Get the data from the next incoming packet.
-	fd_set rfd;                       // ûһõ
-	struct timeval timeout;			 //selectȴʱ
-	timeout.tv_sec = 1;               //selectҪõ
-	timeout.tv_usec = 0;              //timeoutΪ0Ϊ
-	int SelectRcv;
+void DecodeScheduler::DropAll() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	dropping_ = true;
+}
 
-	//UDPݽ
-	FD_ZERO(&rfd);					//һ
-	FD_SET(socket_handle_, &rfd);		//sockҪԵ
-	SelectRcv = select(socket_handle_ + 1, &rfd, 0, 0, &timeout); //׽Ƿɶ
-	if (FD_ISSET(socket_handle_, &rfd))//׽־fd_set˵ͻѾconnect󷢹ˣϿacceptɹ
+void DecodeScheduler::RunEarliest() {
+	Job job;
+	bool dropping = false;
 	{
-		sockaddr_in remote_addr;
-		socklen_t addrlen = sizeof(remote_addr);
-		const int num_bytes = recvfrom(
-			socket_handle_,
-			(char*)(buffer_),
-			kMaxPacketBufferSize,
-			0,
-			(sockaddr*)(&remote_addr),
-			&addrlen);
-		// Copy the data (i	f any) into the data vector.
-		std::vector<unsigned char> data;
-
-		if (num_bytes > 0) {
-			data.insert(data.end(), &buffer_[0], &buffer_[num_bytes]);
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (jobs_.empty()) {
+			return;
 		}
-		return data;
+		job = std::move(jobs_.begin()->second);
+		jobs_.erase(jobs_.begin());
+		dropping = dropping_;
 	}
-		else
-		{
-			cv::Mat picture = cv::imread("our_team.jpg");
-			cv::namedWindow(kWindowName, CV_WINDOW_NORMAL);
+	if (dropping || NowMicroseconds() + job.decode_us > job.deadline_us) {
+		TRACE_SCOPE("drop late frame");
+		job.drop();
+		return;
+	}
+	job.decode();
+}
 
-			cv::imshow(kWindowName, picture);
-			cv::waitKey(kDisplayDelayTimeMS);
+// Suspends a stream coroutine while the job runs on the pool, and resumes it
+// on the given event loop afterwards. The job may refer to the coroutine's
+// locals, since the coroutine does not run in the meantime.
+class TaskAwaiter {
+public:
+	TaskAwaiter(TaskPool* pool, EventLoop* loop, std::function<void()> job)
+		: pool_(pool), loop_(loop), job_(std::move(job)) {}
 
-			std::vector<unsigned char> data;
+	bool await_ready() const { return false; }
 
-			data.clear();
-			//frame_image_.clear();
+	void await_suspend(coro::coroutine_handle<> handle) {
+		// The loop is pinned to a node, so the job stays on that node too.
+		pool_->Submit([this, handle] {
+			job_();
+			loop_->Post(handle);
+		}, CurrentNumaNode());
+	}
 
-			return data;
-		}
-	
+	void await_resume() const {}
+
+private:
+	TaskPool* const pool_;
+	EventLoop* const loop_;
+	std::function<void()> job_;
+};  // TaskAwaiter
+
+// Like TaskAwaiter, but hands a frame's decode to the DecodeScheduler, which
+// runs either the decode or the drop job.
+class DecodeAwaiter {
+public:
+	DecodeAwaiter(
+		DecodeScheduler* scheduler,
+		EventLoop* loop,
+		const long long deadline_us,
+		const double weight,
+		const long long decode_us,
+		std::function<void()> decode,
+		std::function<void()> drop)
+		: scheduler_(scheduler), loop_(loop), deadline_us_(deadline_us),
+		weight_(weight), decode_us_(decode_us), decode_(std::move(decode)),
+		drop_(std::move(drop)) {}
+
+	bool await_ready() const { return false; }
 
+	void await_suspend(coro::coroutine_handle<> handle) {
+		scheduler_->Submit(deadline_us_, weight_, decode_us_, [this, handle] {
+			decode_();
+			loop_->Post(handle);
+		}, [this, handle] {
+			drop_();
+			loop_->Post(handle);
+		}, CurrentNumaNode());
+	}
+
+	void await_resume() const {}
+
+private:
+	DecodeScheduler* const scheduler_;
+	EventLoop* const loop_;
+	const long long deadline_us_;
+	const double weight_;
+	const long long decode_us_;
+	std::function<void()> decode_;
+	std::function<void()> drop_;
+};  // DecodeAwaiter
+
+// Receives one stream on the given event loop, like receive() does on a thread
+// of its own. The idle picture is not shown, since with many streams there are
+// no windows to spare for idle ones.
+StreamTask ReceiveStream(
+	EventLoop* loop,
+	TaskPool* task_pool,
+	DecodeScheduler* decode_scheduler,
+	const int port,
+	const std::string window_name,
+	const double weight,
+	const size_t time_shift_bytes) {
+
+	const ReceiverSocket socket(port);
+	if (!socket.BindSocketToListen()) {
+		std::cerr << "Could not bind socket on port " << port << "." << std::endl;
+		co_return;
+	}
+	StreamReceiver stream(port, window_name, time_shift_bytes);
+	AssembledFrame frame;
+	while (true) {
+		const bool readable = co_await loop->WaitReadable(
+			socket.handle(), NowMicroseconds() + kStreamIdleTimeoutUs);
+		// Take all the packets that are waiting before waiting again.
+		do {
+			SequencedPacket arrived;
+			if (readable) {
+				arrived.data = socket.TryGetPacket(loop->receive_buffer());
+			}
+			arrived.arrival_time_us = NowMicroseconds();
+			const bool received = !arrived.data.empty();
+			stream.OnPacket(std::move(arrived), socket);
+			while (stream.NextFrame(&frame)) {
+				if (kUseDeadlineScheduling) {
+					co_await DecodeAwaiter(
+						decode_scheduler, loop,
+						stream.DecodeDeadlineUs(frame), weight,
+						stream.ExpectedDecodeUs(), [&stream, &frame] {
+							stream.DecodeAndDisplay(frame);
+						}, [&stream, &frame] {
+							stream.DropFrame(frame, NowMicroseconds());
+						});
+					continue;
+				}
+				co_await TaskAwaiter(task_pool, loop, [&stream, &frame] {
+					stream.DecodeAndDisplay(frame);
+				});
+			}
+			if (!received) {
+				break;
+			}
+		} while (readable);
+	}
 }
 
-//Ķ˿ں OpenCVʾڵ
-void receive(int port, std::string kWindowName_id) {
+// The event-loop threads and the task pool that the stream coroutines run
+// on. Streams are spread over the loops round robin.
+class StreamRuntime {
+public:
+	StreamRuntime();
+
+	// Stops the event loops and joins their threads, then finishes the tasks
+	// of the streams and destroys the streams.
+	~StreamRuntime();
+
+	// Starts receiving the stream on the given port. With
+	// kUseDeadlineScheduling, the frames of a stream with a higher weight are
+	// decoded first when frames of several streams are due at about the same
+	// time. The stream is kept in a time-shift ring of time_shift_bytes if that
+	// is not 0, so that only the streams an operator watches take the memory.
+	void AddStream(
+		const int port,
+		const std::string& window_name,
+		const double weight = 1.0,
+		const size_t time_shift_bytes = 0);
+
+private:
+	std::vector<std::unique_ptr<EventLoop>> loops_;
+	std::vector<std::thread> threads_;
+	size_t next_loop_;
 
+	// Orders the decode tasks of all streams. Destroyed after the task pool,
+	// whose workers run them.
+	DecodeScheduler decode_scheduler_;
+
+	// Destroyed first, which runs the tasks that are still queued. They post
+	// their streams to the loops, which destroy them in turn.
+	TaskPool task_pool_;
+};  // StreamRuntime
+
+StreamRuntime::StreamRuntime()
+	: next_loop_(0), decode_scheduler_(&task_pool_),
+	  task_pool_(std::thread::hardware_concurrency()) {
 	WSADATA wsaData;
-	WORD sockVersion = MAKEWORD(2, 2);
-	if (WSAStartup(sockVersion, &wsaData) != 0)
-	{
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
 		exit(0);
 	}
+	for (int i = 0; i < kEventLoopThreads; ++i) {
+		loops_.push_back(std::unique_ptr<EventLoop>(new EventLoop()));
+		EventLoop* loop = loops_.back().get();
+		threads_.push_back(std::thread([loop, i] {
+			TRACE_THREAD_NAME("event loop " + std::to_string(i));
+			PinThreadToNode(i % NumaNodeCount());
+			loop->Run();
+		}));
+	}
+}
 
-	const ReceiverSocket socket(port);
-	if (!socket.BindSocketToListen()) {
-		std::cerr << "Could not bind socket." << std::endl;
-		//system("pause");
-		exit(-1);
+StreamRuntime::~StreamRuntime() {
+	for (std::unique_ptr<EventLoop>& loop : loops_) {
+		loop->Stop();
 	}
-	std::cout << "Listening on port " << port << "." << std::endl;
-	
-	BasicProtocolData protocol_data;
-	while (true) {  // TODO: break out cleanly when done.
-		protocol_data.UnpackData(socket.GetPacket(kWindowName_id));
-		protocol_data.GetImage().Display(kWindowName_id);
+	for (std::thread& thread : threads_) {
+		thread.join();
 	}
+	// No loop resumes the streams that wait for a task anymore, so their
+	// frames are dropped. Destroying the task pool then finishes their tasks,
+	// which post the streams to the loops for ~EventLoop() to destroy.
+	decode_scheduler_.DropAll();
+}
 
+void StreamRuntime::AddStream(
+	const int port,
+	const std::string& window_name,
+	const double weight,
+	const size_t time_shift_bytes) {
+
+	EventLoop* loop = loops_[next_loop_].get();
+	next_loop_ = (next_loop_ + 1) % loops_.size();
+	loop->Post(ReceiveStream(
+		loop, &task_pool_, &decode_scheduler_, port, window_name, weight,
+		time_shift_bytes).handle);
+	std::cout << "Listening on port " << port << "." << std::endl;
 }
 
 int main()
 {
-	//Ϊ˽opencvʾ
+	// Press Ctrl+Break to print the latency histograms of all streams, and to
+	// write the trace when ENABLE_TRACING is defined.
+	SetConsoleCtrlHandler(OnConsoleControl, TRUE);
+
+	//为了解决opencv显示窗口名的问题
 	kWindowName_id1 = kWindowName_id1 + " " + std::to_string(0);
-	std::thread receive1(receive, 4000, kWindowName_id1);
 	kWindowName_id2 = kWindowName_id2 + " " + std::to_string(1);
-	std::thread receive2(receive, 5000, kWindowName_id2);
 	kWindowName_id3 = kWindowName_id3 + " " + std::to_string(2);
+	// The shared-memory ring is only read by blocking, so it needs the
+	// threads.
+	if (kUseStreamRuntime && !kUseSharedMemoryTransport) {
+		StreamRuntime runtime;
+		runtime.AddStream(4000, kWindowName_id1);
+		runtime.AddStream(5000, kWindowName_id2);
+		runtime.AddStream(6000, kWindowName_id3);
+		system("pause");
+		return 0;
+	}
+	std::thread receive1(receive, 4000, kWindowName_id1);
+	std::thread receive2(receive, 5000, kWindowName_id2);
 	std::thread receive3(receive, 6000, kWindowName_id3);
-	//˶֧֣߳ԼմӲͬ˿ڷƵ
+	//加入了多线程支持，可以监听并接收从不同端口发送来的视频数据
 	receive1.detach();
 	receive2.detach();
 	receive3.detach();
-	//⣬UDPĬϵģʽΪģʽûнյµƵʱʾĬϵıֽͼ񣻵ƵӺ󣬿ʵʱлƵ
+	//此外，将UDP从默认的阻塞模式改为非阻塞模式，当没有接收到新的视频数据时，将显示默认的壁纸图像；当视频发送重新连接后，可以实时切换到视频数据
 	system("pause");
 
 	return 0;
@@ -7,175 +7,4151 @@
 #include <string.h>
 #include<ws2tcpip.h>
 #include <thread>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <map>
+#include <algorithm>
+#include <iomanip>
+#include <atomic>
+#include <fstream>
+#include <cmath>
+#include <functional>
+#include <type_traits>
+#include <new>
+#if defined(_M_X64) || defined(_M_ARM64)
+#include <intrin.h>
+#endif
+#include <qos2.h>
+#include <mstcpip.h>
 #include "opencv2/core/core.hpp"
 #include "opencv2/opencv.hpp"
 
 #pragma comment(lib,"ws2_32.lib")
+#pragma comment(lib,"qwave.lib")
 
 //#pragma once
 // This is the maximum UDP packet size, and the buffer will be allocated for
 // the max amount.
 constexpr int kMaxPacketBufferSize = 65535;
 
+// Set to true when the sender and receiver run on the same machine. Frames are
+// then written into a shared-memory ring instead of going through the UDP
+// stack, which removes the 64KB datagram limit and the kernel copies.
+constexpr bool kUseSharedMemoryTransport = false;
+
+// The shared-memory ring holds this many frame slots. Each slot can hold a
+// frame of up to kSharedMemorySlotSize bytes.
+constexpr int kSharedMemorySlotCount = 8;
+constexpr int kSharedMemorySlotSize = 4 * 1024 * 1024;
+
+// The traffic class of a stream. Packets of higher classes are marked with a
+// higher DSCP value, and the transmit scheduler always sends them first when
+// the uplink is saturated.
+enum class QoSClass {
+	kBackground = 0,
+	kBestEffort = 1,
+	kVideo = 2,
+	kCritical = 3,
+};
+constexpr int kNumQoSClasses = 4;
+
+// The uplink capacity that the transmit scheduler paces all streams to, in
+// bits per second, until a stream has a bandwidth estimate. From then on the
+// streams are paced to the sum of their estimates. Set to 0 to send as fast as
+// the socket accepts packets until then.
+constexpr double kUplinkBitsPerSecond = 0;
+
+// At most this many frames are queued per traffic class. When a class falls
+// further behind, its oldest frames are dropped since they are stale anyway.
+constexpr size_t kMaxQueuedFramesPerClass = 4;
+
+// Set to true to have the kernel timestamp packets as they leave, where the
+// system supports it (SIO_TIMESTAMPING), which tells the time a packet spent
+// in the socket layer apart from the time it spent in the network. The kernel
+// keeps the timestamps of at most kTxTimestampsBuffered packets until they are
+// collected.
+constexpr bool kUseKernelTimestamps = true;
+constexpr unsigned short kTxTimestampsBuffered = 64;
+
+// The frames of all streams are resized and encoded on one shared pool of
+// worker threads, one per core. Each stream keeps at most this many frames
+// in the pool at a time, so that a busy camera can use several cores.
+constexpr unsigned int kMaxFramesInFlight = 3;
+
+// The file that the trace is written to on Ctrl+Break when ENABLE_TRACING is
+// defined.
+const char* const kTraceFileName = "sender_trace.json";
+
+// Set to false to leave the placement of threads and frame memory to the
+// system. Otherwise each stream stays on the cores and the memory of one NUMA
+// node.
+constexpr bool kUseNumaPlacement = true;
+
+// The largest payload put into a single UDP packet. Frames are split into
+// fragments of this size so that each packet fits into one Ethernet frame.
+constexpr size_t kMaxFragmentPayloadSize = 1200;
+
+// Packet types, stored in the first byte of every packet.
+//  - kPacketTypeFrame: a fragment of an encoded video frame.
+//  - kPacketTypePadding: a bandwidth probe. The payload is meaningless.
+//  - kPacketTypeFeedback: an arrival report sent back by the receiver.
+//  - kPacketTypeTables: JPEG tables that abbreviated frames refer to. The
+//    payload is the table id followed by the DQT and DHT marker segments.
+//  - kPacketTypePreview: a fragment of a preview frame, laid out like a frame
+//    fragment. Previews are numbered apart from the frames, and their JPEGs
+//    are always complete.
+//  - kPacketTypeSubscription: sent back by the receiver along with its
+//    feedback. The payload is a single byte, kSubscribeFull or
+//    kSubscribePreview, optionally followed by the FrameRegion to send.
+//  - kPacketTypeReceiverReport: reception statistics sent back by the
+//    receiver (see ReceiverReport).
+constexpr unsigned char kPacketTypeFrame = 1;
+constexpr unsigned char kPacketTypePadding = 2;
+constexpr unsigned char kPacketTypeFeedback = 3;
+constexpr unsigned char kPacketTypeTables = 4;
+constexpr unsigned char kPacketTypePreview = 5;
+constexpr unsigned char kPacketTypeSubscription = 6;
+constexpr unsigned char kPacketTypeReceiverReport = 7;
+
+// What a receiver subscribes to: the full stream, with the previews on the
+// side, or only the previews.
+constexpr unsigned char kSubscribeFull = 0;
+constexpr unsigned char kSubscribePreview = 1;
+
+// Frames refer to the tables that were stripped from their JPEG by id (see
+// FragmentInfo). kNoTableId means the JPEG is complete.
+constexpr unsigned char kNoTableId = 0;
+
+// Every packet starts with this header. It is written to the wire in network
+// byte order by WritePacketHeader(), and takes kPacketHeaderSize bytes. The
+// last four of them hold the CRC32C of the whole packet (see SealPacket()).
+struct PacketHeader {
+	unsigned char type;
+
+	// The probe cluster this packet belongs to, or 0 for ordinary packets.
+	unsigned char probe_cluster;
+
+	// The position of this fragment in its frame, and the number of fragments
+	// that the frame was split into.
+	unsigned short fragment_index;
+	unsigned short fragment_count;
+
+	// The per-stream packet number. Frame and padding packets share it.
+	unsigned int sequence;
+
+	// The per-stream frame number.
+	unsigned int frame_id;
+
+	// The sender's clock, in microseconds, when the packet left. This wraps
+	// around, so only differences between two values are meaningful.
+	unsigned int send_time_us;
+};
+constexpr size_t kPacketChecksumOffset = 18;
+constexpr size_t kPacketHeaderSize = 22;
+
+// Helpers to read and write big-endian integers in packet buffers.
+void WriteUint16(unsigned char* buffer, const unsigned short value) {
+	buffer[0] = static_cast<unsigned char>(value >> 8);
+	buffer[1] = static_cast<unsigned char>(value);
+}
+
+void WriteUint32(unsigned char* buffer, const unsigned int value) {
+	buffer[0] = static_cast<unsigned char>(value >> 24);
+	buffer[1] = static_cast<unsigned char>(value >> 16);
+	buffer[2] = static_cast<unsigned char>(value >> 8);
+	buffer[3] = static_cast<unsigned char>(value);
+}
+
+unsigned short ReadUint16(const unsigned char* buffer) {
+	return static_cast<unsigned short>((buffer[0] << 8) | buffer[1]);
+}
+
+unsigned int ReadUint32(const unsigned char* buffer) {
+	return (static_cast<unsigned int>(buffer[0]) << 24) |
+		(static_cast<unsigned int>(buffer[1]) << 16) |
+		(static_cast<unsigned int>(buffer[2]) << 8) |
+		static_cast<unsigned int>(buffer[3]);
+}
+
+// Writes the header into the first kPacketHeaderSize bytes of the buffer.
+void WritePacketHeader(const PacketHeader& header, unsigned char* buffer) {
+	buffer[0] = header.type;
+	buffer[1] = header.probe_cluster;
+	WriteUint16(buffer + 2, header.fragment_index);
+	WriteUint16(buffer + 4, header.fragment_count);
+	WriteUint32(buffer + 6, header.sequence);
+	WriteUint32(buffer + 10, header.frame_id);
+	WriteUint32(buffer + 14, header.send_time_us);
+	// The checksum is only filled in by SealPacket().
+	WriteUint32(buffer + kPacketChecksumOffset, 0);
+}
+
+// Reads the header at the start of a packet. Returns false if the packet is
+// too short to contain one.
+bool ReadPacketHeader(
+	const unsigned char* data, const size_t size, PacketHeader* header) {
+
+	if (size < kPacketHeaderSize) {
+		return false;
+	}
+	header->type = data[0];
+	header->probe_cluster = data[1];
+	header->fragment_index = ReadUint16(data + 2);
+	header->fragment_count = ReadUint16(data + 4);
+	header->sequence = ReadUint32(data + 6);
+	header->frame_id = ReadUint32(data + 10);
+	header->send_time_us = ReadUint32(data + 14);
+	return true;
+}
+
+// CRC32C (Castagnoli) checksums of packets. The crc32 instructions of SSE4.2
+// and ARMv8 compute it at several bytes per cycle; on processors without
+// them, a table is used.
+bool HasCrc32cInstructions() {
+#if defined(_M_X64)
+	static const bool has_sse42 = [] {
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 20)) != 0;
+	}();
+	return has_sse42;
+#elif defined(_M_ARM64)
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Continues the CRC32C state crc over the given bytes. The state starts as
+// 0xFFFFFFFF, and the checksum is the final state inverted.
+unsigned int UpdateCrc32c(
+	unsigned int crc, const unsigned char* data, size_t size) {
+
+#if defined(_M_X64) || defined(_M_ARM64)
+	if (HasCrc32cInstructions()) {
+		for (; size >= 8; data += 8, size -= 8) {
+			unsigned long long word;
+			memcpy(&word, data, sizeof(word));
+#if defined(_M_X64)
+			crc = static_cast<unsigned int>(_mm_crc32_u64(crc, word));
+#else
+			crc = __crc32cd(crc, word);
+#endif
+		}
+		for (; size > 0; ++data, --size) {
+#if defined(_M_X64)
+			crc = _mm_crc32_u8(crc, *data);
+#else
+			crc = __crc32cb(crc, *data);
+#endif
+		}
+		return crc;
+	}
+#endif
+	static const std::vector<unsigned int> table = [] {
+		std::vector<unsigned int> table(256);
+		for (unsigned int i = 0; i < 256; ++i) {
+			unsigned int value = i;
+			for (int bit = 0; bit < 8; ++bit) {
+				value = (value & 1) ? (value >> 1) ^ 0x82F63B78 : value >> 1;
+			}
+			table[i] = value;
+		}
+		return table;
+	}();
+	for (; size > 0; ++data, --size) {
+		crc = table[(crc ^ *data) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+// Returns the CRC32C of the packet, with its checksum field taken as zero.
+unsigned int PacketChecksum(const unsigned char* packet, const size_t size) {
+	static const unsigned char kZeros[4] = {};
+	unsigned int crc = 0xFFFFFFFF;
+	crc = UpdateCrc32c(crc, packet, kPacketChecksumOffset);
+	crc = UpdateCrc32c(crc, kZeros, sizeof(kZeros));
+	crc = UpdateCrc32c(
+		crc, packet + kPacketHeaderSize, size - kPacketHeaderSize);
+	return ~crc;
+}
+
+// Stores the packet's checksum in its header. This must be the last change to
+// the packet before it is sent.
+void SealPacket(unsigned char* packet, const size_t size) {
+	WriteUint32(packet + kPacketChecksumOffset, PacketChecksum(packet, size));
+}
+
+// Returns true if the packet has a header and its checksum matches, which
+// rules out packets that were damaged on the way and stray datagrams that
+// were never sent by this protocol.
+bool IsPacketIntact(const unsigned char* packet, const size_t size) {
+	return size >= kPacketHeaderSize &&
+		ReadUint32(packet + kPacketChecksumOffset) == PacketChecksum(packet, size);
+}
+
+// Returns a monotonic clock reading in microseconds.
+long long NowMicroseconds() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Converts a QueryPerformanceCounter() value, which is what kernel packet
+// timestamps are, to the clock of NowMicroseconds(). The steady_clock of
+// Visual Studio counts QueryPerformanceCounter() ticks as well.
+long long QpcToMicroseconds(const unsigned long long qpc) {
+	static const unsigned long long frequency = [] {
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		return static_cast<unsigned long long>(frequency.QuadPart);
+	}();
+	return static_cast<long long>(
+		qpc / frequency * 1000000 + qpc % frequency * 1000000 / frequency);
+}
+
+// The feedback report sent by the receiver is a kPacketTypeFeedback header
+// followed by a 16-bit entry count and that many (sequence, arrival time)
+// pairs of 32-bit values. Arrival times are the receiver's clock in
+// microseconds.
+constexpr size_t kFeedbackEntrySize = 8;
+constexpr size_t kMaxFeedbackEntries =
+	(kMaxFragmentPayloadSize - 2) / kFeedbackEntrySize;
+
+// Along with its feedback, the receiver regularly sends a report modeled on
+// the receiver reports of RTCP. The kPacketTypeReceiverReport header is
+// followed by a ReceiverReport, written by WriteReceiverReport() in
+// kReceiverReportSize bytes.
+struct ReceiverReport {
+	// The highest packet sequence number received.
+	unsigned int highest_sequence;
+
+	// The number of packets missing since the stream started, and the fraction
+	// of the packets expected since the previous report that went missing, in
+	// 1/256ths.
+	unsigned int cumulative_lost;
+	unsigned char fraction_lost;
+
+	// How much the spacing of the packets on arrival differed from their
+	// spacing on sending, smoothed as in RFC 3550.
+	unsigned int jitter_us;
+
+	// How long the receiver took to decode and to display a frame, on average
+	// recently.
+	unsigned int decode_time_us;
+	unsigned int render_time_us;
+
+	// The send time of the newest packet received, on the sender's clock, and
+	// how long after that packet arrived the report was sent. Whatever else
+	// passed until the report arrived is the round-trip time.
+	unsigned int last_send_time_us;
+	unsigned int delay_since_last_us;
+};
+constexpr size_t kReceiverReportSize = 29;
+
+void WriteReceiverReport(const ReceiverReport& report, unsigned char* buffer) {
+	WriteUint32(buffer, report.highest_sequence);
+	WriteUint32(buffer + 4, report.cumulative_lost);
+	buffer[8] = report.fraction_lost;
+	WriteUint32(buffer + 9, report.jitter_us);
+	WriteUint32(buffer + 13, report.decode_time_us);
+	WriteUint32(buffer + 17, report.render_time_us);
+	WriteUint32(buffer + 21, report.last_send_time_us);
+	WriteUint32(buffer + 25, report.delay_since_last_us);
+}
+
+bool ReadReceiverReport(
+	const unsigned char* data, const size_t size, ReceiverReport* report) {
+
+	if (size < kReceiverReportSize) {
+		return false;
+	}
+	report->highest_sequence = ReadUint32(data);
+	report->cumulative_lost = ReadUint32(data + 4);
+	report->fraction_lost = data[8];
+	report->jitter_us = ReadUint32(data + 9);
+	report->decode_time_us = ReadUint32(data + 13);
+	report->render_time_us = ReadUint32(data + 17);
+	report->last_send_time_us = ReadUint32(data + 21);
+	report->delay_since_last_us = ReadUint32(data + 25);
+	return true;
+}
+
+// The stages that every frame passes through, in order. The durations of
+// each stage are collected per stream in a StreamLatencyStats.
+//  - capture: grabbing the image from the camera.
+//  - resize, overlay, encode, packetize: the sender's processing steps.
+//  - send: from the end of packetizing until the last fragment left.
+//  - receive: the network delay of the last fragment. The two clocks are not
+//    synchronized, so this is the delay above the smallest one seen recently,
+//    i.e. the queueing delay along the path.
+//  - socket: how long a packet spent in the socket layer, from the send call
+//    until the kernel sent it, or from the kernel receiving it until it was
+//    read. This is recorded per packet, and only where the system timestamps
+//    packets (see kUseKernelTimestamps).
+//  - reassemble: from the first to the last fragment of the frame arriving.
+//  - decode, display: the receiver's processing steps. Display includes the
+//    waitKey() delay.
+enum PipelineStage {
+	kStageCapture = 0,
+	kStageResize,
+	kStageOverlay,
+	kStageEncode,
+	kStagePacketize,
+	kStageSend,
+	kStageReceive,
+	kStageSocket,
+	kStageReassemble,
+	kStageDecode,
+	kStageDisplay,
+	kNumPipelineStages
+};
+
+static const char* const kPipelineStageNames[kNumPipelineStages] = {
+	"capture", "resize", "overlay", "encode", "packetize",
+	"send", "receive", "socket", "reassemble", "decode", "display",
+};
+
+// The stages up to and including kStagePacketize happen before the frame is
+// sent, so their end times travel with the frame in its FrameTrace.
+constexpr int kNumTracedStages = kStagePacketize + 1;
+
+// The stage timestamps of one frame. It is sent in front of the encoded frame
+// bytes, as kFrameTraceSize bytes in network byte order.
+struct FrameTrace {
+	// The sender's clock, in microseconds, when the capture started. This is
+	// the same clock as PacketHeader::send_time_us.
+	unsigned int capture_start_us;
+
+	// The time at which each traced stage ended, in microseconds after
+	// capture_start_us.
+	unsigned int stage_end_us[kNumTracedStages];
+};
+constexpr size_t kFrameTraceSize = 4 + 4 * kNumTracedStages;
+
+void WriteFrameTrace(const FrameTrace& trace, unsigned char* buffer) {
+	WriteUint32(buffer, trace.capture_start_us);
+	for (int i = 0; i < kNumTracedStages; ++i) {
+		WriteUint32(buffer + 4 + 4 * i, trace.stage_end_us[i]);
+	}
+}
+
+bool ReadFrameTrace(
+	const unsigned char* data, const size_t size, FrameTrace* trace) {
+
+	if (size < kFrameTraceSize) {
+		return false;
+	}
+	trace->capture_start_us = ReadUint32(data);
+	for (int i = 0; i < kNumTracedStages; ++i) {
+		trace->stage_end_us[i] = ReadUint32(data + 4 + 4 * i);
+	}
+	return true;
+}
+
+// Frames are encoded with one restart interval per row of MCUs, so that each
+// row ("stripe") of the JPEG scan can be decoded on its own. Every frame
+// fragment starts with kFragmentInfoSize bytes that say which part of the
+// scan it carries:
+//  - the id of the tables stripped from the frame's JPEG, or kNoTableId.
+//  - the stripe that the fragment's data starts in, as 16 bits. The fragment
+//    starts exactly at the beginning of the stripe unless
+//    kFragmentContinuesStripe is set. kUnknownStripe means the sender did
+//    not find the stripes, so the frame can only be decoded as a whole.
+// Fragment 0 continues with the FrameTrace and then the JPEG header, which
+// counts as part of stripe 0. The other fragments hold only scan data.
+struct FragmentInfo {
+	unsigned char table_id;
+	unsigned short stripe;
+};
+constexpr size_t kFragmentInfoSize = 3;
+constexpr unsigned short kFragmentContinuesStripe = 0x8000;
+constexpr unsigned short kUnknownStripe = 0xFFFF;
+
+void WriteFragmentInfo(const FragmentInfo& info, unsigned char* buffer) {
+	buffer[0] = info.table_id;
+	WriteUint16(buffer + 1, info.stripe);
+}
+
+bool ReadFragmentInfo(
+	const unsigned char* data, const size_t size, FragmentInfo* info) {
+
+	if (size < kFragmentInfoSize) {
+		return false;
+	}
+	info->table_id = data[0];
+	info->stripe = ReadUint16(data + 1);
+	return true;
+}
+
+// A region of the frames that a receiver subscribes to, for digital pan and
+// zoom. The coordinates are in 1/65536ths of the frame's width and height, so
+// that the receiver need not know the sender's resolution. A region of zero
+// width or height stands for the whole frame. It takes kFrameRegionSize bytes
+// after the subscription byte of a kPacketTypeSubscription packet.
+struct FrameRegion {
+	unsigned short x;
+	unsigned short y;
+	unsigned short width;
+	unsigned short height;
+
+	bool IsWholeFrame() const {
+		return width == 0 || height == 0;
+	}
+};
+constexpr size_t kFrameRegionSize = 8;
+
+void WriteFrameRegion(const FrameRegion& region, unsigned char* buffer) {
+	WriteUint16(buffer, region.x);
+	WriteUint16(buffer + 2, region.y);
+	WriteUint16(buffer + 4, region.width);
+	WriteUint16(buffer + 6, region.height);
+}
+
+bool ReadFrameRegion(
+	const unsigned char* data, const size_t size, FrameRegion* region) {
+
+	if (size < kFrameRegionSize) {
+		return false;
+	}
+	region->x = ReadUint16(data);
+	region->y = ReadUint16(data + 2);
+	region->width = ReadUint16(data + 4);
+	region->height = ReadUint16(data + 6);
+	return true;
+}
+
+// Returns the pixels that the region covers in a frame of the given size, at
+// least one.
+cv::Rect RegionRect(const FrameRegion& region, const int width, const int height) {
+	if (region.IsWholeFrame()) {
+		return cv::Rect(0, 0, width, height);
+	}
+	const int left = static_cast<int>((static_cast<long long>(region.x) * width) >> 16);
+	const int top = static_cast<int>((static_cast<long long>(region.y) * height) >> 16);
+	const int right = std::min(width, static_cast<int>(
+		((static_cast<long long>(region.x) + region.width) * width + 65535) >> 16));
+	const int bottom = std::min(height, static_cast<int>(
+		((static_cast<long long>(region.y) + region.height) * height + 65535) >> 16));
+	return cv::Rect(
+		left, top, std::max(right - left, 1), std::max(bottom - top, 1));
+}
+
+// JPEG marker codes, each following a 0xFF byte.
+constexpr unsigned char kJpegMarkerSOI = 0xD8;
+constexpr unsigned char kJpegMarkerEOI = 0xD9;
+constexpr unsigned char kJpegMarkerSOS = 0xDA;
+constexpr unsigned char kJpegMarkerRST0 = 0xD0;
+constexpr unsigned char kJpegMarkerRST7 = 0xD7;
+
+// Returns true if the marker ends a stripe of the scan: a restart marker, or
+// EOI after the last stripe.
+bool IsStripeEndMarker(const unsigned char marker) {
+	return (marker >= kJpegMarkerRST0 && marker <= kJpegMarkerRST7) ||
+		marker == kJpegMarkerEOI;
+}
+
+// Returns the size of the JPEG header, from SOI up to and including the SOS
+// segment, which is where the scan data starts. Returns 0 if the header is not
+// all there.
+size_t FindJpegScanStart(const unsigned char* jpeg, const size_t size) {
+	if (size < 4 || jpeg[0] != 0xFF || jpeg[1] != kJpegMarkerSOI) {
+		return 0;
+	}
+	size_t position = 2;
+	while (position + 4 <= size) {
+		if (jpeg[position] != 0xFF) {
+			return 0;
+		}
+		if (jpeg[position + 1] == 0xFF) {
+			// A fill byte in front of the marker.
+			++position;
+			continue;
+		}
+		const size_t end = position + 2 + ReadUint16(jpeg + position + 2);
+		if (end > size) {
+			return 0;
+		}
+		if (jpeg[position + 1] == kJpegMarkerSOS) {
+			return end;
+		}
+		position = end;
+	}
+	return 0;
+}
+
+// A histogram of durations in microseconds, in the style of HdrHistogram:
+// values below kExactValues are counted exactly, and every power-of-two range
+// above that is split into kExactValues / 2 buckets, so each value is
+// recorded with a relative error below 1.6% from 1us up to 2^36us.
+class LatencyHistogram {
+public:
+	LatencyHistogram();
+
+	// Counts one value. Negative values are counted as 0.
+	void Record(long long value_us);
+
+	// Returns the number of recorded values.
+	unsigned long long Count() const { return count_; }
+
+	// Returns the largest recorded value.
+	long long Max() const { return max_; }
+
+	// Returns the value below which the given percentage (0-100) of the
+	// recorded values fall, within the precision of the histogram.
+	long long ValueAtPercentile(const double percentile) const;
+
+private:
+	static const int kExactValues = 128;
+	static const int kSubBuckets = kExactValues / 2;
+	static const int kMaxShift = 30;
+
+	// Returns the bucket that the value is counted in.
+	static int BucketIndex(const long long value_us);
+
+	// Returns the highest value that is counted in the given bucket.
+	static long long BucketValue(const int index);
+
+	std::vector<unsigned long long> counts_;
+	unsigned long long count_;
+	long long max_;
+};  // LatencyHistogram
+
+LatencyHistogram::LatencyHistogram()
+	: counts_(kExactValues + kMaxShift * kSubBuckets, 0), count_(0), max_(0) {}
+
+int LatencyHistogram::BucketIndex(const long long value_us) {
+	if (value_us < kExactValues) {
+		return static_cast<int>(value_us);
+	}
+	// Shift the value down until it falls into [kSubBuckets, kExactValues).
+	int shift = 0;
+	while ((value_us >> shift) >= kExactValues && shift < kMaxShift) {
+		++shift;
+	}
+	const long long sub_bucket =
+		std::min<long long>(value_us >> shift, kExactValues - 1) - kSubBuckets;
+	return kExactValues + (shift - 1) * kSubBuckets + static_cast<int>(sub_bucket);
+}
+
+long long LatencyHistogram::BucketValue(const int index) {
+	if (index < kExactValues) {
+		return index;
+	}
+	const int shift = (index - kExactValues) / kSubBuckets + 1;
+	const long long sub_bucket = (index - kExactValues) % kSubBuckets;
+	return ((kSubBuckets + sub_bucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(long long value_us) {
+	if (value_us < 0) {
+		value_us = 0;
+	}
+	++counts_[BucketIndex(value_us)];
+	++count_;
+	if (value_us > max_) {
+		max_ = value_us;
+	}
+}
+
+long long LatencyHistogram::ValueAtPercentile(const double percentile) const {
+	if (count_ == 0) {
+		return 0;
+	}
+	const unsigned long long target = std::max<unsigned long long>(1,
+		static_cast<unsigned long long>(percentile / 100.0 * count_ + 0.5));
+	unsigned long long seen = 0;
+	for (size_t i = 0; i < counts_.size(); ++i) {
+		seen += counts_[i];
+		if (seen >= target) {
+			return std::min(BucketValue(static_cast<int>(i)), max_);
+		}
+	}
+	return max_;
+}
+
+// The per-stage latency histograms of one stream. Instances register
+// themselves, so that DumpLatencyStats() can print all of them on demand.
+class StreamLatencyStats {
+public:
+	explicit StreamLatencyStats(const std::string& name);
+
+	~StreamLatencyStats();
+
+	// Records how long the given stage took for one frame.
+	void Record(const PipelineStage stage, const long long duration_us);
+
+	// Sets a counter of the stream, such as the number of lost packets, which
+	// is printed along with the histograms.
+	void SetCount(const std::string& counter, const long long value);
+
+	// Prints a percentile table of every stage that has values, followed by
+	// the counters.
+	void Print(std::ostream& out) const;
+
+private:
+	const std::string name_;
+	LatencyHistogram histograms_[kNumPipelineStages];
+	std::map<std::string, long long> counts_;
+	mutable std::mutex mutex_;
+};  // StreamLatencyStats
+
+// All live StreamLatencyStats, guarded by the mutex.
+std::mutex latency_stats_mutex;
+std::vector<const StreamLatencyStats*> latency_stats;
+
+StreamLatencyStats::StreamLatencyStats(const std::string& name) : name_(name) {
+	std::lock_guard<std::mutex> lock(latency_stats_mutex);
+	latency_stats.push_back(this);
+}
+
+StreamLatencyStats::~StreamLatencyStats() {
+	std::lock_guard<std::mutex> lock(latency_stats_mutex);
+	latency_stats.erase(
+		std::remove(latency_stats.begin(), latency_stats.end(), this),
+		latency_stats.end());
+}
+
+void StreamLatencyStats::Record(
+	const PipelineStage stage, const long long duration_us) {
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	histograms_[stage].Record(duration_us);
+}
+
+void StreamLatencyStats::SetCount(
+	const std::string& counter, const long long value) {
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	counts_[counter] = value;
+}
+
+void StreamLatencyStats::Print(std::ostream& out) const {
+	static const double kPercentiles[] = { 50, 90, 99, 99.9 };
+	std::lock_guard<std::mutex> lock(mutex_);
+	out << "Latency of " << name_ << " in microseconds:" << std::endl;
+	out << "  stage           count      p50      p90      p99    p99.9      max"
+		<< std::endl;
+	for (int stage = 0; stage < kNumPipelineStages; ++stage) {
+		const LatencyHistogram& histogram = histograms_[stage];
+		if (histogram.Count() == 0) {
+			continue;
+		}
+		out << "  " << std::left << std::setw(12) << kPipelineStageNames[stage]
+			<< std::right << std::setw(9) << histogram.Count();
+		for (const double percentile : kPercentiles) {
+			out << std::setw(9) << histogram.ValueAtPercentile(percentile);
+		}
+		out << std::setw(9) << histogram.Max() << std::endl;
+	}
+	for (const auto& count : counts_) {
+		out << "  " << count.first << ": " << count.second << std::endl;
+	}
+}
+
+// Prints the latency histograms of all streams to stdout.
+void DumpLatencyStats() {
+	std::lock_guard<std::mutex> lock(latency_stats_mutex);
+	for (const StreamLatencyStats* stats : latency_stats) {
+		stats->Print(std::cout);
+	}
+}
+
+// Define ENABLE_TRACING (e.g. in the project's preprocessor definitions) to
+// record the begin and end of the hot functions of every thread. Without it,
+// the TRACE_* macros compile to nothing. The events are written as Chrome
+// trace-event JSON, which can be opened in Perfetto or chrome://tracing.
+#ifdef ENABLE_TRACING
+
+// Each thread records into its own buffer of this many events. Once it is
+// full, the oldest events are overwritten.
+constexpr size_t kTraceBufferEvents = 65536;
+
+// One complete ("X") trace event. The name must be a string literal.
+struct TraceEvent {
+	// 2 * (n + 1) once event n has been written into the slot, odd while the
+	// writer is filling it in.
+	std::atomic<unsigned long long> sequence;
+	const char* name;
+	long long start_us;
+	long long duration_us;
+};
+
+// The events of one thread. Only the owning thread writes to it, so writing
+// needs no lock; readers detect slots that are overwritten while they copy
+// them through the slot's sequence number.
+class TraceBuffer {
+public:
+	explicit TraceBuffer(const unsigned long thread_id)
+		: events_(kTraceBufferEvents), thread_id_(thread_id), next_event_(0) {}
+
+	// Records an event. Only called by the owning thread.
+	void Add(const char* name, const long long start_us, const long long duration_us);
+
+	// Sets the name shown for the thread. Only called by the owning thread,
+	// before it records any events.
+	void SetThreadName(const std::string& name) {
+		thread_name_ = name;
+	}
+
+	// Appends the thread's events to the JSON array being written.
+	void WriteJSON(std::ostream& out, const unsigned long process_id, bool* first) const;
+
+private:
+	std::vector<TraceEvent> events_;
+	const unsigned long thread_id_;
+	std::string thread_name_;
+
+	// The number of events recorded so far.
+	std::atomic<unsigned long long> next_event_;
+};  // TraceBuffer
+
+void TraceBuffer::Add(
+	const char* name, const long long start_us, const long long duration_us) {
+
+	const unsigned long long n = next_event_.load(std::memory_order_relaxed);
+	TraceEvent& event = events_[n % kTraceBufferEvents];
+	event.sequence.store(2 * n + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	event.name = name;
+	event.start_us = start_us;
+	event.duration_us = duration_us;
+	event.sequence.store(2 * n + 2, std::memory_order_release);
+	next_event_.store(n + 1, std::memory_order_release);
+}
+
+void TraceBuffer::WriteJSON(
+	std::ostream& out, const unsigned long process_id, bool* first) const {
+
+	if (!thread_name_.empty()) {
+		out << (*first ? "" : ",\n")
+			<< "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << process_id
+			<< ",\"tid\":" << thread_id_
+			<< ",\"args\":{\"name\":\"" << thread_name_ << "\"}}";
+		*first = false;
+	}
+	const unsigned long long end = next_event_.load(std::memory_order_acquire);
+	const unsigned long long begin =
+		end > kTraceBufferEvents ? end - kTraceBufferEvents : 0;
+	for (unsigned long long n = begin; n < end; ++n) {
+		const TraceEvent& event = events_[n % kTraceBufferEvents];
+		const unsigned long long sequence =
+			event.sequence.load(std::memory_order_acquire);
+		const char* name = event.name;
+		const long long start_us = event.start_us;
+		const long long duration_us = event.duration_us;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		// Skip the event if the writer has started to overwrite it.
+		if (sequence != 2 * n + 2 ||
+			event.sequence.load(std::memory_order_relaxed) != sequence) {
+			continue;
+		}
+		out << (*first ? "" : ",\n")
+			<< "{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":" << process_id
+			<< ",\"tid\":" << thread_id_ << ",\"ts\":" << start_us
+			<< ",\"dur\":" << duration_us << "}";
+		*first = false;
+	}
+}
+
+// The buffers of all threads that recorded events, guarded by the mutex. The
+// buffers are never freed, so events of finished threads can still be written.
+std::mutex trace_buffers_mutex;
+std::vector<TraceBuffer*> trace_buffers;
+
+// Returns the calling thread's buffer, creating it on first use.
+TraceBuffer* GetThreadTraceBuffer() {
+	thread_local TraceBuffer* buffer = nullptr;
+	if (buffer == nullptr) {
+		buffer = new TraceBuffer(GetCurrentThreadId());
+		std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+		trace_buffers.push_back(buffer);
+	}
+	return buffer;
+}
+
+// Records the time between its construction and destruction as one event.
+class TraceScope {
+public:
+	explicit TraceScope(const char* name)
+		: name_(name), start_us_(NowMicroseconds()) {}
+
+	~TraceScope() {
+		GetThreadTraceBuffer()->Add(name_, start_us_, NowMicroseconds() - start_us_);
+	}
+
+private:
+	const char* name_;
+	const long long start_us_;
+};  // TraceScope
+
+// Writes the events of all threads to the given file as Chrome trace-event
+// JSON.
+void WriteChromeTrace(const std::string& file_name) {
+	std::ofstream out(file_name.c_str());
+	if (!out) {
+		std::cerr << "Could not write trace to " << file_name << "." << std::endl;
+		return;
+	}
+	out << "{\"traceEvents\":[\n";
+	bool first = true;
+	{
+		std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+		for (const TraceBuffer* buffer : trace_buffers) {
+			buffer->WriteJSON(out, GetCurrentProcessId(), &first);
+		}
+	}
+	out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+	std::cout << "Trace written to " << file_name << "." << std::endl;
+}
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+// Records the rest of the enclosing scope as an event with the given name.
+#define TRACE_SCOPE(name) \
+	TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+// Names the calling thread in the trace.
+#define TRACE_THREAD_NAME(name) GetThreadTraceBuffer()->SetThreadName(name)
+
+// Writes all events recorded so far to the given file.
+#define TRACE_WRITE(file_name) WriteChromeTrace(file_name)
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_THREAD_NAME(name)
+#define TRACE_WRITE(file_name)
+
+#endif  // ENABLE_TRACING
+
+// Dumps the latency histograms, and the trace if tracing is enabled, when
+// Ctrl+Break is pressed in the console. Other events keep their default
+// handling.
+BOOL WINAPI OnConsoleControl(DWORD control_type) {
+	if (control_type == CTRL_BREAK_EVENT) {
+		DumpLatencyStats();
+		TRACE_WRITE(kTraceFileName);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+// Records the durations of the stages whose end times are in the trace.
+void RecordTracedStages(const FrameTrace& trace, StreamLatencyStats* stats) {
+	unsigned int stage_start_us = 0;
+	for (int stage = 0; stage < kNumTracedStages; ++stage) {
+		stats->Record(
+			static_cast<PipelineStage>(stage),
+			static_cast<int>(trace.stage_end_us[stage] - stage_start_us));
+		stage_start_us = trace.stage_end_us[stage];
+	}
+}
+
+// A probe cluster is a train of this many padding packets, sent back to back
+// so that the bottleneck link spreads them out. Clusters are sent once every
+// kProbeIntervalUs, and a cluster is only evaluated if at least
+// kMinProbePacketsReceived of its packets arrived.
+constexpr size_t kProbePacketCount = 15;
+constexpr long long kProbeIntervalUs = 5000000;
+constexpr size_t kMinProbePacketsReceived = 5;
+
+// The delivery rate of ordinary packets is measured over this window.
+constexpr long long kDeliveryRateWindowUs = 1000000;
+
+// Sent packets are remembered this long while waiting for their feedback.
+constexpr long long kSentPacketHistoryUs = 2000000;
+
+// Reported loss above this fraction lowers the bandwidth estimate.
+constexpr double kLossThreshold = 0.1;
+
+// Estimates the bandwidth available on the path to one receiver.
+//
+// Padding packets are sent back to back in short trains (probe clusters). The
+// bottleneck link spreads them out, and the spacing of their arrival times as
+// reported by the receiver gives the path capacity. Arrival reports of the
+// ordinary frame packets give the delivery rate, which the estimate never
+// stays below, and reported loss pulls the estimate down.
+//
+// OnPacketSent() is called by the transmit thread and the other methods by the
+// sending thread, so all state is guarded by a mutex.
+class BandwidthEstimator {
+public:
+	BandwidthEstimator();
+
+	// Records a packet that has just been sent.
+	void OnPacketSent(
+		const PacketHeader& header, const size_t size, const long long send_time_us);
+
+	// Processes a feedback report received from the receiver.
+	void OnFeedback(const unsigned char* report, const size_t size);
+
+	// Returns true if it is time to send a new probe cluster, and sets the id
+	// that the cluster's packets must carry.
+	bool StartProbeCluster(const long long now_us, unsigned char* probe_cluster);
+
+	// Returns the estimated available bandwidth in bits per second, or 0 if
+	// nothing has been measured yet. Quality and scale decisions should keep
+	// the stream's bitrate below this.
+	double GetEstimate() const;
+
+private:
+	struct SentPacket {
+		long long send_time_us;
+		size_t size;
+		unsigned char probe_cluster;
+	};
+
+	struct ProbeCluster {
+		long long start_time_us;
+		size_t packets_sent;
+		size_t packets_received;
+		size_t bytes_received;
+		size_t first_packet_size;
+		long long first_arrival_us;
+		long long last_arrival_us;
+	};
+
+	struct Delivery {
+		long long arrival_time_us;
+		size_t size;
+	};
+
+	// Converts a wrapping 32-bit arrival time into a 64-bit one.
+	long long UnwrapArrivalTime(const unsigned int arrival_time_us);
+
+	// Updates the estimate from the probe clusters that are complete.
+	void EvaluateProbeClusters(const long long now_us);
+
+	// Updates the estimate from the delivery rate of ordinary packets.
+	void EvaluateDeliveryRate();
+
+	// Packets waiting for feedback, by sequence number.
+	std::map<unsigned int, SentPacket> sent_packets_;
+
+	// Probe clusters waiting to be evaluated, by id.
+	std::map<unsigned char, ProbeCluster> probe_clusters_;
+
+	// Ordinary packets reported within the delivery rate window.
+	std::deque<Delivery> deliveries_;
+
+	// The last arrival time seen, to unwrap the 32-bit values.
+	bool has_arrival_time_;
+	unsigned int last_arrival_time_raw_;
+	long long last_arrival_time_us_;
+
+	// The highest sequence number reported so far, to measure loss.
+	bool has_reported_sequence_;
+	unsigned int highest_reported_sequence_;
+
+	double estimate_;
+	long long last_probe_time_us_;
+	unsigned char next_probe_cluster_;
+
+	mutable std::mutex mutex_;
+};  // BandwidthEstimator
+
+BandwidthEstimator::BandwidthEstimator()
+	: has_arrival_time_(false), last_arrival_time_raw_(0),
+	last_arrival_time_us_(0), has_reported_sequence_(false),
+	highest_reported_sequence_(0), estimate_(0), last_probe_time_us_(0),
+	next_probe_cluster_(1) {}
+
+void BandwidthEstimator::OnPacketSent(
+	const PacketHeader& header, const size_t size, const long long send_time_us) {
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	sent_packets_[header.sequence] =
+		SentPacket{ send_time_us, size, header.probe_cluster };
+	if (header.probe_cluster != 0) {
+		std::map<unsigned char, ProbeCluster>::iterator cluster =
+			probe_clusters_.find(header.probe_cluster);
+		if (cluster != probe_clusters_.end()) {
+			++cluster->second.packets_sent;
+		}
+	}
+	// Forget packets whose feedback never came.
+	while (!sent_packets_.empty() &&
+		sent_packets_.begin()->second.send_time_us <
+		send_time_us - kSentPacketHistoryUs) {
+		sent_packets_.erase(sent_packets_.begin());
+	}
+}
+
+long long BandwidthEstimator::UnwrapArrivalTime(
+	const unsigned int arrival_time_us) {
+
+	if (!has_arrival_time_) {
+		has_arrival_time_ = true;
+		last_arrival_time_raw_ = arrival_time_us;
+		last_arrival_time_us_ = arrival_time_us;
+		return last_arrival_time_us_;
+	}
+	last_arrival_time_us_ += static_cast<int>(
+		arrival_time_us - last_arrival_time_raw_);
+	last_arrival_time_raw_ = arrival_time_us;
+	return last_arrival_time_us_;
+}
+
+void BandwidthEstimator::OnFeedback(
+	const unsigned char* report, const size_t size) {
+
+	if (size < kPacketHeaderSize + 2) {
+		return;
+	}
+	const size_t num_entries = ReadUint16(report + kPacketHeaderSize);
+	if (size < kPacketHeaderSize + 2 + num_entries * kFeedbackEntrySize) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex_);
+	size_t num_new_packets = 0;
+	unsigned int highest_sequence = highest_reported_sequence_;
+	bool has_highest_sequence = has_reported_sequence_;
+	for (size_t i = 0; i < num_entries; ++i) {
+		const unsigned char* entry =
+			report + kPacketHeaderSize + 2 + i * kFeedbackEntrySize;
+		const unsigned int sequence = ReadUint32(entry);
+		const long long arrival_time_us = UnwrapArrivalTime(ReadUint32(entry + 4));
+		if (!has_reported_sequence_ ||
+			static_cast<int>(sequence - highest_reported_sequence_) > 0) {
+			++num_new_packets;
+		}
+		if (!has_highest_sequence ||
+			static_cast<int>(sequence - highest_sequence) > 0) {
+			highest_sequence = sequence;
+			has_highest_sequence = true;
+		}
+		std::map<unsigned int, SentPacket>::iterator sent =
+			sent_packets_.find(sequence);
+		if (sent == sent_packets_.end()) {
+			continue;
+		}
+		if (sent->second.probe_cluster == 0) {
+			deliveries_.push_back(Delivery{ arrival_time_us, sent->second.size });
+		} else {
+			std::map<unsigned char, ProbeCluster>::iterator cluster =
+				probe_clusters_.find(sent->second.probe_cluster);
+			if (cluster != probe_clusters_.end()) {
+				ProbeCluster& probe = cluster->second;
+				if (probe.packets_received == 0 ||
+					arrival_time_us < probe.first_arrival_us) {
+					probe.first_arrival_us = arrival_time_us;
+					probe.first_packet_size = sent->second.size;
+				}
+				if (probe.packets_received == 0 ||
+					arrival_time_us > probe.last_arrival_us) {
+					probe.last_arrival_us = arrival_time_us;
+				}
+				++probe.packets_received;
+				probe.bytes_received += sent->second.size;
+			}
+		}
+		sent_packets_.erase(sent);
+	}
+
+	// Every packet between the previous report and the highest sequence
+	// number in this one should have been reported by now.
+	if (has_reported_sequence_) {
+		const int num_expected =
+			static_cast<int>(highest_sequence - highest_reported_sequence_);
+		if (num_expected >= 10) {
+			const double loss =
+				1.0 - static_cast<double>(num_new_packets) / num_expected;
+			if (loss > kLossThreshold) {
+				estimate_ *= 1.0 - 0.5 * loss;
+			}
+		}
+	}
+	highest_reported_sequence_ = highest_sequence;
+	has_reported_sequence_ = has_highest_sequence;
+
+	EvaluateProbeClusters(NowMicroseconds());
+	EvaluateDeliveryRate();
+}
+
+void BandwidthEstimator::EvaluateProbeClusters(const long long now_us) {
+	std::map<unsigned char, ProbeCluster>::iterator cluster =
+		probe_clusters_.begin();
+	while (cluster != probe_clusters_.end()) {
+		const ProbeCluster& probe = cluster->second;
+		const bool all_reported = probe.packets_sent == kProbePacketCount &&
+			probe.packets_received == probe.packets_sent;
+		const bool timed_out = now_us - probe.start_time_us > 1000000;
+		if (!all_reported && !timed_out) {
+			++cluster;
+			continue;
+		}
+		// The first packet only marks the start of the train; the bottleneck
+		// rate is given by the bytes that arrived after it.
+		const long long dispersion_us =
+			probe.last_arrival_us - probe.first_arrival_us;
+		if (probe.packets_received >= kMinProbePacketsReceived &&
+			dispersion_us > 0) {
+			estimate_ = (probe.bytes_received - probe.first_packet_size) * 8e6 /
+				dispersion_us;
+		}
+		cluster = probe_clusters_.erase(cluster);
+	}
+}
+
+void BandwidthEstimator::EvaluateDeliveryRate() {
+	if (deliveries_.empty()) {
+		return;
+	}
+	const long long newest_arrival_us = deliveries_.back().arrival_time_us;
+	while (deliveries_.front().arrival_time_us <
+		newest_arrival_us - kDeliveryRateWindowUs) {
+		deliveries_.pop_front();
+	}
+	const long long span_us =
+		newest_arrival_us - deliveries_.front().arrival_time_us;
+	if (span_us < kDeliveryRateWindowUs / 5) {
+		return;
+	}
+	size_t bytes = 0;
+	for (size_t i = 1; i < deliveries_.size(); ++i) {
+		bytes += deliveries_[i].size;
+	}
+	// What was actually delivered is always available.
+	const double delivery_rate = bytes * 8e6 / span_us;
+	if (delivery_rate > estimate_) {
+		estimate_ = delivery_rate;
+	}
+}
+
+bool BandwidthEstimator::StartProbeCluster(
+	const long long now_us, unsigned char* probe_cluster) {
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (last_probe_time_us_ != 0 &&
+		now_us - last_probe_time_us_ < kProbeIntervalUs) {
+		return false;
+	}
+	last_probe_time_us_ = now_us;
+	*probe_cluster = next_probe_cluster_;
+	// Cluster id 0 means "not a probe", so skip it when wrapping around.
+	next_probe_cluster_ = next_probe_cluster_ == 255 ? 1 : next_probe_cluster_ + 1;
+	probe_clusters_[*probe_cluster] = ProbeCluster{ now_us, 0, 0, 0, 0, 0, 0 };
+	return true;
+}
+
+double BandwidthEstimator::GetEstimate() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return estimate_;
+}
+
+// On machines with several NUMA nodes, the threads of a stream are kept on the
+// cores of one node, and its frames are allocated from that node's memory, so
+// that neither threads nor frames move across the nodes between the stages.
+
+// Returns the number of NUMA nodes, which is 1 unless kUseNumaPlacement is set.
+int NumaNodeCount() {
+	ULONG highest_node = 0;
+	if (!kUseNumaPlacement || !GetNumaHighestNodeNumber(&highest_node)) {
+		return 1;
+	}
+	return static_cast<int>(highest_node) + 1;
+}
+
+// Restricts the calling thread to the cores of the given node.
+void PinThreadToNode(const int node) {
+	if (!kUseNumaPlacement) {
+		return;
+	}
+	GROUP_AFFINITY affinity = {};
+	if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &affinity) ||
+		affinity.Mask == 0) {
+		return;
+	}
+	SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+}
+
+// Returns the node of the core that the calling thread is running on.
+int CurrentNumaNode() {
+	PROCESSOR_NUMBER processor;
+	GetCurrentProcessorNumberEx(&processor);
+	USHORT node = 0;
+	if (!GetNumaProcessorNodeEx(&processor, &node)) {
+		return 0;
+	}
+	return node;
+}
+
+// Freed frame buffers of up to this many bytes in total are kept per node for
+// the next frames, instead of being given back to the system.
+constexpr size_t kMaxPooledFrameBytes = 64 * 1024 * 1024;
+
+// Buffers are allocated in multiples of this, so that frames of about the same
+// size can reuse each other's buffers.
+constexpr size_t kFrameBufferGranularity = 64 * 1024;
+
+// Allocates the pixels of cv::Mat images from the memory of one NUMA node.
+// Set it as the allocator of a cv::Mat before the image is created in it.
+// Freed buffers are pooled, so that a stream's frames keep reusing the same
+// node-local pages.
+class NumaFrameAllocator : public cv::MatAllocator {
+public:
+	explicit NumaFrameAllocator(const int node) : node_(node), pooled_bytes_(0) {}
+
+	cv::UMatData* allocate(
+		int dims,
+		const int* sizes,
+		int type,
+		void* data,
+		size_t* step,
+		int flags,
+		cv::UMatUsageFlags usage_flags) const override;
+
+	bool allocate(
+		cv::UMatData* data, int access_flags, cv::UMatUsageFlags usage_flags) const override;
+
+	void deallocate(cv::UMatData* data) const override;
+
+private:
+	const int node_;
+
+	// The freed buffers by size, guarded by the mutex.
+	mutable std::mutex mutex_;
+	mutable std::multimap<size_t, void*> free_buffers_;
+	mutable size_t pooled_bytes_;
+};  // NumaFrameAllocator
+
+cv::UMatData* NumaFrameAllocator::allocate(
+	int dims,
+	const int* sizes,
+	int type,
+	void* data,
+	size_t* step,
+	int /* flags */,
+	cv::UMatUsageFlags /* usage_flags */) const {
+
+	// Compute the steps the way the default allocator does.
+	size_t total = CV_ELEM_SIZE(type);
+	for (int i = dims - 1; i >= 0; --i) {
+		if (step) {
+			if (data && step[i] != CV_AUTOSTEP) {
+				total = step[i];
+			} else {
+				step[i] = total;
+			}
+		}
+		total *= sizes[i];
+	}
+	cv::UMatData* u = new cv::UMatData(this);
+	u->size = total;
+	if (data) {
+		u->data = u->origdata = static_cast<unsigned char*>(data);
+		u->flags |= cv::UMatData::USER_ALLOCATED;
+		return u;
+	}
+	const size_t buffer_size = (total + kFrameBufferGranularity - 1) /
+		kFrameBufferGranularity * kFrameBufferGranularity;
+	void* buffer = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		const auto pooled = free_buffers_.find(buffer_size);
+		if (pooled != free_buffers_.end()) {
+			buffer = pooled->second;
+			free_buffers_.erase(pooled);
+			pooled_bytes_ -= buffer_size;
+		}
+	}
+	if (!buffer) {
+		buffer = VirtualAllocExNuma(
+			GetCurrentProcess(), nullptr, buffer_size,
+			MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, static_cast<DWORD>(node_));
+	}
+	if (!buffer) {
+		// The node is out of memory, so take it from anywhere.
+		buffer = VirtualAlloc(nullptr, buffer_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	}
+	if (!buffer) {
+		delete u;
+		throw std::bad_alloc();
+	}
+	u->data = u->origdata = static_cast<unsigned char*>(buffer);
+	return u;
+}
+
+bool NumaFrameAllocator::allocate(
+	cv::UMatData* data, int /* access_flags */, cv::UMatUsageFlags /* usage_flags */) const {
+	return data != nullptr;
+}
+
+void NumaFrameAllocator::deallocate(cv::UMatData* data) const {
+	if (!data) {
+		return;
+	}
+	if (!(data->flags & cv::UMatData::USER_ALLOCATED)) {
+		const size_t buffer_size = (data->size + kFrameBufferGranularity - 1) /
+			kFrameBufferGranularity * kFrameBufferGranularity;
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (pooled_bytes_ + buffer_size <= kMaxPooledFrameBytes) {
+			free_buffers_.insert(std::make_pair(buffer_size, data->origdata));
+			pooled_bytes_ += buffer_size;
+		} else {
+			lock.unlock();
+			VirtualFree(data->origdata, 0, MEM_RELEASE);
+		}
+	}
+	delete data;
+}
+
+// Returns the frame allocator of the node that the calling thread is running
+// on, or nullptr for the default allocator if kUseNumaPlacement is not set.
+cv::MatAllocator* GetLocalFrameAllocator() {
+	static std::vector<std::unique_ptr<NumaFrameAllocator>>* allocators = [] {
+		std::vector<std::unique_ptr<NumaFrameAllocator>>* allocators =
+			new std::vector<std::unique_ptr<NumaFrameAllocator>>();
+		for (int node = 0; node < NumaNodeCount(); ++node) {
+			allocators->push_back(
+				std::unique_ptr<NumaFrameAllocator>(new NumaFrameAllocator(node)));
+		}
+		return allocators;
+	}();
+	if (!kUseNumaPlacement) {
+		return nullptr;
+	}
+	const size_t node = static_cast<size_t>(CurrentNumaNode());
+	return node < allocators->size() ? (*allocators)[node].get() : nullptr;
+}
+
 class ProtocolData {
 public:
-	// Puts all of the relevant variables into a raw byte buffer which is
-	// returned, ready to be sent as a packet over the network.
-	virtual std::vector<unsigned char> PackageData() const = 0;
+	// Puts all of the relevant variables into a raw byte buffer which is
+	// returned, ready to be sent as a packet over the network.
+	virtual std::vector<unsigned char> PackageData() const = 0;
+
+	// Unpacks a received data buffer into the appropriate variables, in
+	// accordance to the specific protocol being implemented.
+	virtual void UnpackData(
+		const std::vector<unsigned char>& raw_bytes) = 0;
+};
+
+// What the sender knows about a stream's receiver from its receiver reports
+// (see ReceiverReport), for adaptation decisions and metrics. It is only used
+// on the thread that polls the feedback.
+class ReceiverReportTracker {
+public:
+	ReceiverReportTracker()
+		: report_(), num_reports_(0), report_time_us_(0), round_trip_us_(0) {}
+
+	// Takes a kPacketTypeReceiverReport packet that arrived at now_us.
+	void OnReport(
+		const unsigned char* packet, const size_t size, const long long now_us);
+
+	// Returns the latest report, and the number of reports so far. The report
+	// is all zeros until the first one arrives.
+	const ReceiverReport& LastReport() const {
+		return report_;
+	}
+	long long NumReports() const {
+		return num_reports_;
+	}
+
+	// Returns when the latest report arrived.
+	long long LastReportTimeUs() const {
+		return report_time_us_;
+	}
+
+	// Returns the round-trip time to the receiver, averaged over the recent
+	// reports, or 0 until it is known.
+	long long RoundTripUs() const {
+		return round_trip_us_;
+	}
+
+	// Puts the latest report into the stream's stats.
+	void ReportStats(StreamLatencyStats* stats) const;
+
+private:
+	ReceiverReport report_;
+	long long num_reports_;
+	long long report_time_us_;
+	long long round_trip_us_;
+};  // ReceiverReportTracker
+
+void ReceiverReportTracker::OnReport(
+	const unsigned char* packet, const size_t size, const long long now_us) {
+
+	if (size < kPacketHeaderSize || !ReadReceiverReport(
+		packet + kPacketHeaderSize, size - kPacketHeaderSize, &report_)) {
+		return;
+	}
+	++num_reports_;
+	report_time_us_ = now_us;
+	if (report_.last_send_time_us == 0) {
+		return;
+	}
+	// The time since the packet left, less the time the receiver held on to
+	// the report, was spent on the way there and back.
+	const int round_trip_us = static_cast<int>(
+		static_cast<unsigned int>(now_us) - report_.last_send_time_us -
+		report_.delay_since_last_us);
+	if (round_trip_us < 0) {
+		return;
+	}
+	round_trip_us_ = round_trip_us_ == 0 ?
+		round_trip_us : round_trip_us_ + (round_trip_us - round_trip_us_) / 8;
+}
+
+void ReceiverReportTracker::ReportStats(StreamLatencyStats* stats) const {
+	stats->SetCount("receiver highest sequence", report_.highest_sequence);
+	stats->SetCount("receiver packets lost", report_.cumulative_lost);
+	stats->SetCount("receiver fraction lost (1/256)", report_.fraction_lost);
+	stats->SetCount("receiver jitter us", report_.jitter_us);
+	stats->SetCount("receiver decode us", report_.decode_time_us);
+	stats->SetCount("receiver render us", report_.render_time_us);
+	stats->SetCount("round trip us", round_trip_us_);
+}
+
+// The interface that every transport implements, so the sending loop does not
+// need to know whether frames leave through a UDP socket or a shared-memory
+// ring.
+class PacketSender {
+public:
+	virtual ~PacketSender() {}
+
+	// Sends the given raw bytes to the receiver as a single packet.
+	virtual void SendPacket(const std::vector<unsigned char> &data) const = 0;
+
+	// Marks all further packets with the given traffic class. Transports that
+	// never leave the machine ignore this.
+	virtual void SetQoSClass(const QoSClass qos_class) {}
+
+	// Returns the largest payload that fits into a single packet.
+	virtual size_t MaxPayloadSize() const = 0;
+
+	// Returns true if the receiver sends feedback reports back through this
+	// transport, which makes bandwidth probing possible.
+	virtual bool HasFeedbackChannel() const { return false; }
+
+	// Hands any feedback reports that have arrived to the estimator, without
+	// waiting for new ones.
+	virtual void PollFeedback(BandwidthEstimator* estimator) {}
+
+	// Returns true if the receiver subscribed to the previews only, as of the
+	// last PollFeedback().
+	virtual bool WantsOnlyPreviews() const { return false; }
+
+	// Returns the region of the frames that the receiver subscribed to, as of
+	// the last PollFeedback().
+	virtual FrameRegion RequestedRegion() const { return FrameRegion(); }
+
+	// Returns what the receiver reported about the stream as of the last
+	// PollFeedback(), or null if the transport has no receiver reports.
+	virtual const ReceiverReportTracker* ReceiverReports() const {
+		return nullptr;
+	}
+
+	// Records how long the packets sent so far spent in the socket layer, for
+	// those that the kernel has timestamped by now. Transports without kernel
+	// timestamps ignore this.
+	virtual void RecordSocketDelays(StreamLatencyStats* stats) const {}
+};
+
+class SenderSocket final : public PacketSender {
+public:
+	SenderSocket(const std::string &receiver_ip, const int receiver_port);
+
+	// TODO: add destructor to clear the socket
+	// close(fd);
+
+	void SendPacket(const std::vector<unsigned char> &data) const override;
+
+	// Sets the DSCP bits of the outgoing packets (through qWAVE, and through
+	// IP_TOS as a fallback) and the socket priority where it is supported.
+	void SetQoSClass(const QoSClass qos_class) override;
+
+	size_t MaxPayloadSize() const override {
+		return kMaxFragmentPayloadSize;
+	}
+
+	// The receiver replies to the address the packets come from, so feedback
+	// arrives on this same socket.
+	bool HasFeedbackChannel() const override { return true; }
+
+	// Also takes the receiver's subscription and its receiver reports, which
+	// come along with its feedback.
+	void PollFeedback(BandwidthEstimator* estimator) override;
+
+	bool WantsOnlyPreviews() const override { return wants_only_previews_; }
+
+	FrameRegion RequestedRegion() const override { return region_; }
+
+	const ReceiverReportTracker* ReceiverReports() const override {
+		return &receiver_reports_;
+	}
+
+	void RecordSocketDelays(StreamLatencyStats* stats) const override;
+
+private:
+	// Feedback reports are received into this buffer.
+	std::vector<unsigned char> feedback_buffer_;
+
+	// The receiver's subscription. The full stream and the whole frames are
+	// sent until the receiver says otherwise.
+	bool wants_only_previews_;
+	FrameRegion region_;
+
+	// The receiver reports that came along with the feedback.
+	ReceiverReportTracker receiver_reports_;
+
+	// The socket identifier (handle).
+	int socket_handle_;
+
+	// The qWAVE handle and flow that the socket was added to, if any.
+	HANDLE qos_handle_;
+	QOS_FLOWID qos_flow_id_;
+
+	// The struct that contains the receiver's address and port. This is set up
+	// in the constructor.
+	sockaddr_in receiver_addr_;
+
+	// True if the kernel timestamps the outgoing packets. Each packet is then
+	// sent with an ID, and the IDs of the packets whose timestamps have not been
+	// collected yet are kept along with the times they were sent at.
+	bool transmit_timestamps_;
+	mutable unsigned int next_timestamp_id_;
+	mutable std::deque<std::pair<unsigned int, long long>> pending_timestamps_;
+};  // SenderSocket
+
+SenderSocket::SenderSocket(
+	const std::string &receiver_ip, const int receiver_port)
+	: feedback_buffer_(kMaxPacketBufferSize), wants_only_previews_(false), region_(),
+	  qos_handle_(NULL), qos_flow_id_(0),
+	  transmit_timestamps_(false), next_timestamp_id_(0) {
+
+	socket_handle_ = socket(AF_INET, SOCK_DGRAM, 0);
+	receiver_addr_.sin_family = AF_INET;
+	receiver_addr_.sin_port = htons(receiver_port);
+	receiver_addr_.sin_addr.s_addr = inet_addr(receiver_ip.c_str());
+#ifdef SIO_TIMESTAMPING
+	if (kUseKernelTimestamps) {
+		TIMESTAMPING_CONFIG config = {};
+		config.Flags = TIMESTAMPING_FLAG_TX;
+		config.TxTimestampsBuffered = kTxTimestampsBuffered;
+		DWORD num_bytes = 0;
+		transmit_timestamps_ = WSAIoctl(
+			socket_handle_, SIO_TIMESTAMPING, &config, sizeof(config),
+			nullptr, 0, &num_bytes, nullptr, nullptr) == 0;
+	}
+#endif
+}
+
+void SenderSocket::SendPacket(
+	const std::vector<unsigned char> &data) const {
+
+#ifdef SIO_TIMESTAMPING
+	if (transmit_timestamps_) {
+		// The ID goes along as control data, which only WSASendMsg() can send.
+		WSABUF data_buffer;
+		data_buffer.buf = const_cast<char*>(reinterpret_cast<const char*>(data.data()));
+		data_buffer.len = static_cast<ULONG>(data.size());
+		alignas(WSACMSGHDR) char control[WSA_CMSG_SPACE(sizeof(UINT32))] = {};
+		WSAMSG message = {};
+		message.name = const_cast<LPSOCKADDR>(
+			reinterpret_cast<const sockaddr*>(&receiver_addr_));
+		message.namelen = sizeof(receiver_addr_);
+		message.lpBuffers = &data_buffer;
+		message.dwBufferCount = 1;
+		message.Control.buf = control;
+		message.Control.len = sizeof(control);
+		WSACMSGHDR* header = WSA_CMSG_FIRSTHDR(&message);
+		header->cmsg_len = WSA_CMSG_LEN(sizeof(UINT32));
+		header->cmsg_level = SOL_SOCKET;
+		header->cmsg_type = SO_TIMESTAMP_ID;
+		const UINT32 timestamp_id = next_timestamp_id_++;
+		memcpy(WSA_CMSG_DATA(header), &timestamp_id, sizeof(timestamp_id));
+		const long long send_time_us = NowMicroseconds();
+		DWORD num_bytes = 0;
+		if (WSASendMsg(
+				socket_handle_, &message, 0, &num_bytes, nullptr, nullptr) == 0) {
+			pending_timestamps_.push_back(std::make_pair(timestamp_id, send_time_us));
+			// The kernel only keeps the newest timestamps.
+			if (pending_timestamps_.size() > kTxTimestampsBuffered) {
+				pending_timestamps_.pop_front();
+			}
+		}
+		return;
+	}
+#endif
+	sendto(
+		socket_handle_,
+		(const char *)data.data(),
+		data.size(),
+		0,
+		const_cast<sockaddr*>(reinterpret_cast<const sockaddr*>(&receiver_addr_)),
+		sizeof(receiver_addr_));
+}
+
+void SenderSocket::PollFeedback(BandwidthEstimator* estimator) {
+	TRACE_SCOPE("poll feedback");
+	while (true) {
+		// Only take what is already there; the sending loop must not block.
+		fd_set rfd;
+		FD_ZERO(&rfd);
+		FD_SET(socket_handle_, &rfd);
+		struct timeval timeout;
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 0;
+		if (select(socket_handle_ + 1, &rfd, 0, 0, &timeout) <= 0) {
+			return;
+		}
+		const int num_bytes = recvfrom(
+			socket_handle_,
+			reinterpret_cast<char*>(feedback_buffer_.data()),
+			kMaxPacketBufferSize,
+			0,
+			NULL,
+			NULL);
+		if (num_bytes <= 0) {
+			return;
+		}
+		PacketHeader header;
+		if (!IsPacketIntact(feedback_buffer_.data(), num_bytes) ||
+			!ReadPacketHeader(feedback_buffer_.data(), num_bytes, &header)) {
+			continue;
+		}
+		if (header.type == kPacketTypeFeedback) {
+			estimator->OnFeedback(feedback_buffer_.data(), num_bytes);
+		} else if (header.type == kPacketTypeSubscription &&
+			num_bytes > static_cast<int>(kPacketHeaderSize)) {
+			wants_only_previews_ =
+				feedback_buffer_[kPacketHeaderSize] == kSubscribePreview;
+			// Receivers that do not zoom leave the region out.
+			if (!ReadFrameRegion(
+				feedback_buffer_.data() + kPacketHeaderSize + 1,
+				num_bytes - kPacketHeaderSize - 1,
+				&region_)) {
+				region_ = FrameRegion();
+			}
+		} else if (header.type == kPacketTypeReceiverReport) {
+			receiver_reports_.OnReport(
+				feedback_buffer_.data(), num_bytes, NowMicroseconds());
+		}
+	}
+}
+
+void SenderSocket::RecordSocketDelays(StreamLatencyStats* stats) const {
+#ifdef SIO_TIMESTAMPING
+	while (!pending_timestamps_.empty()) {
+		UINT32 timestamp_id = pending_timestamps_.front().first;
+		UINT64 timestamp = 0;
+		DWORD num_bytes = 0;
+		if (WSAIoctl(
+				socket_handle_, SIO_GET_TX_TIMESTAMP,
+				&timestamp_id, sizeof(timestamp_id),
+				&timestamp, sizeof(timestamp),
+				&num_bytes, nullptr, nullptr) == 0) {
+			stats->Record(
+				kStageSocket,
+				QpcToMicroseconds(timestamp) - pending_timestamps_.front().second);
+		} else if (WSAGetLastError() == WSAEWOULDBLOCK) {
+			// The packet has not left yet, and neither have the ones after it.
+			return;
+		}
+		pending_timestamps_.pop_front();
+	}
+#endif
+}
+
+void SenderSocket::SetQoSClass(const QoSClass qos_class) {
+	// DSCP code points: CS1 (background), default, AF41 (video), EF.
+	static const DWORD kDSCPValues[kNumQoSClasses] = { 8, 0, 34, 46 };
+	static const QOS_TRAFFIC_TYPE kTrafficTypes[kNumQoSClasses] = {
+		QOSTrafficTypeBackground,
+		QOSTrafficTypeBestEffort,
+		QOSTrafficTypeAudioVideo,
+		QOSTrafficTypeControl,
+	};
+	const int index = static_cast<int>(qos_class);
+	DWORD dscp = kDSCPValues[index];
+
+	// Windows ignores IP_TOS unless the policy allows it, but it is cheap to
+	// set and is honoured on other stacks.
+	const int tos = static_cast<int>(dscp << 2);
+	setsockopt(
+		socket_handle_, IPPROTO_IP, IP_TOS,
+		reinterpret_cast<const char*>(&tos), sizeof(tos));
+#ifdef SO_PRIORITY
+	const int priority = index * 2;
+	setsockopt(
+		socket_handle_, SOL_SOCKET, SO_PRIORITY,
+		reinterpret_cast<const char*>(&priority), sizeof(priority));
+#endif
+
+	// qWAVE marks the packets according to the traffic type. Setting an
+	// explicit DSCP value on top of that needs administrator rights, so a
+	// failure there is not an error.
+	if (qos_handle_ == NULL) {
+		QOS_VERSION version;
+		version.MajorVersion = 1;
+		version.MinorVersion = 0;
+		if (!QOSCreateHandle(&version, &qos_handle_)) {
+			qos_handle_ = NULL;
+			return;
+		}
+	}
+	if (qos_flow_id_ != 0) {
+		QOSRemoveSocketFromFlow(qos_handle_, 0, qos_flow_id_, 0);
+		qos_flow_id_ = 0;
+	}
+	if (!QOSAddSocketToFlow(
+		qos_handle_,
+		socket_handle_,
+		reinterpret_cast<sockaddr*>(&receiver_addr_),
+		kTrafficTypes[index],
+		QOS_NON_ADAPTIVE_FLOW,
+		&qos_flow_id_)) {
+		std::cerr << "Could not add the socket to a QoS flow." << std::endl;
+		qos_flow_id_ = 0;
+		return;
+	}
+	QOSSetFlow(
+		qos_handle_, qos_flow_id_, QOSSetOutgoingDSCPValue,
+		sizeof(dscp), &dscp, 0, NULL);
+}
+
+// The layout of the shared-memory ring. The same layout is declared in
+// receiver.cpp, and both sides must agree on it.
+struct SharedMemoryRingHeader {
+	// Number of frames published so far. Frame n lives in slot
+	// n % kSharedMemorySlotCount.
+	volatile LONG64 write_count;
+};
+
+struct SharedMemorySlotHeader {
+	// Odd while the slot is being written, 2 * (n + 1) once frame n has been
+	// completely written. Readers check it before and after reading the slot
+	// to detect frames that were overwritten underneath them.
+	volatile LONG64 sequence;
+
+	// Number of valid frame bytes that follow this header.
+	volatile LONG size;
+};
+
+constexpr size_t kSharedMemorySlotStride =
+	sizeof(SharedMemorySlotHeader) + kSharedMemorySlotSize;
+constexpr size_t kSharedMemoryRingSize =
+	sizeof(SharedMemoryRingHeader) + kSharedMemorySlotCount * kSharedMemorySlotStride;
+
+// Returns the name of the shared-memory section (or of its event, if a suffix
+// is given) used for the stream on the given port.
+std::string SharedMemoryName(const int port, const std::string &suffix) {
+	return "Local\\streaming-udp-video-" + std::to_string(port) + suffix;
+}
+
+// Sends frames to a receiver running on the same machine through a ring of
+// frame slots in a pagefile-backed shared-memory section. The receiver is
+// woken through a named auto-reset event after each frame is published.
+class SharedMemorySender final : public PacketSender {
+public:
+	// Creates (or opens, if the receiver was started first) the ring for the
+	// stream on the given port.
+	explicit SharedMemorySender(const int port);
+
+	~SharedMemorySender();
+
+	// Copies the frame into the next slot of the ring and notifies the
+	// receiver. The oldest frame is overwritten if the receiver falls behind.
+	void SendPacket(const std::vector<unsigned char> &data) const override;
+
+	// A whole frame fits into one slot, so frames are never fragmented.
+	size_t MaxPayloadSize() const override {
+		return kSharedMemorySlotSize - kPacketHeaderSize;
+	}
+
+private:
+	// Handles to the shared-memory section and the notification event.
+	HANDLE mapping_handle_;
+	HANDLE event_handle_;
+
+	// The start of the mapped ring, or nullptr if it could not be mapped.
+	unsigned char *ring_;
+};  // SharedMemorySender
+
+SharedMemorySender::SharedMemorySender(const int port) : ring_(nullptr) {
+	mapping_handle_ = CreateFileMapping(
+		INVALID_HANDLE_VALUE,
+		NULL,
+		PAGE_READWRITE,
+		0,
+		static_cast<DWORD>(kSharedMemoryRingSize),
+		SharedMemoryName(port, "").c_str());
+	event_handle_ = CreateEvent(
+		NULL, FALSE, FALSE, SharedMemoryName(port, "-event").c_str());
+	if (mapping_handle_ == NULL || event_handle_ == NULL) {
+		std::cerr << "Could not create the shared-memory ring." << std::endl;
+		return;
+	}
+	ring_ = static_cast<unsigned char*>(MapViewOfFile(
+		mapping_handle_, FILE_MAP_ALL_ACCESS, 0, 0, kSharedMemoryRingSize));
+	if (ring_ == nullptr) {
+		std::cerr << "Could not map the shared-memory ring." << std::endl;
+	}
+}
+
+SharedMemorySender::~SharedMemorySender() {
+	if (ring_ != nullptr) {
+		UnmapViewOfFile(ring_);
+	}
+	if (event_handle_ != NULL) {
+		CloseHandle(event_handle_);
+	}
+	if (mapping_handle_ != NULL) {
+		CloseHandle(mapping_handle_);
+	}
+}
+
+void SharedMemorySender::SendPacket(
+	const std::vector<unsigned char> &data) const {
+
+	if (ring_ == nullptr) {
+		return;
+	}
+	if (data.size() > kSharedMemorySlotSize) {
+		std::cerr << "Frame is too large for a shared-memory slot." << std::endl;
+		return;
+	}
+	SharedMemoryRingHeader *ring_header =
+		reinterpret_cast<SharedMemoryRingHeader*>(ring_);
+	const LONG64 frame_number = ring_header->write_count;
+	SharedMemorySlotHeader *slot = reinterpret_cast<SharedMemorySlotHeader*>(
+		ring_ + sizeof(SharedMemoryRingHeader) +
+		(frame_number % kSharedMemorySlotCount) * kSharedMemorySlotStride);
+
+	// Mark the slot as being written, copy the frame in, then publish it.
+	InterlockedExchange64(&slot->sequence, 2 * frame_number + 1);
+	memcpy(reinterpret_cast<unsigned char*>(slot + 1), data.data(), data.size());
+	slot->size = static_cast<LONG>(data.size());
+	InterlockedExchange64(&slot->sequence, 2 * frame_number + 2);
+	InterlockedExchange64(&ring_header->write_count, frame_number + 1);
+	SetEvent(event_handle_);
+}
+
+// Creates the transport for the stream on the given port: the shared-memory
+// ring if it is enabled, otherwise a UDP socket to the receiver.
+std::unique_ptr<PacketSender> MakePacketSender(
+	const std::string &receiver_ip, const int receiver_port) {
+
+	if (kUseSharedMemoryTransport) {
+		return std::unique_ptr<PacketSender>(new SharedMemorySender(receiver_port));
+	}
+	return std::unique_ptr<PacketSender>(
+		new SenderSocket(receiver_ip, receiver_port));
+}
+
+// The transport that kUseSharedMemoryTransport picks, as a concrete type, so
+// that a Pipeline compiled for it calls it without virtual dispatch.
+typedef std::conditional<
+	kUseSharedMemoryTransport, SharedMemorySender, SenderSocket>::type
+	StreamTransport;
+
+// Creates a transport of the given type for the stream on the given port.
+// MakeTransport<PacketSender>() creates the one MakePacketSender() picks.
+template <typename Transport>
+std::unique_ptr<Transport> MakeTransport(
+	const std::string &receiver_ip, const int receiver_port);
+
+template <>
+std::unique_ptr<SenderSocket> MakeTransport<SenderSocket>(
+	const std::string &receiver_ip, const int receiver_port) {
+
+	return std::unique_ptr<SenderSocket>(
+		new SenderSocket(receiver_ip, receiver_port));
+}
+
+template <>
+std::unique_ptr<SharedMemorySender> MakeTransport<SharedMemorySender>(
+	const std::string &receiver_ip, const int receiver_port) {
+
+	return std::unique_ptr<SharedMemorySender>(
+		new SharedMemorySender(receiver_port));
+}
+
+template <>
+std::unique_ptr<PacketSender> MakeTransport<PacketSender>(
+	const std::string &receiver_ip, const int receiver_port) {
+
+	return MakePacketSender(receiver_ip, receiver_port);
+}
+
+// Splits encoded frames into packets that fit the transport, and numbers the
+// packets and frames of one stream.
+class Packetizer {
+public:
+	Packetizer() : next_sequence_(0), next_frame_id_(0), next_preview_id_(0) {}
+
+	// Splits the frame's JPEG, preceded by its trace, into fragments of at
+	// most max_payload_size bytes, each with its own packet header and
+	// FragmentInfo. Fragments are cut at the ends of stripes, so that each
+	// stripe travels in a single fragment unless it is too large for one.
+	// The end of the packetize stage is stamped into the trace, both the
+	// caller's and the one in the packets. An empty frame produces no packets.
+	std::vector<std::vector<unsigned char>> PacketizeFrame(
+		const std::vector<unsigned char>& jpeg,
+		const unsigned char table_id,
+		FrameTrace* trace,
+		const size_t max_payload_size);
+
+	// Same as above, but for a preview frame, whose JPEG is complete.
+	std::vector<std::vector<unsigned char>> PacketizePreview(
+		const std::vector<unsigned char>& jpeg,
+		FrameTrace* trace,
+		const size_t max_payload_size);
+
+	// Creates the padding packets of a probe cluster.
+	std::vector<std::vector<unsigned char>> MakeProbeCluster(
+		const unsigned char probe_cluster);
+
+	// Creates the kPacketTypeTables packet with the given payload.
+	std::vector<unsigned char> MakeTablePacket(
+		const std::vector<unsigned char>& table_payload);
+
+private:
+	// PacketizeFrame() for frames of the given packet type and id.
+	std::vector<std::vector<unsigned char>> Packetize(
+		const unsigned char type,
+		const unsigned int frame_id,
+		const std::vector<unsigned char>& jpeg,
+		const unsigned char table_id,
+		FrameTrace* trace,
+		const size_t max_payload_size);
+
+	unsigned int next_sequence_;
+	unsigned int next_frame_id_;
+	unsigned int next_preview_id_;
+};  // Packetizer
+
+// Returns the offset just past the end of each stripe of the JPEG's scan,
+// that is past its restart marker or, for the last stripe, past EOI. Any bytes
+// after EOI are counted into the last stripe. Returns nothing if the scan
+// could not be found.
+std::vector<size_t> FindStripeEnds(const std::vector<unsigned char>& jpeg) {
+	std::vector<size_t> stripe_ends;
+	const size_t scan_start = FindJpegScanStart(jpeg.data(), jpeg.size());
+	if (scan_start == 0) {
+		return stripe_ends;
+	}
+	// Inside the scan, 0xFF bytes of data are followed by a stuffed 0x00, so
+	// any other byte after 0xFF is a marker.
+	for (size_t i = scan_start; i + 1 < jpeg.size(); ++i) {
+		if (jpeg[i] != 0xFF) {
+			continue;
+		}
+		if (IsStripeEndMarker(jpeg[i + 1])) {
+			stripe_ends.push_back(i + 2);
+		}
+		++i;
+	}
+	if (!stripe_ends.empty()) {
+		stripe_ends.back() = jpeg.size();
+	}
+	return stripe_ends;
+}
+
+std::vector<std::vector<unsigned char>> Packetizer::PacketizeFrame(
+	const std::vector<unsigned char>& jpeg,
+	const unsigned char table_id,
+	FrameTrace* trace,
+	const size_t max_payload_size) {
+
+	if (jpeg.empty()) {
+		return std::vector<std::vector<unsigned char>>();
+	}
+	return Packetize(kPacketTypeFrame, next_frame_id_++, jpeg, table_id, trace,
+		max_payload_size);
+}
+
+std::vector<std::vector<unsigned char>> Packetizer::PacketizePreview(
+	const std::vector<unsigned char>& jpeg,
+	FrameTrace* trace,
+	const size_t max_payload_size) {
+
+	if (jpeg.empty()) {
+		return std::vector<std::vector<unsigned char>>();
+	}
+	return Packetize(kPacketTypePreview, next_preview_id_++, jpeg, kNoTableId,
+		trace, max_payload_size);
+}
+
+std::vector<std::vector<unsigned char>> Packetizer::Packetize(
+	const unsigned char type,
+	const unsigned int frame_id,
+	const std::vector<unsigned char>& jpeg,
+	const unsigned char table_id,
+	FrameTrace* trace,
+	const size_t max_payload_size) {
+
+	TRACE_SCOPE("packetize");
+
+	std::vector<std::vector<unsigned char>> packets;
+	const std::vector<size_t> stripe_ends = FindStripeEnds(jpeg);
+
+	// Pick the byte range of the JPEG that goes into each fragment.
+	struct Fragment {
+		size_t begin;
+		size_t end;
+		FragmentInfo info;
+	};
+	std::vector<Fragment> fragments;
+	size_t begin = 0;
+	size_t stripe = 0;
+	bool continues_stripe = false;
+	while (begin < jpeg.size()) {
+		Fragment fragment;
+		fragment.begin = begin;
+		fragment.info.table_id = table_id;
+		fragment.info.stripe = stripe_ends.empty() ? kUnknownStripe :
+			static_cast<unsigned short>(
+				stripe | (continues_stripe ? kFragmentContinuesStripe : 0));
+		const size_t capacity = max_payload_size - kFragmentInfoSize -
+			(fragments.empty() ? kFrameTraceSize : 0);
+		// Take as many whole stripes as fit.
+		fragment.end = begin;
+		while (stripe < stripe_ends.size() &&
+			stripe_ends[stripe] - begin <= capacity) {
+			fragment.end = stripe_ends[stripe];
+			++stripe;
+			continues_stripe = false;
+		}
+		if (fragment.end == begin) {
+			// Not even one stripe fits, so cut it. Never cut between a 0xFF
+			// and the byte after it, so that markers stay in one piece.
+			fragment.end = std::min(begin + capacity, jpeg.size());
+			if (fragment.end < jpeg.size() && jpeg[fragment.end - 1] == 0xFF &&
+				fragment.end - 1 > begin) {
+				--fragment.end;
+			}
+			continues_stripe = true;
+		}
+		fragments.push_back(fragment);
+		begin = fragment.end;
+	}
+
+	PacketHeader header;
+	header.type = type;
+	header.probe_cluster = 0;
+	header.fragment_count = static_cast<unsigned short>(fragments.size());
+	header.frame_id = frame_id;
+	header.send_time_us = 0;
+	for (size_t i = 0; i < fragments.size(); ++i) {
+		const Fragment& fragment = fragments[i];
+		// The trace is written below, once packetizing is done.
+		const size_t prefix_size =
+			kFragmentInfoSize + (i == 0 ? kFrameTraceSize : 0);
+		header.fragment_index = static_cast<unsigned short>(i);
+		header.sequence = next_sequence_++;
+		std::vector<unsigned char> packet(
+			kPacketHeaderSize + prefix_size + fragment.end - fragment.begin);
+		WritePacketHeader(header, packet.data());
+		WriteFragmentInfo(fragment.info, packet.data() + kPacketHeaderSize);
+		memcpy(packet.data() + kPacketHeaderSize + prefix_size,
+			jpeg.data() + fragment.begin, fragment.end - fragment.begin);
+		packets.push_back(std::move(packet));
+	}
+	trace->stage_end_us[kStagePacketize] =
+		static_cast<unsigned int>(NowMicroseconds()) - trace->capture_start_us;
+	WriteFrameTrace(
+		*trace, packets[0].data() + kPacketHeaderSize + kFragmentInfoSize);
+	return packets;
+}
+
+std::vector<std::vector<unsigned char>> Packetizer::MakeProbeCluster(
+	const unsigned char probe_cluster) {
+
+	std::vector<std::vector<unsigned char>> packets;
+	PacketHeader header;
+	header.type = kPacketTypePadding;
+	header.probe_cluster = probe_cluster;
+	header.fragment_index = 0;
+	header.fragment_count = 0;
+	header.frame_id = 0;
+	header.send_time_us = 0;
+	for (size_t i = 0; i < kProbePacketCount; ++i) {
+		header.sequence = next_sequence_++;
+		std::vector<unsigned char> packet(
+			kPacketHeaderSize + kMaxFragmentPayloadSize, 0);
+		WritePacketHeader(header, packet.data());
+		packets.push_back(std::move(packet));
+	}
+	return packets;
+}
+
+std::vector<unsigned char> Packetizer::MakeTablePacket(
+	const std::vector<unsigned char>& table_payload) {
+
+	PacketHeader header;
+	header.type = kPacketTypeTables;
+	header.probe_cluster = 0;
+	header.fragment_index = 0;
+	header.fragment_count = 1;
+	header.sequence = next_sequence_++;
+	header.frame_id = 0;
+	header.send_time_us = 0;
+	std::vector<unsigned char> packet(kPacketHeaderSize + table_payload.size());
+	WritePacketHeader(header, packet.data());
+	memcpy(packet.data() + kPacketHeaderSize, table_payload.data(), table_payload.size());
+	return packet;
+}
+
+// Sends the packets of all streams from a single thread. Frames are kept in
+// one queue per traffic class, and the queue of the highest class that has
+// packets waiting is always drained first, so that critical streams keep
+// their frame rate while the others degrade when the uplink saturates.
+class TransmitScheduler {
+public:
+	// Starts the transmit thread. The uplink rate (in bits per second) paces
+	// all frames until a stream has an estimate (see SetStreamEstimate()); 0
+	// disables pacing until then.
+	explicit TransmitScheduler(const double uplink_bits_per_second);
+
+	~TransmitScheduler();
+
+	// Queues the packets of a frame to be sent through the given transport,
+	// and reports each packet to the estimator (if any) as it leaves. Once
+	// the last packet has left, the time since the frame was packetized (at
+	// packetized_time_us, wrapping like PacketHeader::send_time_us) is
+	// recorded as its send stage. This never blocks; if the class queue is
+	// full its oldest unsent frame is dropped.
+	void EnqueueFrame(
+		const PacketSender* transport,
+		BandwidthEstimator* estimator,
+		StreamLatencyStats* latency_stats,
+		const unsigned int packetized_time_us,
+		const QoSClass qos_class,
+		std::vector<std::vector<unsigned char>> packets);
+
+	// Queues a probe cluster. Its packets are sent back to back, ignoring the
+	// pacing, since their spacing at the receiver is what gets measured.
+	void EnqueueProbeCluster(
+		const PacketSender* transport,
+		BandwidthEstimator* estimator,
+		const QoSClass qos_class,
+		std::vector<std::vector<unsigned char>> packets);
+
+	// Queues a kPacketTypeTables packet, to be sent before the frames queued
+	// after it. Unlike frames it is never dropped, since the frames that
+	// follow cannot be decoded without it.
+	void EnqueueTables(
+		const PacketSender* transport,
+		BandwidthEstimator* estimator,
+		const QoSClass qos_class,
+		std::vector<unsigned char> packet);
+
+	// Sets the bandwidth estimated for the stream that the estimator belongs
+	// to, in bits per second, or 0 if it has none. Packets are paced to the
+	// sum of the estimates that are known, so that the higher classes keep
+	// the uplink when the streams together exceed it.
+	void SetStreamEstimate(
+		const BandwidthEstimator* estimator, const double bits_per_second);
+
+private:
+	struct QueuedFrame {
+		const PacketSender* transport;
+		BandwidthEstimator* estimator;
+		StreamLatencyStats* latency_stats;
+		unsigned int packetized_time_us;
+		std::deque<std::vector<unsigned char>> packets;
+		bool paced;
+		bool started;
+		bool droppable;
+	};
+
+	// Adds the frame to its class queue and wakes up the transmit thread.
+	void Enqueue(const QoSClass qos_class, QueuedFrame frame);
+
+	// The transmit thread's loop.
+	void Run();
+
+	// One queue per traffic class, indexed by QoSClass.
+	std::deque<QueuedFrame> queues_[kNumQoSClasses];
+
+	// The number of frames dropped per class because the queue was full.
+	size_t dropped_frames_[kNumQoSClasses];
+
+	// The latest estimate of each stream, by its estimator.
+	std::map<const BandwidthEstimator*, double> stream_estimates_;
+
+	// The uplink rate given to the constructor, which is paced to while no
+	// stream has an estimate, and the one paced to.
+	const double configured_bits_per_second_;
+	double uplink_bits_per_second_;
+	bool stop_;
+
+	std::mutex mutex_;
+	std::condition_variable packet_queued_;
+	std::thread thread_;
+};  // TransmitScheduler
+
+TransmitScheduler::TransmitScheduler(const double uplink_bits_per_second)
+	: configured_bits_per_second_(uplink_bits_per_second),
+	uplink_bits_per_second_(uplink_bits_per_second), stop_(false) {
+
+	for (int i = 0; i < kNumQoSClasses; ++i) {
+		dropped_frames_[i] = 0;
+	}
+	thread_ = std::thread(&TransmitScheduler::Run, this);
+}
+
+TransmitScheduler::~TransmitScheduler() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	packet_queued_.notify_one();
+	thread_.join();
+}
+
+void TransmitScheduler::EnqueueFrame(
+	const PacketSender* transport,
+	BandwidthEstimator* estimator,
+	StreamLatencyStats* latency_stats,
+	const unsigned int packetized_time_us,
+	const QoSClass qos_class,
+	std::vector<std::vector<unsigned char>> packets) {
+
+	if (packets.empty()) {
+		return;
+	}
+	QueuedFrame frame = { transport, estimator, latency_stats, packetized_time_us,
+		std::deque<std::vector<unsigned char>>(
+			std::make_move_iterator(packets.begin()),
+			std::make_move_iterator(packets.end())),
+		true, false, true };
+	Enqueue(qos_class, std::move(frame));
+}
+
+void TransmitScheduler::EnqueueProbeCluster(
+	const PacketSender* transport,
+	BandwidthEstimator* estimator,
+	const QoSClass qos_class,
+	std::vector<std::vector<unsigned char>> packets) {
+
+	QueuedFrame frame = { transport, estimator, nullptr, 0,
+		std::deque<std::vector<unsigned char>>(
+			std::make_move_iterator(packets.begin()),
+			std::make_move_iterator(packets.end())),
+		false, false, true };
+	Enqueue(qos_class, std::move(frame));
+}
+
+void TransmitScheduler::EnqueueTables(
+	const PacketSender* transport,
+	BandwidthEstimator* estimator,
+	const QoSClass qos_class,
+	std::vector<unsigned char> packet) {
+
+	QueuedFrame frame = { transport, estimator, nullptr, 0,
+		std::deque<std::vector<unsigned char>>(), true, false, false };
+	frame.packets.push_back(std::move(packet));
+	Enqueue(qos_class, std::move(frame));
+}
+
+void TransmitScheduler::Enqueue(const QoSClass qos_class, QueuedFrame frame) {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		const int index = static_cast<int>(qos_class);
+		std::deque<QueuedFrame>& queue = queues_[index];
+		if (queue.size() >= kMaxQueuedFramesPerClass) {
+			// A frame that is partly sent is finished, since dropping the rest
+			// of it would waste the packets that already left, and tables are
+			// always sent.
+			std::deque<QueuedFrame>::iterator oldest = queue.begin();
+			while (oldest != queue.end() && (oldest->started || !oldest->droppable)) {
+				++oldest;
+			}
+			if (oldest != queue.end()) {
+				queue.erase(oldest);
+				++dropped_frames_[index];
+			}
+		}
+		queue.push_back(std::move(frame));
+	}
+	packet_queued_.notify_one();
+}
+
+void TransmitScheduler::SetStreamEstimate(
+	const BandwidthEstimator* estimator, const double bits_per_second) {
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	stream_estimates_[estimator] = bits_per_second;
+	// Streams whose receiver never sent feedback have no estimate; they are
+	// left out rather than keeping the others unpaced.
+	double uplink_bits_per_second = 0;
+	for (const auto& stream : stream_estimates_) {
+		if (stream.second > 0) {
+			uplink_bits_per_second += stream.second;
+		}
+	}
+	uplink_bits_per_second_ = uplink_bits_per_second > 0
+		? uplink_bits_per_second : configured_bits_per_second_;
+}
+
+void TransmitScheduler::Run() {
+	TRACE_THREAD_NAME("transmit scheduler");
+	std::chrono::steady_clock::time_point next_send_time =
+		std::chrono::steady_clock::now();
+	while (true) {
+		const PacketSender* transport = nullptr;
+		BandwidthEstimator* estimator = nullptr;
+		StreamLatencyStats* latency_stats = nullptr;
+		StreamLatencyStats* socket_stats = nullptr;
+		unsigned int packetized_time_us = 0;
+		std::vector<unsigned char> packet;
+		bool paced = false;
+		double uplink_bits_per_second = 0;
+		{
+			TRACE_SCOPE("wait for packet");
+			std::unique_lock<std::mutex> lock(mutex_);
+			int index = -1;
+			packet_queued_.wait(lock, [this, &index] {
+				for (index = kNumQoSClasses - 1; index >= 0; --index) {
+					if (!queues_[index].empty()) {
+						return true;
+					}
+				}
+				return stop_;
+			});
+			if (stop_) {
+				return;
+			}
+			QueuedFrame& frame = queues_[index].front();
+			transport = frame.transport;
+			estimator = frame.estimator;
+			paced = frame.paced;
+			socket_stats = frame.latency_stats;
+			packet = std::move(frame.packets.front());
+			frame.packets.pop_front();
+			frame.started = true;
+			if (frame.packets.empty()) {
+				// Only the last packet of a frame completes its send stage.
+				latency_stats = frame.latency_stats;
+				packetized_time_us = frame.packetized_time_us;
+				queues_[index].pop_front();
+			}
+			uplink_bits_per_second = uplink_bits_per_second_;
+		}
+		// Wait until the uplink has room for the packet. The highest class is
+		// picked again after every packet, so a large low-priority frame never
+		// delays a high-priority one by more than a single packet.
+		if (paced && uplink_bits_per_second > 0) {
+			TRACE_SCOPE("pace");
+			std::this_thread::sleep_until(next_send_time);
+			const std::chrono::steady_clock::time_point now =
+				std::chrono::steady_clock::now();
+			if (next_send_time < now) {
+				next_send_time = now;
+			}
+			next_send_time += std::chrono::microseconds(static_cast<long long>(
+				packet.size() * 8 * 1e6 / uplink_bits_per_second));
+		}
+		// Stamp the actual send time into the header just before it leaves,
+		// which completes the packet.
+		const long long send_time_us = NowMicroseconds();
+		PacketHeader header;
+		if (ReadPacketHeader(packet.data(), packet.size(), &header)) {
+			header.send_time_us = static_cast<unsigned int>(send_time_us);
+			WritePacketHeader(header, packet.data());
+			SealPacket(packet.data(), packet.size());
+		}
+		{
+			TRACE_SCOPE("send packet");
+			transport->SendPacket(packet);
+		}
+		if (socket_stats != nullptr) {
+			transport->RecordSocketDelays(socket_stats);
+		}
+		if (estimator != nullptr) {
+			estimator->OnPacketSent(header, packet.size(), send_time_us);
+		}
+		if (latency_stats != nullptr) {
+			latency_stats->Record(kStageSend, static_cast<int>(
+				static_cast<unsigned int>(send_time_us) - packetized_time_us));
+		}
+	}
+}
+
+// Returns the transmit scheduler shared by all sending threads. It is never
+// destroyed, since the sending threads run until the process exits.
+TransmitScheduler& GetTransmitScheduler() {
+	static TransmitScheduler* scheduler =
+		new TransmitScheduler(kUplinkBitsPerSecond);
+	return *scheduler;
+}
+
+// Runs the tasks of all streams on one worker thread per core. Each worker has
+// a deque of its own, which tasks are spread over. A worker takes the oldest
+// task from the front of its deque, and when it runs dry, steals from the back
+// of another worker's deque, so that no core idles while another has tasks
+// queued. Taking the oldest task first, rather than the newest as work
+// stealing usually does, keeps the latency of each frame low.
+//
+// The workers are spread over the NUMA nodes and pinned to them. A task can be
+// submitted to the workers of a node, and workers steal from their own node
+// before they steal across nodes.
+//
+// Tasks may run in parallel and finish in any order. A stream that needs its
+// results in order puts them back in order with a FrameSequencer.
+class TaskPool {
+public:
+	explicit TaskPool(const unsigned int num_workers);
+
+	// Lets the workers finish the tasks they are running, and joins them.
+	// Tasks that have not started are dropped.
+	~TaskPool();
+
+	// Queues the task for a worker of the given node, or of any node if it is
+	// -1. A task submitted from a worker of that node goes to that worker's
+	// deque, since the data it works on is likely still in that core's cache.
+	void Submit(std::function<void()> task, const int node = -1);
+
+private:
+	struct Worker {
+		int node;
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	void Work(const size_t index);
+
+	// Takes a task from the worker's deque, or steals one from another.
+	bool TakeTask(const size_t index, std::function<void()>* task);
+
+	// Takes the oldest task of the worker, or steals its newest one.
+	bool TakeTaskFrom(Worker* worker, const bool steal, std::function<void()>* task);
+
+	std::vector<std::unique_ptr<Worker>> workers_;
+
+	// The number of tasks in all deques. Idle workers sleep on task_added_
+	// until it is nonzero.
+	std::atomic<size_t> num_queued_;
+	std::mutex idle_mutex_;
+	std::condition_variable task_added_;
+
+	std::atomic<size_t> next_worker_;
+	std::atomic<bool> stopped_;
+	std::vector<std::thread> threads_;
+};  // TaskPool
+
+// The pool and the index of the worker that the current thread is, if any.
+thread_local const TaskPool* current_task_pool = nullptr;
+thread_local size_t current_worker_index = 0;
+
+TaskPool::TaskPool(const unsigned int num_workers)
+	: num_queued_(0), next_worker_(0), stopped_(false) {
+	const int num_nodes = NumaNodeCount();
+	for (unsigned int i = 0; i < std::max(num_workers, 1u); ++i) {
+		workers_.push_back(std::unique_ptr<Worker>(new Worker()));
+		workers_.back()->node = static_cast<int>(i % num_nodes);
+	}
+	for (size_t i = 0; i < workers_.size(); ++i) {
+		threads_.push_back(std::thread([this, i] {
+			TRACE_THREAD_NAME("task worker " + std::to_string(i));
+			PinThreadToNode(workers_[i]->node);
+			current_task_pool = this;
+			current_worker_index = i;
+			Work(i);
+		}));
+	}
+}
+
+TaskPool::~TaskPool() {
+	{
+		std::lock_guard<std::mutex> lock(idle_mutex_);
+		stopped_ = true;
+	}
+	task_added_.notify_all();
+	for (std::thread& thread : threads_) {
+		thread.join();
+	}
+}
+
+void TaskPool::Submit(std::function<void()> task, const int node) {
+	size_t index = current_worker_index;
+	if (current_task_pool != this ||
+		(node >= 0 && workers_[index]->node != node)) {
+		index = next_worker_++ % workers_.size();
+		// Move on to the next worker of the node, if it has any.
+		for (size_t i = 0; node >= 0 && i < workers_.size(); ++i) {
+			const size_t candidate = (index + i) % workers_.size();
+			if (workers_[candidate]->node == node) {
+				index = candidate;
+				break;
+			}
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lock(workers_[index]->mutex);
+		workers_[index]->tasks.push_back(std::move(task));
+	}
+	{
+		// Taking the lock makes sure that a worker about to sleep sees the
+		// task.
+		std::lock_guard<std::mutex> lock(idle_mutex_);
+		++num_queued_;
+	}
+	task_added_.notify_one();
+}
+
+bool TaskPool::TakeTask(const size_t index, std::function<void()>* task) {
+	if (TakeTaskFrom(workers_[index].get(), false, task)) {
+		return true;
+	}
+	const int node = workers_[index]->node;
+	for (const bool same_node : {true, false}) {
+		for (size_t i = 1; i < workers_.size(); ++i) {
+			Worker* victim = workers_[(index + i) % workers_.size()].get();
+			if ((victim->node == node) == same_node &&
+				TakeTaskFrom(victim, true, task)) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+bool TaskPool::TakeTaskFrom(
+	Worker* worker, const bool steal, std::function<void()>* task) {
+
+	std::lock_guard<std::mutex> lock(worker->mutex);
+	if (worker->tasks.empty()) {
+		return false;
+	}
+	if (steal) {
+		*task = std::move(worker->tasks.back());
+		worker->tasks.pop_back();
+	} else {
+		*task = std::move(worker->tasks.front());
+		worker->tasks.pop_front();
+	}
+	--num_queued_;
+	return true;
+}
+
+void TaskPool::Work(const size_t index) {
+	while (!stopped_) {
+		std::function<void()> task;
+		if (TakeTask(index, &task)) {
+			task();
+			continue;
+		}
+		TRACE_SCOPE("wait for task");
+		std::unique_lock<std::mutex> lock(idle_mutex_);
+		task_added_.wait(lock, [this] { return stopped_ || num_queued_ > 0; });
+	}
+}
+
+TaskPool& GetTaskPool() {
+	static TaskPool* pool = new TaskPool(std::thread::hardware_concurrency());
+	return *pool;
+}
+
+// Puts the frames of one stream back into capture order after they were
+// processed on the TaskPool, and limits how many are in the pool at a time.
+// Each frame gets a ticket when it is captured; the step that must see the
+// frames in order is handed in with the ticket, and run once the frames
+// before it are through. It runs on whichever thread completed the frame
+// that let it go, and never on two threads at once.
+class FrameSequencer {
+public:
+	FrameSequencer() : next_ticket_(0), next_to_finish_(0), finishing_(false) {}
+
+	// Waits until fewer than kMaxFramesInFlight frames are in flight, and
+	// returns the ticket of the next frame.
+	unsigned int NextTicket();
+
+	// Hands in the in-order step of the frame with the given ticket, and runs
+	// it and any of the following ones that were waiting for it.
+	void Complete(const unsigned int ticket, std::function<void()> finish);
+
+private:
+	std::mutex mutex_;
+	std::condition_variable frame_finished_;
+	unsigned int next_ticket_;
+	unsigned int next_to_finish_;
+	bool finishing_;
+
+	// The steps of the frames that completed ahead of an earlier one.
+	std::map<unsigned int, std::function<void()>> waiting_;
+};  // FrameSequencer
+
+unsigned int FrameSequencer::NextTicket() {
+	TRACE_SCOPE("wait for frame slot");
+	std::unique_lock<std::mutex> lock(mutex_);
+	frame_finished_.wait(lock, [this] {
+		return next_ticket_ - next_to_finish_ < kMaxFramesInFlight;
+	});
+	return next_ticket_++;
+}
+
+void FrameSequencer::Complete(
+	const unsigned int ticket, std::function<void()> finish) {
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	waiting_[ticket] = std::move(finish);
+	if (finishing_) {
+		// The thread that is finishing frames will get to this one.
+		return;
+	}
+	finishing_ = true;
+	auto next = waiting_.find(next_to_finish_);
+	while (next != waiting_.end()) {
+		std::function<void()> step = std::move(next->second);
+		waiting_.erase(next);
+		lock.unlock();
+		step();
+		lock.lock();
+		++next_to_finish_;
+		frame_finished_.notify_all();
+		next = waiting_.find(next_to_finish_);
+	}
+	finishing_ = false;
+}
+
+
+class ReceiverSocket {
+public:
+	// Creates a new socket and stores the handle.
+	explicit ReceiverSocket(const int port_number);
+
+	// Attempts to bind the socket on the port number provided to listen to
+	// incoming UDP packets. If the socket could not be created (in the
+	// constructor) or if the binding process fails, an error message will be
+	// printed to stderr. The method returns true on success, false otherwise.
+	const bool BindSocketToListen() const;
+
+	// Waits for the next packet on the given port, and returns vector of bytes
+	// (stored as unsigned chars) that contains the raw packet data.
+	const std::vector<unsigned char> GetPacket() const;
+
+private:
+	// This buffer will be used to collect incoming packet data. It is only used
+	// in the GetPacket() method.
+	char buffer_[kMaxPacketBufferSize];
+
+	// The port number that the socket will listen for packets on.
+	const int port_;
+
+	// The socket identifier (handle).
+	int socket_handle_;
+};  // ReceiverSocket
+
+class JpegRateController;
+
+class VideoFrame {
+public:
+	// Default constructor (required) just makes an empty image.
+	VideoFrame() {}
+
+	// Initialize the video frame from an existing cv::Mat image.
+	explicit VideoFrame(const cv::Mat& image) : frame_image_(image) {}
+
+	// Initialize the video frame (image) from a buffer of raw bytes.
+	explicit VideoFrame(const std::vector<unsigned char> frame_bytes);
+
+	// Uses the underlying video/image/gui library to display the frame on the
+	// user's screen. Only one frame can be displayed at a time, as all frames
+	// will share the same GUI window.
+	void Display() const;
+
+	// Returns the raw byte representation of the given video frame. Singe image
+	// compression to JPEG is also handled here to minimize the frame size.
+	// A source JPEG (see SetSourceJPEG) is returned as it is.
+	std::vector<unsigned char> GetJPEG() const;
+
+	// Same as above, but compresses with the given JPEG quality (0 to 100).
+	std::vector<unsigned char> GetJPEG(const int quality) const;
+
+	// Same as above, but lets the rate controller pick the quality so that the
+	// result fits into max_bytes. The frame is encoded at most twice; if even
+	// the second attempt is too large, it is returned anyway. A source JPEG
+	// that fits is returned as it is, and one that does not is requantized
+	// if kUseRequantization is set.
+	std::vector<unsigned char> GetJPEG(
+		const size_t max_bytes, JpegRateController* rate_controller) const;
+
+	// Returns the frame as a preview: at most kPreviewMaxWidth wide, and
+	// compressed with kPreviewJPEGQuality. A source JPEG is decoded at an
+	// eighth of its size, which takes little more than its DC coefficients.
+	std::vector<unsigned char> GetPreviewJPEG() const;
+
+	// Sets the JPEG that the source delivered the frame as, so that it can be
+	// sent without encoding the frame again. The image may then be left empty;
+	// it is decoded from the JPEG if it is needed.
+	void SetSourceJPEG(std::vector<unsigned char> jpeg) {
+		source_jpeg_ = std::make_shared<const std::vector<unsigned char>>(
+			std::move(jpeg));
+	}
+
+	// Sets the stage timestamps of the frame.
+	void SetTrace(const FrameTrace& trace) {
+		trace_ = trace;
+	}
+
+	// Returns the stage timestamps of the frame.
+	const FrameTrace& GetTrace() const {
+		return trace_;
+	}
+
+private:
+	// Returns the image, decoding it from the source JPEG if it is not there.
+	cv::Mat GetImage() const;
+
+	cv::Mat frame_image_;
+
+	// The JPEG from the source, if any. It is shared between the copies of the
+	// frame, since it is never changed.
+	std::shared_ptr<const std::vector<unsigned char>> source_jpeg_;
+
+	// When the frame passed through each stage of the sender.
+	FrameTrace trace_ = {};
+};
+
+// A frame as it came from the camera, before it is resized and drawn into.
+struct RawFrame {
+	cv::Mat image;
+
+	// The frame as the source compressed it, if it did. The image is empty
+	// then.
+	std::vector<unsigned char> jpeg;
+
+	FrameTrace trace = {};
+};
+
+// The scaler and overlay stages of a Pipeline. Each stage is a small class
+// whose methods are inline, so that a pipeline of fixed stages compiles
+// without calls between them, and a stage that does nothing compiles to
+// nothing. IsIdentity() is true for a stage that never changes the image;
+// if both are, frames that the source delivered as JPEG are sent without
+// being decoded. The Dynamic* stages decide at runtime instead, for streams
+// that are configured at runtime.
+//
+// Scalers are told how far the image is zoomed into the frame (see
+// FrameRegion): a region that is a quarter of the frame's width has a zoom of
+// 4. They scale it by that much more, up to its own resolution, so that the
+// region is sent with as many pixels as the whole frame would have been.
+struct NoScaler {
+	static constexpr bool IsIdentity() { return true; }
+
+	void Scale(cv::Mat* image, const double zoom) const {}
+};
+
+// Downsamples the image by the given scale, which must be below 1.
+class ResizeScaler {
+public:
+	explicit ResizeScaler(const float scale) : scale_(scale) {}
+
+	static constexpr bool IsIdentity() { return false; }
+
+	void Scale(cv::Mat* image, const double zoom) const {
+		const double scale = scale_ * zoom;
+		if (scale < 1.0) {
+			TRACE_SCOPE("resize");
+			cv::resize(*image, *image, cv::Size(0, 0), scale, scale);
+		}
+	}
+
+private:
+	const float scale_;
+};
+
+// Downsamples the image by the given scale, unless it is 1 or more.
+class DynamicScaler {
+public:
+	explicit DynamicScaler(const float scale) : scale_(scale) {}
+
+	bool IsIdentity() const { return scale_ >= 1.0; }
+
+	void Scale(cv::Mat* image, const double zoom) const {
+		const double scale = scale_ * zoom;
+		if (scale < 1.0) {
+			TRACE_SCOPE("resize");
+			cv::resize(*image, *image, cv::Size(0, 0), scale, scale);
+		}
+	}
+
+private:
+	const float scale_;
+};
+
+struct NoOverlay {
+	static constexpr bool IsIdentity() { return true; }
+
+	void Draw(cv::Mat* image) const {}
+};
+
+// Draws the local time into the image.
+struct TimestampOverlay {
+	static constexpr bool IsIdentity() { return false; }
+
+	void Draw(cv::Mat* image) const {
+		//These codes is to offset the time difference betwenn two PCs.(Because it is hard to solve it in a correct way.)
+		SYSTEMTIME sys;	GetLocalTime(&sys);
+		FILETIME ft;
+		int offset_sec = -2;
+		int offset_ms = 10;
+		SystemTimeToFileTime(&sys, &ft);
+		*(__int64 *)(&ft) = *(__int64 *)(&ft) + ((__int64)offset_sec * 1000i64 + (__int64)offset_ms) * 10000i64;
+		FileTimeToSystemTime(&ft, &sys);
+		std::string hour = std::to_string(sys.wHour);
+		std::string min = std::to_string(sys.wMinute);
+		std::string sec = std::to_string(sys.wSecond);
+		std::string ms = std::to_string(sys.wMilliseconds);
+		std::string text = hour + ":" + min + ":" + sec + "." + ms;
+		cv::putText(*image, text, cv::Point2f(16, 100), cv::FONT_HERSHEY_COMPLEX_SMALL, 1.6, cv::Scalar(0, 255, 0), 2);
+	}
+};
+
+// Draws the local time into the image if draw_timestamp is set.
+class DynamicOverlay {
+public:
+	explicit DynamicOverlay(const bool draw_timestamp)
+		: draw_timestamp_(draw_timestamp) {}
+
+	bool IsIdentity() const { return !draw_timestamp_; }
+
+	void Draw(cv::Mat* image) const {
+		if (draw_timestamp_) {
+			TimestampOverlay().Draw(image);
+		}
+	}
+
+private:
+	const bool draw_timestamp_;
+};
+
+class VideoCapture {
+public:
+	// Initializes the OpenCV VideoCapture object by selecting the default
+	// camera. If no camera is provided it will not be possile to read any video
+	// frames.
+	//
+	// Specify whether or not the video being sent is displayed in a window, and
+	// the scale = (0, 1] which will affect the size of the data.
+	//The third parameter is used to define which webcamera to be captured.
+	//If the camera in the laptop is chosen, camera = 0
+	//If the additional camera webcamera is chosen, camera = 1
+	//
+	// Unless draw_timestamp is set, nothing is drawn into the frames. If the
+	// frames are not scaled either, the camera is asked for MJPEG, and the
+	// JPEGs it delivers are sent on without being decoded and encoded again.
+	VideoCapture(
+		const bool show_video,
+		const float scale,
+		int camera,
+		const bool draw_timestamp = true);
+
+	// Same as above, but instead of a camera, replays the JPEGs of a raw MJPEG
+	// file (JPEG images back to back) in a loop, at kReplayFramesPerSecond.
+	VideoCapture(
+		const bool show_video,
+		const float scale,
+		const std::string& mjpeg_file_name,
+		const bool draw_timestamp = true);
+
+	// Captures and returns a frame from the available video camera.
+	//
+	// If the show_video option was set to true, the frame will be displayed.
+	//
+	// NOTE: This method cannot be const, since the cv::VideoCapture object is
+	// modified through a non-const method when getting a new frame from the
+	// camera.
+	VideoFrame GetFrameFromCamera();
+
+	// The two halves of GetFrameFromCamera(). ReadFrame() captures the frame,
+	// and PrepareFrame() resizes and draws into it. PrepareFrame() can run on
+	// any thread, and on several frames at once.
+	RawFrame ReadFrame();
+	VideoFrame PrepareFrame(RawFrame raw_frame) const;
+
+	// Same as above, but resizes and draws with the given stages of a Pipeline
+	// instead of the scale and draw_timestamp the capture was created with.
+	// The frame is cut down to the given region before it is resized, and the
+	// region is resized as if it were the whole frame. Frames that the source
+	// delivers as JPEGs are cut in the compressed domain (see CropJPEG()).
+	template <typename Scaler, typename Overlay>
+	VideoFrame PrepareFrame(
+		RawFrame raw_frame,
+		const Scaler& scaler,
+		const Overlay& overlay,
+		const FrameRegion& region = FrameRegion()) const;
+
+private:
+	// The OpenCV camera capture object. This is used to interface with a
+	// connected camera and extract frames from it.
+	cv::VideoCapture capture_;
+
+	// The image scale should be between (0 and 1]. The image will be
+	// downsampled by the given amount to reduce cost of sending the data.
+	const float scale_;
+
+	// Set to true to show the video.
+	const bool show_video_;
+
+	// Set to true to draw the time into each frame.
+	const bool draw_timestamp_;
+
+	// Returns the next JPEG of the replayed file, once it is due.
+	std::vector<unsigned char> GetReplayFrame();
+
+	// The contents of the replayed file, and the offset and size of each JPEG
+	// in it. Empty unless a file is being replayed.
+	std::vector<unsigned char> replay_data_;
+	std::vector<std::pair<size_t, size_t>> replay_frames_;
+	size_t next_replay_frame_;
+	std::chrono::steady_clock::time_point next_replay_time_;
+};
+
+// Replayed files are played back at this rate.
+constexpr double kReplayFramesPerSecond = 30;
+
+VideoCapture::VideoCapture(
+	const bool show_video,
+	const float scale,
+	int camera,
+	const bool draw_timestamp)
+	: show_video_(show_video), scale_(scale), capture_(cv::VideoCapture(camera)),
+	  draw_timestamp_(draw_timestamp), next_replay_frame_(0) {
+
+	// TODO: Verify that the scale is in the appropriate range.
+	if (scale_ >= 1.0 && !draw_timestamp_) {
+		// Not every camera and capture backend can deliver the JPEGs
+		// undecoded. Frames that still come decoded are simply encoded again.
+		capture_.set(cv::CAP_PROP_FOURCC, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'));
+		capture_.set(cv::CAP_PROP_CONVERT_RGB, 0);
+	}
+}
+
+// Returns the size of the JPEG at the start of data, up to and including its
+// EOI marker, or 0 if it does not end within size bytes.
+size_t FindJpegEnd(const unsigned char* data, const size_t size) {
+	const size_t scan_start = FindJpegScanStart(data, size);
+	if (scan_start == 0) {
+		return 0;
+	}
+	for (size_t i = scan_start; i + 1 < size; ++i) {
+		if (data[i] == 0xFF && data[i + 1] == kJpegMarkerEOI) {
+			return i + 2;
+		}
+	}
+	return 0;
+}
+
+VideoCapture::VideoCapture(
+	const bool show_video,
+	const float scale,
+	const std::string& mjpeg_file_name,
+	const bool draw_timestamp)
+	: show_video_(show_video), scale_(scale), draw_timestamp_(draw_timestamp),
+	  next_replay_frame_(0), next_replay_time_(std::chrono::steady_clock::now()) {
+
+	std::ifstream file(mjpeg_file_name.c_str(), std::ios::binary);
+	replay_data_.assign(
+		std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	// Inside the scan, a 0xFF byte is always followed by 0x00 or a restart
+	// marker, so the first EOI after the scan starts ends the JPEG.
+	size_t offset = 0;
+	while (offset + 1 < replay_data_.size()) {
+		if (replay_data_[offset] != 0xFF ||
+			replay_data_[offset + 1] != kJpegMarkerSOI) {
+			++offset;
+			continue;
+		}
+		const size_t size = FindJpegEnd(
+			replay_data_.data() + offset, replay_data_.size() - offset);
+		if (size == 0) {
+			break;
+		}
+		replay_frames_.push_back(std::make_pair(offset, size));
+		offset += size;
+	}
+	if (replay_frames_.empty()) {
+		std::cerr << "No JPEG frames found in " << mjpeg_file_name << "." << std::endl;
+	}
+}
+
+std::vector<unsigned char> VideoCapture::GetReplayFrame() {
+	std::this_thread::sleep_until(next_replay_time_);
+	next_replay_time_ = std::max(
+		next_replay_time_ + std::chrono::microseconds(
+			static_cast<long long>(1e6 / kReplayFramesPerSecond)),
+		std::chrono::steady_clock::now());
+	const std::pair<size_t, size_t>& frame = replay_frames_[next_replay_frame_];
+	next_replay_frame_ = (next_replay_frame_ + 1) % replay_frames_.size();
+	return std::vector<unsigned char>(
+		replay_data_.begin() + frame.first,
+		replay_data_.begin() + frame.first + frame.second);
+}
+
+
+
+// The name of the window in which all frames will be displayed. If a new frame
+// is displayed, it will replace the previous frame displayed in that window.
+static const std::string kWindowName = "Streaming Video";
+
+// Delays thread execution for this amount of time after a frame is displayed.
+// This prevents the window from being refreshed too often, which can cause
+// display issues.
+constexpr int kDisplayDelayTimeMS = 15;
+
+// JPEG compression values.
+static const std::string kJPEGExtension = ".jpg";
+constexpr int kJPEGQuality = 60;
+
+// The rate controller never goes below this quality, however small the byte
+// budget. Below it, the blocking artifacts make the video useless anyway.
+constexpr int kMinJPEGQuality = 20;
+
+// Every kPreviewFrameInterval-th frame is also sent as a preview, halved until
+// it is at most kPreviewMaxWidth pixels wide and encoded at
+// kPreviewJPEGQuality. Receivers that show many streams at once subscribe to
+// the previews only (see kPacketTypeSubscription), and then the other frames
+// are neither encoded nor sent.
+constexpr unsigned int kPreviewFrameInterval = 15;
+constexpr int kPreviewMaxWidth = 160;
+constexpr int kPreviewJPEGQuality = 30;
+
+// The frame rate that a stream's bitrate budget is divided over.
+constexpr double kTargetFramesPerSecond = 30;
+
+// A frame never takes more than this many packets, whatever the bandwidth.
+constexpr size_t kMaxPacketsPerFrame = 24;
+
+// The fraction of the estimated bandwidth that frames may use. The rest is
+// left for packet headers, probes and estimation error.
+constexpr double kBandwidthUtilization = 0.9;
+
+// Frames sent over UDP leave out their JPEG tables, which are sent in separate
+// packets instead. The shared-memory ring has no bandwidth to save, so frames
+// always stay complete there.
+constexpr bool kUseAbbreviatedJPEG = true;
+
+// The tables in use are sent again at least this often, in case their packet
+// was lost.
+constexpr long long kTableResendIntervalUs = 500000;
+
+// Set to true to requantize the JPEGs that the source delivers when they do
+// not fit their budget, rather than decoding and encoding them again (see
+// RequantizeJPEG()). JPEGs that cannot be requantized are still encoded again.
+constexpr bool kUseRequantization = true;
+
+// Picks a JPEG quality per frame so that frames fit a byte budget. The size
+// of a JPEG grows roughly exponentially with its quality, so the controller
+// predicts the quality for the next frame from the size that the previous
+// frame had at its quality, assuming a similar scene. The slope of the model
+// is learned whenever a frame has to be encoded twice. Several frames of a
+// stream can be encoded at once, so all state is guarded by a mutex.
+class JpegRateController {
+public:
+	// Returns the quality to encode the next frame with.
+	int PredictQuality(const size_t max_bytes) const;
+
+	// Returns the quality that makes a frame that was size bytes at the given
+	// quality fit into max_bytes.
+	int QualityFor(
+		const int quality, const size_t size, const size_t max_bytes) const;
+
+	// Learns from the frame that was just sent.
+	void OnEncoded(const int quality, const size_t size);
+
+	// Learns the model's slope from two encodes of the same frame.
+	void OnReencoded(
+		const int first_quality,
+		const size_t first_size,
+		const int second_quality,
+		const size_t second_size);
+
+private:
+	// QualityFor(), with the mutex held.
+	int QualityForLocked(
+		const int quality, const size_t size, const size_t max_bytes) const;
+
+	mutable std::mutex mutex_;
+
+	// The growth of ln(size) per quality step. Around the default quality, a
+	// step of 20 makes frames about 1.5 times as large.
+	double log_size_per_quality_ = 0.02;
+
+	int last_quality_ = kJPEGQuality;
+	size_t last_size_ = 0;
+};  // JpegRateController
+
+int JpegRateController::PredictQuality(const size_t max_bytes) const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (last_size_ == 0) {
+		return kJPEGQuality;
+	}
+	return QualityForLocked(last_quality_, last_size_, max_bytes);
+}
+
+int JpegRateController::QualityFor(
+	const int quality, const size_t size, const size_t max_bytes) const {
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	return QualityForLocked(quality, size, max_bytes);
+}
+
+int JpegRateController::QualityForLocked(
+	const int quality, const size_t size, const size_t max_bytes) const {
+
+	// Aim a little below the budget, since the prediction is never exact.
+	const double target = 0.9 * max_bytes;
+	const int predicted = quality + static_cast<int>(std::floor(
+		std::log(target / std::max<size_t>(size, 1)) / log_size_per_quality_));
+	return std::min(std::max(predicted, kMinJPEGQuality), kJPEGQuality);
+}
+
+void JpegRateController::OnEncoded(const int quality, const size_t size) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	last_quality_ = quality;
+	last_size_ = size;
+}
+
+void JpegRateController::OnReencoded(
+	const int first_quality,
+	const size_t first_size,
+	const int second_quality,
+	const size_t second_size) {
+
+	if (first_quality == second_quality || first_size == 0 || second_size == 0) {
+		return;
+	}
+	const double measured =
+		std::log(static_cast<double>(first_size) / second_size) /
+		(first_quality - second_quality);
+	std::lock_guard<std::mutex> lock(mutex_);
+	// Average with the old slope so that one odd frame does not throw the
+	// model off.
+	log_size_per_quality_ = std::min(std::max(
+		(log_size_per_quality_ + measured) / 2, 0.005), 0.1);
+}
+
+
+// More JPEG marker codes, for the segments that can be stripped.
+constexpr unsigned char kJpegMarkerDQT = 0xDB;
+constexpr unsigned char kJpegMarkerDHT = 0xC4;
+constexpr unsigned char kJpegMarkerAPP0 = 0xE0;
+constexpr unsigned char kJpegMarkerAPP15 = 0xEF;
+constexpr unsigned char kJpegMarkerCOM = 0xFE;
+
+// Splits a JPEG into its DQT and DHT segments and the abbreviated JPEG that
+// remains without them. APPn and COM segments are dropped, as the decoder does
+// not need them. Returns false if the JPEG could not be parsed up to its scan.
+bool SplitJpegTables(
+	const std::vector<unsigned char>& jpeg,
+	std::vector<unsigned char>* tables,
+	std::vector<unsigned char>* abbreviated) {
+
+	if (jpeg.size() < 4 || jpeg[0] != 0xFF || jpeg[1] != kJpegMarkerSOI) {
+		return false;
+	}
+	tables->clear();
+	abbreviated->assign(jpeg.begin(), jpeg.begin() + 2);
+	size_t position = 2;
+	while (position + 4 <= jpeg.size()) {
+		if (jpeg[position] != 0xFF) {
+			return false;
+		}
+		const unsigned char marker = jpeg[position + 1];
+		if (marker == 0xFF) {
+			// A fill byte in front of the marker.
+			++position;
+			continue;
+		}
+		const size_t end = position + 2 + ReadUint16(jpeg.data() + position + 2);
+		if (end > jpeg.size()) {
+			return false;
+		}
+		if (marker == kJpegMarkerDQT || marker == kJpegMarkerDHT) {
+			tables->insert(tables->end(), jpeg.begin() + position, jpeg.begin() + end);
+		} else if (marker == kJpegMarkerCOM ||
+			(marker >= kJpegMarkerAPP0 && marker <= kJpegMarkerAPP15)) {
+			// Dropped.
+		} else if (marker == kJpegMarkerSOS) {
+			// The entropy-coded data and EOI follow the scan header.
+			abbreviated->insert(abbreviated->end(), jpeg.begin() + position, jpeg.end());
+			return !tables->empty();
+		} else {
+			abbreviated->insert(
+				abbreviated->end(), jpeg.begin() + position, jpeg.begin() + end);
+		}
+		position = end;
+	}
+	return false;
+}
+
+// Strips the tables out of the JPEGs of one stream, and decides when the
+// receiver has to be sent them. Each distinct set of tables gets its own id,
+// so the receiver can keep the tables of every quality the rate controller
+// switches between.
+class JpegTableStripper {
+public:
+	JpegTableStripper() : next_table_id_(kNoTableId + 1), ids_wrapped_(false) {}
+
+	// Returns the JPEG with its tables stripped if possible, and sets table_id
+	// to the id of the stripped tables (kNoTableId if nothing was stripped, or
+	// if the tables took over an id that the receiver may still hold older
+	// tables for).
+	// If the receiver needs the tables now, the payload of a kPacketTypeTables
+	// packet is put into table_payload; otherwise it is cleared.
+	std::vector<unsigned char> StripTables(
+		const std::vector<unsigned char>& jpeg,
+		const long long now_us,
+		unsigned char* table_id,
+		std::vector<unsigned char>* table_payload);
+
+private:
+	// Frames whose table id was used before for other tables are sent
+	// complete until their tables went out this often, so that the receiver
+	// does not decode them with the old tables if a table packet is lost.
+	static const int kReusedTableSends = 2;
+
+	struct Tables {
+		unsigned char table_id;
+		long long last_sent_us;
+		// How often the tables were sent, while they are counted (see
+		// kReusedTableSends), or -1.
+		int sends;
+	};
+
+	// All tables seen so far, keyed by their segments.
+	std::map<std::vector<unsigned char>, Tables> tables_;
+	unsigned char next_table_id_;
+	// Set once the ids ran out, after which every id is a reused one.
+	bool ids_wrapped_;
+};  // JpegTableStripper
+
+std::vector<unsigned char> JpegTableStripper::StripTables(
+	const std::vector<unsigned char>& jpeg,
+	const long long now_us,
+	unsigned char* table_id,
+	std::vector<unsigned char>* table_payload) {
+
+	table_payload->clear();
+	std::vector<unsigned char> tables;
+	std::vector<unsigned char> abbreviated;
+	if (!SplitJpegTables(jpeg, &tables, &abbreviated)) {
+		*table_id = kNoTableId;
+		return jpeg;
+	}
+	auto found = tables_.find(tables);
+	if (found == tables_.end()) {
+		// The rate controller picks a quality per frame, and JPEGs from the
+		// source bring tables of their own, so the ids do run out. Start over
+		// then; the receiver replaces the tables of a reused id when their
+		// packet arrives.
+		if (next_table_id_ == kNoTableId) {
+			tables_.clear();
+			next_table_id_ = kNoTableId + 1;
+			ids_wrapped_ = true;
+		}
+		found = tables_.insert(std::make_pair(
+			tables, Tables{ next_table_id_++, 0, ids_wrapped_ ? 0 : -1 })).first;
+		found->second.last_sent_us = now_us - kTableResendIntervalUs;
+	}
+	Tables& found_tables = found->second;
+	if (now_us - found_tables.last_sent_us >= kTableResendIntervalUs) {
+		found_tables.last_sent_us = now_us;
+		table_payload->push_back(found_tables.table_id);
+		table_payload->insert(table_payload->end(), tables.begin(), tables.end());
+		if (found_tables.sends >= 0 && ++found_tables.sends >= kReusedTableSends) {
+			found_tables.sends = -1;
+		}
+	}
+	if (found_tables.sends >= 0) {
+		*table_id = kNoTableId;
+		return jpeg;
+	}
+	*table_id = found_tables.table_id;
+	return abbreviated;
+}
 
-	// Unpacks a received data buffer into the appropriate variables, in
-	// accordance to the specific protocol being implemented.
-	virtual void UnpackData(
-		const std::vector<unsigned char>& raw_bytes) = 0;
+// The frame header and restart interval markers, which the requantizer has to
+// understand beyond the segments above.
+constexpr unsigned char kJpegMarkerSOF0 = 0xC0;
+constexpr unsigned char kJpegMarkerSOF15 = 0xCF;
+constexpr unsigned char kJpegMarkerDRI = 0xDD;
+
+// The position in natural (row-major) order of each coefficient of a block in
+// the zigzag order that JPEG stores blocks and quantization tables in.
+static const unsigned char kJpegNaturalOrder[64] = {
+	0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
 };
 
-class SenderSocket {
-public:
-	SenderSocket(const std::string &receiver_ip, const int receiver_port);
+// The example quantization tables of the JPEG standard (K.1 and K.2), in
+// natural order, which encoders scale by the quality.
+static const unsigned char kLuminanceQuantization[64] = {
+	16, 11, 10, 16, 24, 40, 51, 61,
+	12, 12, 14, 19, 26, 58, 60, 55,
+	14, 13, 16, 24, 40, 57, 69, 56,
+	14, 17, 22, 29, 51, 87, 80, 62,
+	18, 22, 37, 56, 68, 109, 103, 77,
+	24, 35, 55, 64, 81, 104, 113, 92,
+	49, 64, 78, 87, 103, 121, 120, 101,
+	72, 92, 95, 98, 112, 100, 103, 99,
+};
+static const unsigned char kChrominanceQuantization[64] = {
+	17, 18, 24, 47, 99, 99, 99, 99,
+	18, 21, 26, 66, 99, 99, 99, 99,
+	24, 26, 56, 99, 99, 99, 99, 99,
+	47, 66, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+};
 
-	// TODO: add destructor to clear the socket
-	// close(fd);
+// The example Huffman tables of the JPEG standard (K.3), as the number of
+// codes of each length from 1 to 16 followed by the symbols. They hold a code
+// for every symbol of a baseline scan, whatever the coefficients.
+static const unsigned char kLuminanceDCHuffman[16 + 12] = {
+	0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+};
+static const unsigned char kChrominanceDCHuffman[16 + 12] = {
+	0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+};
+static const unsigned char kLuminanceACHuffman[16 + 162] = {
+	0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d,
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+	0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+	0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
+	0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+	0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+	0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+	0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+	0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+	0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+	0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+	0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa,
+};
+static const unsigned char kChrominanceACHuffman[16 + 162] = {
+	0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77,
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+	0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+	0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+	0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
+	0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
+	0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+	0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+	0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+	0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+	0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+	0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+	0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+	0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa,
+};
 
-	void SendPacket(const std::vector<unsigned char> &data) const;
+// Reads the entropy-coded data of a JPEG scan, removing the stuffed zero
+// bytes. The bits are buffered ahead, so that Huffman codes can be looked up
+// several bits at a time. At a marker, zero bits are returned, as a decoder
+// would, and the reader only moves past the marker when told to.
+class JpegBitReader {
+public:
+	JpegBitReader(const unsigned char* data, const size_t size)
+		: data_(data), size_(size), position_(0), bits_(0), num_bits_(0) {}
 
-private:
-	// The socket identifier (handle).
-	int socket_handle_;
+	// Returns the next num_bits bits, at most 16, without consuming them.
+	unsigned int PeekBits(const int num_bits) {
+		if (num_bits_ < num_bits) {
+			Fill();
+		}
+		return static_cast<unsigned int>(bits_ >> (num_bits_ - num_bits)) &
+			((1u << num_bits) - 1);
+	}
 
-	// The struct that contains the receiver's address and port. This is set up
-	// in the constructor.
-	sockaddr_in receiver_addr_;
-};  // SenderSocket
+	void SkipBits(const int num_bits) {
+		num_bits_ -= num_bits;
+	}
 
-SenderSocket::SenderSocket(
-	const std::string &receiver_ip, const int receiver_port) {
+	// Reads a coefficient of the given size category and returns its value.
+	int ReadValue(const int size) {
+		if (size == 0) {
+			return 0;
+		}
+		const int value = static_cast<int>(PeekBits(size));
+		SkipBits(size);
+		// Values below half the range are negative (F.12 of the standard).
+		return value < (1 << (size - 1)) ? value - (1 << size) + 1 : value;
+	}
 
-	socket_handle_ = socket(AF_INET, SOCK_DGRAM, 0);
-	receiver_addr_.sin_family = AF_INET;
-	receiver_addr_.sin_port = htons(receiver_port);
-	receiver_addr_.sin_addr.s_addr = inet_addr(receiver_ip.c_str());
-}
+	// Drops the bits left in the current byte and moves past the restart
+	// marker that must follow. Returns false if there is none.
+	bool SkipRestartMarker() {
+		// Buffering never goes past a marker, so only padding and the zero bits
+		// returned at the marker are dropped.
+		num_bits_ = 0;
+		if (position_ + 2 > size_ || data_[position_] != 0xFF ||
+			!IsStripeEndMarker(data_[position_ + 1]) ||
+			data_[position_ + 1] == kJpegMarkerEOI) {
+			return false;
+		}
+		position_ += 2;
+		return true;
+	}
 
-void SenderSocket::SendPacket(
-	const std::vector<unsigned char> &data) const {
+	// Moves past the next restart marker without decoding the data up to it.
+	// Returns false if there is none.
+	bool SkipToRestartMarker() {
+		while (position_ + 1 < size_) {
+			const void* found = memchr(data_ + position_, 0xFF, size_ - position_ - 1);
+			if (found == nullptr) {
+				break;
+			}
+			position_ = static_cast<const unsigned char*>(found) - data_;
+			// Skip stuffed zero bytes and fill bytes.
+			if (data_[position_ + 1] != 0x00 && data_[position_ + 1] != 0xFF) {
+				return SkipRestartMarker();
+			}
+			++position_;
+		}
+		return false;
+	}
 
-	sendto(
-		socket_handle_,
-		(const char *)data.data(),
-		data.size(),
-		0,
-		const_cast<sockaddr*>(reinterpret_cast<const sockaddr*>(&receiver_addr_)),
-		sizeof(receiver_addr_));
-}
+private:
+	// Buffers bytes until more than 56 bits are buffered.
+	void Fill() {
+		while (num_bits_ <= 56) {
+			unsigned char byte = 0;
+			if (position_ < size_ && data_[position_] != 0xFF) {
+				byte = data_[position_++];
+			} else if (position_ + 1 < size_ && data_[position_ + 1] == 0x00) {
+				byte = 0xFF;
+				position_ += 2;
+			}
+			bits_ = (bits_ << 8) | byte;
+			num_bits_ += 8;
+		}
+	}
 
+	const unsigned char* const data_;
+	const size_t size_;
+	size_t position_;
+	unsigned long long bits_;
+	int num_bits_;
+};  // JpegBitReader
 
-class ReceiverSocket {
+// A Huffman table of a JPEG, in the forms that decoding and encoding need.
+class JpegHuffmanTable {
 public:
-	// Creates a new socket and stores the handle.
-	explicit ReceiverSocket(const int port_number);
+	// Builds the table from the contents of a DHT segment: 16 code counts and
+	// the symbols. Returns false if the table is malformed.
+	bool Build(const unsigned char* counts, const unsigned char* symbols);
 
-	// Attempts to bind the socket on the port number provided to listen to
-	// incoming UDP packets. If the socket could not be created (in the
-	// constructor) or if the binding process fails, an error message will be
-	// printed to stderr. The method returns true on success, false otherwise.
-	const bool BindSocketToListen() const;
+	// Returns the symbol of the next code, or -1 if there is none.
+	int Decode(JpegBitReader* reader) const;
 
-	// Waits for the next packet on the given port, and returns vector of bytes
-	// (stored as unsigned chars) that contains the raw packet data.
-	const std::vector<unsigned char> GetPacket() const;
+	// Returns the code of a symbol and its length, which is 0 if the table has
+	// no code for it.
+	unsigned short Code(const unsigned char symbol) const {
+		return codes_[symbol];
+	}
+	unsigned char CodeLength(const unsigned char symbol) const {
+		return code_lengths_[symbol];
+	}
 
 private:
-	// This buffer will be used to collect incoming packet data. It is only used
-	// in the GetPacket() method.
-	char buffer_[kMaxPacketBufferSize];
+	// Codes of up to this many bits are decoded with a single lookup.
+	static const int kLookupBits = 9;
 
-	// The port number that the socket will listen for packets on.
-	const int port_;
+	// For each kLookupBits bits that the data can continue with, the length
+	// of the code they start with times 256 plus its symbol, or 0 if the code
+	// is longer.
+	unsigned short lookup_[1 << kLookupBits];
 
-	// The socket identifier (handle).
-	int socket_handle_;
-};  // ReceiverSocket
+	// For each code length, the largest code of that length (-1 for none),
+	// the first code, and the index of the first code's symbol.
+	int max_code_[17];
+	int min_code_[17];
+	int first_symbol_[17];
+	unsigned char symbols_[256];
 
-class VideoFrame {
-public:
-	// Default constructor (required) just makes an empty image.
-	VideoFrame() {}
+	unsigned short codes_[256];
+	unsigned char code_lengths_[256];
+};  // JpegHuffmanTable
 
-	// Initialize the video frame from an existing cv::Mat image.
-	explicit VideoFrame(const cv::Mat& image) : frame_image_(image) {}
+bool JpegHuffmanTable::Build(
+	const unsigned char* counts, const unsigned char* symbols) {
 
-	// Initialize the video frame (image) from a buffer of raw bytes.
-	explicit VideoFrame(const std::vector<unsigned char> frame_bytes);
+	memset(lookup_, 0, sizeof(lookup_));
+	memset(codes_, 0, sizeof(codes_));
+	memset(code_lengths_, 0, sizeof(code_lengths_));
+	// Codes are assigned in order of length, each one more than the last,
+	// and doubled at every step in length (C.2 of the standard).
+	int code = 0;
+	int num_symbols = 0;
+	for (int length = 1; length <= 16; ++length) {
+		first_symbol_[length] = num_symbols;
+		min_code_[length] = code;
+		for (int i = 0; i < counts[length - 1]; ++i) {
+			if (num_symbols == 256 || code >= (1 << length)) {
+				return false;
+			}
+			const unsigned char symbol = symbols[num_symbols];
+			symbols_[num_symbols++] = symbol;
+			codes_[symbol] = static_cast<unsigned short>(code);
+			code_lengths_[symbol] = static_cast<unsigned char>(length);
+			if (length <= kLookupBits) {
+				const int shift = kLookupBits - length;
+				for (int j = 0; j < (1 << shift); ++j) {
+					lookup_[(code << shift) | j] =
+						static_cast<unsigned short>((length << 8) | symbol);
+				}
+			}
+			++code;
+		}
+		max_code_[length] = counts[length - 1] == 0 ? -1 : code - 1;
+		code <<= 1;
+	}
+	return true;
+}
 
-	// Uses the underlying video/image/gui library to display the frame on the
-	// user's screen. Only one frame can be displayed at a time, as all frames
-	// will share the same GUI window.
-	void Display() const;
+int JpegHuffmanTable::Decode(JpegBitReader* reader) const {
+	const unsigned short entry = lookup_[reader->PeekBits(kLookupBits)];
+	if (entry != 0) {
+		reader->SkipBits(entry >> 8);
+		return entry & 0xFF;
+	}
+	const unsigned int bits = reader->PeekBits(16);
+	for (int length = kLookupBits + 1; length <= 16; ++length) {
+		const int code = static_cast<int>(bits >> (16 - length));
+		if (code <= max_code_[length]) {
+			reader->SkipBits(length);
+			return symbols_[first_symbol_[length] + code - min_code_[length]];
+		}
+	}
+	return -1;
+}
 
-	// Returns the raw byte representation of the given video frame. Singe image
-	// compression to JPEG is also handled here to minimize the frame size.
-	std::vector<unsigned char> GetJPEG() const;
+// Writes entropy-coded data, stuffing a zero byte after every 0xFF.
+class JpegBitWriter {
+public:
+	explicit JpegBitWriter(std::vector<unsigned char>* output)
+		: output_(output), bits_(0), num_bits_(0) {}
 
-private:
-	cv::Mat frame_image_;
-};
+	void Write(const unsigned int bits, const int num_bits) {
+		bits_ = (bits_ << num_bits) | (bits & ((1u << num_bits) - 1));
+		num_bits_ += num_bits;
+		while (num_bits_ >= 8) {
+			num_bits_ -= 8;
+			PutByte(static_cast<unsigned char>(bits_ >> num_bits_));
+		}
+	}
 
-class VideoCapture {
-public:
-	// Initializes the OpenCV VideoCapture object by selecting the default
-	// camera. If no camera is provided it will not be possile to read any video
-	// frames.
-	//
-	// Specify whether or not the video being sent is displayed in a window, and
-	// the scale = (0, 1] which will affect the size of the data.
-	//The third parameter is used to define which webcamera to be captured.
-	//If the camera in the laptop is chosen, camera = 0
-	//If the additional camera webcamera is chosen, camera = 1
-	VideoCapture(const bool show_video, const float scale, int camera);
+	// Writes a coefficient that takes the given number of bits.
+	void WriteValue(const int value, const int size) {
+		Write(static_cast<unsigned int>(value < 0 ? value - 1 : value), size);
+	}
 
-	// Captures and returns a frame from the available video camera.
-	//
-	// If the show_video option was set to true, the frame will be displayed.
-	//
-	// NOTE: This method cannot be const, since the cv::VideoCapture object is
-	// modified through a non-const method when getting a new frame from the
-	// camera.
-	VideoFrame GetFrameFromCamera();
+	// Pads the last byte with 1 bits.
+	void Flush() {
+		if (num_bits_ > 0) {
+			Write(0x7F, 8 - num_bits_);
+		}
+	}
 
 private:
-	// The OpenCV camera capture object. This is used to interface with a
-	// connected camera and extract frames from it.
-	cv::VideoCapture capture_;
+	void PutByte(const unsigned char byte) {
+		output_->push_back(byte);
+		if (byte == 0xFF) {
+			output_->push_back(0x00);
+		}
+	}
 
-	// The image scale should be between (0 and 1]. The image will be
-	// downsampled by the given amount to reduce cost of sending the data.
-	const float scale_;
+	std::vector<unsigned char>* const output_;
+	unsigned int bits_;
+	int num_bits_;
+};  // JpegBitWriter
 
-	// Set to true to show the video.
-	const bool show_video_;
-};
+// Returns the number of bits of the magnitude of value: its size category.
+int CoefficientSize(int value) {
+	if (value < 0) {
+		value = -value;
+	}
+	int size = 0;
+	while (value != 0) {
+		++size;
+		value >>= 1;
+	}
+	return size;
+}
 
-VideoCapture::VideoCapture(const bool show_video, const float scale, int camera)
-	: show_video_(show_video), scale_(scale), capture_(cv::VideoCapture(camera)) {
+// Decodes the Huffman-coded coefficients of a baseline JPEG and codes them
+// again with the standard Huffman tables, without going back to the pixels.
+// The inverse and forward DCT and the color conversion are skipped entirely,
+// which makes this several times faster than decoding and encoding the frame.
+// On the way:
+//  - the coefficients are divided down to the quantization tables of the
+//    given quality. No table gets finer than the JPEG's own, so that no size
+//    is spent on detail that is not there. With a quality of 0, the tables
+//    and the coefficients stay as they are, and nothing is lost.
+//  - only the MCUs that the region touches are kept. Restart intervals
+//    outside the region are skipped without being decoded.
+//
+// Like EncodeJPEG(), the result has a restart marker after every row of MCUs.
+// Returns false for JPEGs that are not baseline, or that could not be parsed.
+bool TranscodeJPEG(
+	const std::vector<unsigned char>& jpeg,
+	const int quality,
+	const FrameRegion& region,
+	std::vector<unsigned char>* transcoded) {
 
-	// TODO: Verify that the scale is in the appropriate range.
-}
+	struct Component {
+		unsigned char id;
+		int horizontal;
+		int vertical;
+		unsigned char quantization;
+		const JpegHuffmanTable* dc_table;
+		const JpegHuffmanTable* ac_table;
+		int dc_prediction;
+		int output_dc_prediction;
+	};
+	int quantization[4][64];
+	bool has_quantization[4] = {};
+	JpegHuffmanTable huffman_tables[2][4];
+	bool has_huffman[2][4] = {};
+	std::vector<Component> components;
+	std::vector<unsigned char> frame_header;
+	int width = 0;
+	int height = 0;
+	int restart_interval = 0;
+	if (jpeg.size() < 4 || jpeg[0] != 0xFF || jpeg[1] != kJpegMarkerSOI) {
+		return false;
+	}
+	// Read the segments up to the scan.
+	size_t position = 2;
+	size_t scan_start = 0;
+	while (scan_start == 0) {
+		if (position + 4 > jpeg.size() || jpeg[position] != 0xFF) {
+			return false;
+		}
+		const unsigned char marker = jpeg[position + 1];
+		if (marker == 0xFF) {
+			// A fill byte in front of the marker.
+			++position;
+			continue;
+		}
+		const unsigned char* segment = jpeg.data() + position + 4;
+		const size_t length = ReadUint16(jpeg.data() + position + 2);
+		const size_t end = position + 2 + length;
+		if (length < 2 || end > jpeg.size()) {
+			return false;
+		}
+		const unsigned char* const segment_end = jpeg.data() + end;
+		if (marker == kJpegMarkerDQT) {
+			while (segment < segment_end) {
+				const int precision = segment[0] >> 4;
+				const int table = segment[0] & 0x0F;
+				if (table >= 4 || segment + 1 + 64 * (precision + 1) > segment_end) {
+					return false;
+				}
+				for (int i = 0; i < 64; ++i) {
+					quantization[table][i] = precision == 0 ?
+						segment[1 + i] : ReadUint16(segment + 1 + 2 * i);
+				}
+				has_quantization[table] = true;
+				segment += 1 + 64 * (precision + 1);
+			}
+		} else if (marker == kJpegMarkerDHT) {
+			while (segment + 17 <= segment_end) {
+				const int table_class = segment[0] >> 4;
+				const int table = segment[0] & 0x0F;
+				int num_symbols = 0;
+				for (int i = 1; i <= 16; ++i) {
+					num_symbols += segment[i];
+				}
+				if (table_class > 1 || table >= 4 ||
+					segment + 17 + num_symbols > segment_end ||
+					!huffman_tables[table_class][table].Build(segment + 1, segment + 17)) {
+					return false;
+				}
+				has_huffman[table_class][table] = true;
+				segment += 17 + num_symbols;
+			}
+		} else if (marker == kJpegMarkerDRI) {
+			if (length < 4) {
+				return false;
+			}
+			restart_interval = ReadUint16(segment);
+		} else if (marker == kJpegMarkerSOF0 || marker == kJpegMarkerSOF0 + 1) {
+			// Baseline, or extended with Huffman coding and 8-bit samples.
+			if (length < 8 || segment[0] != 8) {
+				return false;
+			}
+			height = ReadUint16(segment + 1);
+			width = ReadUint16(segment + 3);
+			const int num_components = segment[5];
+			if (num_components < 1 || num_components > 4 ||
+				length != 8 + 3 * static_cast<size_t>(num_components) ||
+				width == 0 || height == 0) {
+				return false;
+			}
+			for (int i = 0; i < num_components; ++i) {
+				const unsigned char* info = segment + 6 + 3 * i;
+				Component component = {};
+				component.id = info[0];
+				component.horizontal = info[1] >> 4;
+				component.vertical = info[1] & 0x0F;
+				component.quantization = info[2];
+				if (component.horizontal < 1 || component.horizontal > 4 ||
+					component.vertical < 1 || component.vertical > 4 ||
+					component.quantization >= 4) {
+					return false;
+				}
+				components.push_back(component);
+			}
+			frame_header.assign(jpeg.begin() + position, jpeg.begin() + end);
+			frame_header[1] = kJpegMarkerSOF0;
+		} else if (marker >= kJpegMarkerSOF0 && marker <= kJpegMarkerSOF15 &&
+			marker != kJpegMarkerDHT && marker != 0xC8 && marker != 0xCC) {
+			// Progressive, lossless or arithmetic coding. DHT and the JPG and
+			// DAC markers share the range of frame header markers.
+			return false;
+		} else if (marker == kJpegMarkerEOI) {
+			return false;
+		} else if (marker == kJpegMarkerSOS) {
+			// Only a single scan with all components, as cameras write it.
+			if (components.empty() || length < 6 ||
+				segment[0] != components.size() ||
+				length != 6 + 2 * components.size()) {
+				return false;
+			}
+			for (size_t i = 0; i < components.size(); ++i) {
+				const unsigned char* info = segment + 1 + 2 * i;
+				Component& component = components[i];
+				const int dc = info[1] >> 4;
+				const int ac = info[1] & 0x0F;
+				if (info[0] != component.id || dc >= 4 || ac >= 4 ||
+					!has_huffman[0][dc] || !has_huffman[1][ac] ||
+					!has_quantization[component.quantization]) {
+					return false;
+				}
+				component.dc_table = &huffman_tables[0][dc];
+				component.ac_table = &huffman_tables[1][ac];
+			}
+			const unsigned char* selection = segment + 1 + 2 * components.size();
+			if (selection[0] != 0 || selection[1] != 63 || selection[2] != 0) {
+				return false;
+			}
+			scan_start = end;
+		}
+		position = end;
+	}
 
+	// The tables of the requested quality, scaled like libjpeg does, but never
+	// finer than the JPEG's own. Quality 0 keeps the JPEG's tables.
+	const int clamped_quality = std::min(std::max(quality, 1), 100);
+	const int scale = clamped_quality < 50 ?
+		5000 / clamped_quality : 200 - 2 * clamped_quality;
+	int output_quantization[4][64];
+	for (int table = 0; table < 4; ++table) {
+		if (!has_quantization[table]) {
+			continue;
+		}
+		// The first component is the luminance.
+		const unsigned char* standard =
+			table == components[0].quantization ?
+			kLuminanceQuantization : kChrominanceQuantization;
+		for (int i = 0; i < 64; ++i) {
+			const int scaled = std::min(std::max(
+				(standard[kJpegNaturalOrder[i]] * scale + 50) / 100, 1), 255);
+			if (quantization[table][i] == 0 || quantization[table][i] > 255) {
+				return false;
+			}
+			output_quantization[table][i] = quality == 0 ?
+				quantization[table][i] : std::max(scaled, quantization[table][i]);
+		}
+	}
+	JpegHuffmanTable output_tables[2][2];
+	output_tables[0][0].Build(kLuminanceDCHuffman, kLuminanceDCHuffman + 16);
+	output_tables[1][0].Build(kLuminanceACHuffman, kLuminanceACHuffman + 16);
+	output_tables[0][1].Build(kChrominanceDCHuffman, kChrominanceDCHuffman + 16);
+	output_tables[1][1].Build(kChrominanceACHuffman, kChrominanceACHuffman + 16);
 
+	// Write the headers: the new quantization tables, the frame header, the
+	// standard Huffman tables, one restart interval per row of MCUs, and the
+	// scan header.
+	int max_horizontal = 1;
+	int max_vertical = 1;
+	for (const Component& component : components) {
+		max_horizontal = std::max(max_horizontal, component.horizontal);
+		max_vertical = std::max(max_vertical, component.vertical);
+	}
+	// A scan of a single component is not interleaved: its MCUs are single
+	// blocks, as many as cover the component.
+	const bool interleaved = components.size() > 1;
+	const int mcu_columns = interleaved ?
+		(width + 8 * max_horizontal - 1) / (8 * max_horizontal) :
+		(width * components[0].horizontal / max_horizontal + 7) / 8;
+	const int mcu_rows = interleaved ?
+		(height + 8 * max_vertical - 1) / (8 * max_vertical) :
+		(height * components[0].vertical / max_vertical + 7) / 8;
+	// The region, widened to the MCUs that it touches.
+	const int mcu_width = interleaved ? 8 * max_horizontal : 8;
+	const int mcu_height = interleaved ? 8 * max_vertical : 8;
+	const cv::Rect pixels = RegionRect(region, width, height);
+	const int first_column = pixels.x / mcu_width;
+	const int first_row = pixels.y / mcu_height;
+	const int columns = std::min(
+		(pixels.x + pixels.width + mcu_width - 1) / mcu_width, mcu_columns) - first_column;
+	const int rows = std::min(
+		(pixels.y + pixels.height + mcu_height - 1) / mcu_height, mcu_rows) - first_row;
+	if (columns <= 0 || rows <= 0 || columns > 0xFFFF) {
+		return false;
+	}
+	const int output_width = std::min(columns * mcu_width, width - first_column * mcu_width);
+	const int output_height = std::min(rows * mcu_height, height - first_row * mcu_height);
+	WriteUint16(frame_header.data() + 5, static_cast<unsigned short>(output_height));
+	WriteUint16(frame_header.data() + 7, static_cast<unsigned short>(output_width));
+	std::vector<unsigned char>& output = *transcoded;
+	output.clear();
+	output.reserve(jpeg.size());
+	const unsigned char start[] = { 0xFF, kJpegMarkerSOI };
+	output.insert(output.end(), start, start + 2);
+	for (int table = 0; table < 4; ++table) {
+		if (!has_quantization[table]) {
+			continue;
+		}
+		const unsigned char header[] = {
+			0xFF, kJpegMarkerDQT, 0, 67, static_cast<unsigned char>(table) };
+		output.insert(output.end(), header, header + 5);
+		for (int i = 0; i < 64; ++i) {
+			output.push_back(static_cast<unsigned char>(output_quantization[table][i]));
+		}
+	}
+	output.insert(output.end(), frame_header.begin(), frame_header.end());
+	const unsigned char* const huffman_segments[4] = {
+		kLuminanceDCHuffman, kLuminanceACHuffman,
+		kChrominanceDCHuffman, kChrominanceACHuffman,
+	};
+	const size_t huffman_sizes[4] = {
+		sizeof(kLuminanceDCHuffman), sizeof(kLuminanceACHuffman),
+		sizeof(kChrominanceDCHuffman), sizeof(kChrominanceACHuffman),
+	};
+	for (int i = 0; i < (interleaved ? 4 : 2); ++i) {
+		const size_t length = 2 + 1 + huffman_sizes[i];
+		const unsigned char header[] = {
+			0xFF, kJpegMarkerDHT,
+			static_cast<unsigned char>(length >> 8), static_cast<unsigned char>(length),
+			static_cast<unsigned char>(((i % 2) << 4) | (i / 2)) };
+		output.insert(output.end(), header, header + 5);
+		output.insert(output.end(), huffman_segments[i], huffman_segments[i] + huffman_sizes[i]);
+	}
+	const unsigned char restart[] = {
+		0xFF, kJpegMarkerDRI, 0, 4,
+		static_cast<unsigned char>(columns >> 8), static_cast<unsigned char>(columns) };
+	output.insert(output.end(), restart, restart + 6);
+	const unsigned char scan_header[] = {
+		0xFF, kJpegMarkerSOS, 0, static_cast<unsigned char>(6 + 2 * components.size()),
+		static_cast<unsigned char>(components.size()) };
+	output.insert(output.end(), scan_header, scan_header + 5);
+	for (size_t i = 0; i < components.size(); ++i) {
+		output.push_back(components[i].id);
+		// The first component uses the luminance tables, the others the
+		// chrominance ones.
+		output.push_back(i == 0 ? 0x00 : 0x11);
+	}
+	const unsigned char selection[] = { 0, 63, 0 };
+	output.insert(output.end(), selection, selection + 3);
 
-// The name of the window in which all frames will be displayed. If a new frame
-// is displayed, it will replace the previous frame displayed in that window.
-static const std::string kWindowName = "Streaming Video";
+	// Requantizing divides each coefficient by the ratio of the new and the
+	// old quantization step, in 16-bit fixed point. No ratio is more than 1,
+	// so coefficients never grow.
+	int ratios[4][64];
+	for (int table = 0; table < 4; ++table) {
+		for (int i = 0; has_quantization[table] && i < 64; ++i) {
+			ratios[table][i] = (quantization[table][i] * 65536 +
+				output_quantization[table][i] / 2) / output_quantization[table][i];
+		}
+	}
 
-// Delays thread execution for this amount of time after a frame is displayed.
-// This prevents the window from being refreshed too often, which can cause
-// display issues.
-constexpr int kDisplayDelayTimeMS = 15;
+	// Decode, requantize and encode one block at a time. Only the nonzero
+	// coefficients of a block are kept, with their positions.
+	JpegBitReader reader(jpeg.data() + scan_start, jpeg.size() - scan_start);
+	JpegBitWriter writer(&output);
+	int positions[64];
+	int values[64];
+	const auto is_kept = [=](const int mcu) {
+		const int row = mcu / mcu_columns;
+		const int column = mcu % mcu_columns;
+		return row >= first_row && row < first_row + rows &&
+			column >= first_column && column < first_column + columns;
+	};
+	// Nothing after the last row of the region is needed.
+	const int num_mcus = (first_row + rows) * mcu_columns;
+	int num_kept = 0;
+	for (int mcu = 0; mcu < num_mcus; ++mcu) {
+		if (restart_interval > 0 && mcu % restart_interval == 0) {
+			if (mcu > 0 && !reader.SkipRestartMarker()) {
+				return false;
+			}
+			for (Component& component : components) {
+				component.dc_prediction = 0;
+			}
+			// Each restart interval starts over, so those without a kept MCU
+			// need not be decoded.
+			while (mcu < num_mcus) {
+				const int interval_end = std::min(mcu + restart_interval, num_mcus);
+				int kept = mcu;
+				while (kept < interval_end && !is_kept(kept)) {
+					++kept;
+				}
+				if (kept < interval_end) {
+					break;
+				}
+				if (interval_end < num_mcus && !reader.SkipToRestartMarker()) {
+					return false;
+				}
+				mcu = interval_end;
+			}
+			if (mcu == num_mcus) {
+				break;
+			}
+		}
+		const bool kept = is_kept(mcu);
+		if (kept && num_kept > 0 && num_kept % columns == 0) {
+			writer.Flush();
+			const unsigned char marker[] = {
+				0xFF, static_cast<unsigned char>(kJpegMarkerRST0 + (num_kept / columns - 1) % 8) };
+			output.insert(output.end(), marker, marker + 2);
+			for (Component& component : components) {
+				component.output_dc_prediction = 0;
+			}
+		}
+		for (size_t c = 0; c < components.size(); ++c) {
+			Component& component = components[c];
+			const int num_blocks =
+				interleaved ? component.horizontal * component.vertical : 1;
+			const int* ratio = ratios[component.quantization];
+			const JpegHuffmanTable& dc_table = output_tables[0][c == 0 ? 0 : 1];
+			const JpegHuffmanTable& ac_table = output_tables[1][c == 0 ? 0 : 1];
+			for (int block = 0; block < num_blocks; ++block) {
+				const int dc_size = component.dc_table->Decode(&reader);
+				if (dc_size < 0 || dc_size > 11) {
+					return false;
+				}
+				component.dc_prediction += reader.ReadValue(dc_size);
+				int num_values = 0;
+				for (int k = 1; k < 64; ++k) {
+					const int symbol = component.ac_table->Decode(&reader);
+					if (symbol < 0) {
+						return false;
+					}
+					const int run = symbol >> 4;
+					const int size = symbol & 0x0F;
+					if (size == 0) {
+						if (run != 15) {
+							break;
+						}
+						k += 15;
+						continue;
+					}
+					k += run;
+					if (k > 63 || size > 10) {
+						return false;
+					}
+					if (!kept) {
+						reader.SkipBits(size);
+						continue;
+					}
+					const int value = reader.ReadValue(size) * ratio[k];
+					const int requantized_value = value >= 0 ?
+						(value + 32768) >> 16 : -((-value + 32768) >> 16);
+					if (requantized_value != 0) {
+						positions[num_values] = k;
+						values[num_values++] = requantized_value;
+					}
+				}
+				if (!kept) {
+					continue;
+				}
+				const int dc = component.dc_prediction * ratio[0];
+				const int requantized_dc = dc >= 0 ?
+					(dc + 32768) >> 16 : -((-dc + 32768) >> 16);
+				const int difference = requantized_dc - component.output_dc_prediction;
+				component.output_dc_prediction = requantized_dc;
+				const int dc_output_size = CoefficientSize(difference);
+				writer.Write(dc_table.Code(dc_output_size), dc_table.CodeLength(dc_output_size));
+				writer.WriteValue(difference, dc_output_size);
+				int previous = 0;
+				for (int i = 0; i < num_values; ++i) {
+					int run = positions[i] - previous - 1;
+					while (run > 15) {
+						writer.Write(ac_table.Code(0xF0), ac_table.CodeLength(0xF0));
+						run -= 16;
+					}
+					const int size = CoefficientSize(values[i]);
+					const unsigned char symbol = static_cast<unsigned char>((run << 4) | size);
+					writer.Write(ac_table.Code(symbol), ac_table.CodeLength(symbol));
+					writer.WriteValue(values[i], size);
+					previous = positions[i];
+				}
+				if (previous < 63) {
+					writer.Write(ac_table.Code(0x00), ac_table.CodeLength(0x00));
+				}
+			}
+		}
+		if (kept) {
+			++num_kept;
+		}
+	}
+	if (num_kept != columns * rows) {
+		return false;
+	}
+	writer.Flush();
+	const unsigned char end[] = { 0xFF, kJpegMarkerEOI };
+	output.insert(output.end(), end, end + 2);
+	return true;
+}
 
-// JPEG compression values.
-static const std::string kJPEGExtension = ".jpg";
-constexpr int kJPEGQuality = 60;
+// Requantizes a baseline JPEG to the given quality (see TranscodeJPEG()).
+bool RequantizeJPEG(
+	const std::vector<unsigned char>& jpeg,
+	const int quality,
+	std::vector<unsigned char>* requantized) {
+
+	TRACE_SCOPE("requantize JPEG");
+	return TranscodeJPEG(jpeg, quality, FrameRegion(), requantized);
+}
+
+// Cuts the region out of a baseline JPEG losslessly, at the boundaries of its
+// MCUs (see TranscodeJPEG()). Nothing is decoded to pixels, and with a restart
+// marker after every row of MCUs, as EncodeJPEG() writes them, only the rows
+// of the region are Huffman-decoded.
+bool CropJPEG(
+	const std::vector<unsigned char>& jpeg,
+	const FrameRegion& region,
+	std::vector<unsigned char>* cropped) {
 
+	TRACE_SCOPE("crop JPEG");
+	return TranscodeJPEG(jpeg, 0, region, cropped);
+}
 
 VideoFrame::VideoFrame(const std::vector<unsigned char> frame_bytes) {
 	frame_image_ = cv::imdecode(frame_bytes, cv::IMREAD_COLOR);
@@ -191,53 +4167,217 @@ void VideoFrame::Display() const {
 	cv::waitKey(kDisplayDelayTimeMS);
 }
 
-std::vector<unsigned char> VideoFrame::GetJPEG() const {
+// Compresses the image to JPEG with the given quality.
+std::vector<unsigned char> EncodeJPEG(const cv::Mat& image, const int quality) {
+	TRACE_SCOPE("encode JPEG");
+	// Put a restart marker after every row of MCUs, so that the receiver can
+	// decode each row on its own. Color images are encoded with 2x2 chroma
+	// subsampling, which makes an MCU 16 pixels wide.
+	const int mcu_width = image.channels() == 1 ? 8 : 16;
 	const std::vector<int> compression_params = {
 		cv::IMWRITE_JPEG_QUALITY,
-		kJPEGQuality
+		quality,
+		cv::IMWRITE_JPEG_RST_INTERVAL,
+		(image.cols + mcu_width - 1) / mcu_width
 	};
 	std::vector<unsigned char> data_buffer;
-	cv::imencode(kJPEGExtension, frame_image_, data_buffer, compression_params);
+	cv::imencode(kJPEGExtension, image, data_buffer, compression_params);
+	return data_buffer;
+}
+
+cv::Mat VideoFrame::GetImage() const {
+	if (frame_image_.empty() && source_jpeg_) {
+		TRACE_SCOPE("decode source JPEG");
+		return cv::imdecode(*source_jpeg_, cv::IMREAD_COLOR);
+	}
+	return frame_image_;
+}
+
+std::vector<unsigned char> VideoFrame::GetJPEG() const {
+	if (source_jpeg_) {
+		return *source_jpeg_;
+	}
+	return GetJPEG(kJPEGQuality);
+}
+
+std::vector<unsigned char> VideoFrame::GetJPEG(const int quality) const {
+	return EncodeJPEG(GetImage(), quality);
+}
+
+std::vector<unsigned char> VideoFrame::GetJPEG(
+	const size_t max_bytes, JpegRateController* rate_controller) const {
+
+	if (source_jpeg_ && source_jpeg_->size() <= max_bytes) {
+		return *source_jpeg_;
+	}
+	// A source JPEG is requantized if it can be. Otherwise it is decoded, but
+	// only once, even if it has to be encoded twice.
+	cv::Mat image;
+	const auto compress = [this, &image](const int quality) {
+		std::vector<unsigned char> jpeg;
+		if (kUseRequantization && source_jpeg_ &&
+			RequantizeJPEG(*source_jpeg_, quality, &jpeg)) {
+			return jpeg;
+		}
+		if (image.empty()) {
+			image = GetImage();
+		}
+		return EncodeJPEG(image, quality);
+	};
+	const int quality = rate_controller->PredictQuality(max_bytes);
+	std::vector<unsigned char> data_buffer = compress(quality);
+	if (data_buffer.size() > max_bytes && quality > kMinJPEGQuality) {
+		// The scene got more complex than the previous frame suggested, so
+		// encode once more with the quality corrected by this frame's size.
+		const int retry_quality = std::min(
+			rate_controller->QualityFor(quality, data_buffer.size(), max_bytes),
+			quality - 1);
+		std::vector<unsigned char> retry_buffer = compress(retry_quality);
+		rate_controller->OnReencoded(
+			quality, data_buffer.size(), retry_quality, retry_buffer.size());
+		rate_controller->OnEncoded(retry_quality, retry_buffer.size());
+		return retry_buffer;
+	}
+	rate_controller->OnEncoded(quality, data_buffer.size());
 	return data_buffer;
 }
 
+std::vector<unsigned char> VideoFrame::GetPreviewJPEG() const {
+	TRACE_SCOPE("encode preview");
+	cv::Mat image = frame_image_;
+	if (image.empty() && source_jpeg_) {
+		image = cv::imdecode(*source_jpeg_, cv::IMREAD_REDUCED_COLOR_8);
+	}
+	if (image.empty()) {
+		return std::vector<unsigned char>();
+	}
+	// Each level of the pyramid halves the image, smoothing it on the way.
+	while (image.cols > kPreviewMaxWidth) {
+		cv::pyrDown(image, image);
+	}
+	return EncodeJPEG(image, kPreviewJPEGQuality);
+}
+
 VideoFrame VideoCapture::GetFrameFromCamera() {
-	if (!capture_.isOpened()) {
+	return PrepareFrame(ReadFrame());
+}
+
+RawFrame VideoCapture::ReadFrame() {
+	const bool replaying = !replay_frames_.empty();
+	if (!replaying && !capture_.isOpened()) {
 		std::cerr << "Could not get frame. Camera not available." << std::endl;
+		return RawFrame();
+	}
+	TRACE_SCOPE("get frame from camera");
+	RawFrame raw_frame;
+	FrameTrace& trace = raw_frame.trace;
+	trace.capture_start_us = static_cast<unsigned int>(NowMicroseconds());
+	cv::Mat& image = raw_frame.image;
+	std::vector<unsigned char>& jpeg = raw_frame.jpeg;
+	{
+		TRACE_SCOPE("read camera");
+		if (replaying) {
+			jpeg = GetReplayFrame();
+		} else {
+			// Capture into memory of the node that the thread runs on.
+			image.allocator = GetLocalFrameAllocator();
+			capture_ >> image;
+			// Undecoded frames come as a single row of bytes.
+			if (image.rows == 1 && image.type() == CV_8UC1 && image.total() > 2 &&
+				image.data[0] == 0xFF && image.data[1] == kJpegMarkerSOI) {
+				jpeg.assign(image.data, image.data + image.total());
+				image = cv::Mat();
+			}
+		}
+	}
+	trace.stage_end_us[kStageCapture] =
+		static_cast<unsigned int>(NowMicroseconds()) - trace.capture_start_us;
+	return raw_frame;
+}
+
+template <typename Scaler, typename Overlay>
+VideoFrame VideoCapture::PrepareFrame(
+	RawFrame raw_frame,
+	const Scaler& scaler,
+	const Overlay& overlay,
+	const FrameRegion& region) const {
+
+	if (raw_frame.image.empty() && raw_frame.jpeg.empty()) {
 		return VideoFrame();
 	}
-	cv::Mat image;
-	capture_ >> image;
-	// If the image is being downsampled, resize it first.
-	if (scale_ < 1.0) {
-		cv::resize(image, image, cv::Size(0, 0), scale_, scale_);
-	}
-
-	//These codes is to offset the time difference betwenn two PCs.(Because it is hard to solve it in a correct way.)
-	SYSTEMTIME sys;	GetLocalTime(&sys);
-	FILETIME ft;
-	int offset_sec = -2;
-	int offset_ms = 10;
-	SystemTimeToFileTime(&sys, &ft);
-	*(__int64 *)(&ft) = *(__int64 *)(&ft) + ((__int64)offset_sec * 1000i64 + (__int64)offset_ms) * 10000i64;
-	FileTimeToSystemTime(&ft, &sys);
-	std::string hour = std::to_string(sys.wHour);
-	std::string min = std::to_string(sys.wMinute);
-	std::string sec = std::to_string(sys.wSecond);
-	std::string ms = std::to_string(sys.wMilliseconds);
-	std::string text = hour + ":" + min + ":" + sec + "." + ms;
-	cv::putText(image, text, cv::Point2f(16, 100), cv::FONT_HERSHEY_COMPLEX_SMALL, 1.6, cv::Scalar(0, 255, 0), 2);
+	TRACE_SCOPE("prepare frame");
+	cv::Mat& image = raw_frame.image;
+	std::vector<unsigned char>& jpeg = raw_frame.jpeg;
+	FrameTrace& trace = raw_frame.trace;
+	bool cropped = region.IsWholeFrame();
+	if (!jpeg.empty() && !cropped) {
+		// The region is cut out of the JPEG losslessly, so that neither the
+		// rest of the frame is decoded nor the region encoded again.
+		std::vector<unsigned char> cropped_jpeg;
+		if (CropJPEG(jpeg, region, &cropped_jpeg)) {
+			jpeg.swap(cropped_jpeg);
+			cropped = true;
+		}
+	}
+	if (!jpeg.empty() && scaler.IsIdentity() && overlay.IsIdentity()) {
+		// Nothing has to change in the frame, so its JPEG is passed through.
+		// It is only decoded if it is to be shown.
+		trace.stage_end_us[kStageResize] = trace.stage_end_us[kStageCapture];
+		trace.stage_end_us[kStageOverlay] = trace.stage_end_us[kStageCapture];
+		if (show_video_) {
+			image = cv::imdecode(jpeg, cv::IMREAD_COLOR);
+		}
+		VideoFrame video_frame(image);
+		video_frame.SetSourceJPEG(std::move(jpeg));
+		video_frame.SetTrace(trace);
+		if (show_video_) {
+			video_frame.Display();
+		}
+		return video_frame;
+	}
+	if (!jpeg.empty()) {
+		TRACE_SCOPE("decode source JPEG");
+		image = cv::imdecode(jpeg, cv::IMREAD_COLOR);
+	}
+	if (!cropped && !image.empty()) {
+		// The region of a decoded frame is only a view into it, so that
+		// nothing but the region is resized.
+		image = image(RegionRect(region, image.cols, image.rows));
+	}
+	// If the image is being downsampled, resize it first. The region takes the
+	// place of the whole frame, up to its own resolution, which is how zooming
+	// in sharpens it at the same bitrate.
+	const double zoom = region.IsWholeFrame() ?
+		1.0 : 65536.0 / std::max(region.width, region.height);
+	scaler.Scale(&image, zoom);
+	trace.stage_end_us[kStageResize] =
+		static_cast<unsigned int>(NowMicroseconds()) - trace.capture_start_us;
+
+	overlay.Draw(&image);
+	trace.stage_end_us[kStageOverlay] =
+		static_cast<unsigned int>(NowMicroseconds()) - trace.capture_start_us;
 	VideoFrame video_frame(image);
+	video_frame.SetTrace(trace);
 	if (show_video_) {
 		video_frame.Display();
 	}
 	return video_frame;
 }
 
+VideoFrame VideoCapture::PrepareFrame(RawFrame raw_frame) const {
+	return PrepareFrame(
+		std::move(raw_frame), DynamicScaler(scale_), DynamicOverlay(draw_timestamp_));
+}
+
 class BasicProtocolData : public ProtocolData {
 public:
 	std::vector<unsigned char> PackageData() const;
 
+	// Same as above, but compresses the frame to at most max_bytes, using the
+	// given rate controller to pick the quality.
+	std::vector<unsigned char> PackageData(
+		const size_t max_bytes, JpegRateController* rate_controller) const;
+
 	void UnpackData(
 		const std::vector<unsigned char>& raw_bytes) override;
 
@@ -260,6 +4400,12 @@ std::vector<unsigned char> BasicProtocolData::PackageData() const {
 	return video_frame_.GetJPEG();
 }
 
+std::vector<unsigned char> BasicProtocolData::PackageData(
+	const size_t max_bytes, JpegRateController* rate_controller) const {
+
+	return video_frame_.GetJPEG(max_bytes, rate_controller);
+}
+
 void BasicProtocolData::UnpackData(
 	const std::vector<unsigned char>& raw_bytes) {
 
@@ -313,58 +4459,242 @@ const std::vector<unsigned char> ReceiverSocket::GetPacket() const {
 	return data;
 }
 
-void send1() {
-
-	WORD socketVersion = MAKEWORD(2, 2);
-	WSADATA wsaData;
-	if (WSAStartup(socketVersion, &wsaData) != 0)
-	{
-		exit(0);
-	}
+// Set to the path of a raw MJPEG file to stream it in a loop instead of the
+// cameras, e.g. for testing without a camera.
+static const std::string kReplayFileName = "";
 
-	const int port = 6000;
-	
-	//std::string ip_address = "127.0.0.1";  // Localhost
-	std::string ip_address = "192.168.43.168";
+// Returns how many bytes a frame's JPEG may take: its share of the estimated
+// bandwidth at the target frame rate, but never more than fits into
+// kMaxPacketsPerFrame packets. Pass 0 if no estimate is available yet.
+size_t FrameByteBudget(
+	const size_t max_payload_size, const double estimated_bits_per_second) {
 
-	const SenderSocket socket(ip_address, port);
-	std::cout << "Sending to " << ip_address
-		<< " on port " << port << "." << std::endl;
-	VideoCapture video_capture(false, 0.6, 0);
-	BasicProtocolData protocol_data;
-	while (true) {  // TODO: break out cleanly when done.
-		protocol_data.SetImage(video_capture.GetFrameFromCamera());
-		socket.SendPacket(protocol_data.PackageData());
+	// Fragments end at stripe boundaries, so they are not quite full; the cap
+	// is only approximate.
+	size_t budget = kMaxPacketsPerFrame * (max_payload_size - kFragmentInfoSize) -
+		kFrameTraceSize;
+	if (estimated_bits_per_second > 0) {
+		budget = std::min(budget, static_cast<size_t>(
+			estimated_bits_per_second * kBandwidthUtilization /
+			kTargetFramesPerSecond / 8));
 	}
+	return budget;
 }
 
-void send2() {
+// Encodes frames as JPEG, with the quality picked by a rate controller so
+// that each frame fits its byte budget. This is the codec stage of a
+// Pipeline; it is called from several workers at once.
+class JpegCodec {
+public:
+	std::vector<unsigned char> Encode(
+		const VideoFrame& frame, const size_t max_bytes) {
 
-	WORD socketVersion = MAKEWORD(2, 2);
-	WSADATA wsaData;
-	if (WSAStartup(socketVersion, &wsaData) != 0)
-	{
-		exit(0);
+		return frame.GetJPEG(max_bytes, &rate_controller_);
 	}
 
-	const int port = 5000;
+	std::vector<unsigned char> EncodePreview(const VideoFrame& frame) {
+		return frame.GetPreviewJPEG();
+	}
 
-	//std::string ip_address = "127.0.0.1";  // Localhost
-	std::string ip_address = "192.168.43.168";
+private:
+	JpegRateController rate_controller_;
+};
 
-	const SenderSocket socket(ip_address, port);
-	std::cout << "Sending to " << ip_address
-		<< " on port " << port << "." << std::endl;
-	VideoCapture video_capture(false, 0.6, 1);
-	BasicProtocolData protocol_data;
+// Captures frames from a source and streams them to a receiver through the
+// given stages:
+//  - Source: ReadFrame() and PrepareFrame(raw_frame, scaler, overlay, region),
+//    like VideoCapture.
+//  - Scaler, Overlay: see NoScaler.
+//  - Codec: Encode(frame, max_bytes) and EncodePreview(frame), like
+//    JpegCodec.
+//  - Packetizer: like Packetizer.
+//  - Transport: a PacketSender. With a concrete one, like StreamTransport, it
+//    is called without virtual dispatch; with PacketSender itself, the
+//    transport can be any.
+// Common configurations are compiled for exactly their stages this way.
+// RuntimePipeline is the variant whose stages are configured at runtime.
+template <typename Source, typename Scaler, typename Overlay, typename Codec,
+	typename Packetizer, typename Transport>
+class Pipeline {
+public:
+	Pipeline(
+		Source source,
+		const Scaler& scaler,
+		const Overlay& overlay,
+		std::unique_ptr<Transport> transport,
+		const QoSClass qos_class,
+		const std::string& name);
+
+	// Streams frames until the process exits. The frames are prepared and
+	// encoded on the task pool workers of the given NUMA node, several at a
+	// time, and packetized in capture order. Since this never returns, the
+	// tasks can refer to the pipeline.
+	//
+	// Over transports with a feedback channel, every kPreviewFrameInterval-th
+	// frame is sent as a preview as well, and only the previews are sent while
+	// the receiver subscribes to nothing else. The frames, previews included,
+	// are cut down to the region that the receiver subscribed to.
+	void Run(const int node);
+
+private:
+	Source source_;
+	const Scaler scaler_;
+	const Overlay overlay_;
+	Codec codec_;
+	Packetizer packetizer_;
+	const std::unique_ptr<Transport> transport_;
+	const QoSClass qos_class_;
+	BandwidthEstimator bandwidth_estimator_;
+	JpegTableStripper table_stripper_;
+	std::vector<unsigned char> table_payload_;
+	StreamLatencyStats latency_stats_;
+	FrameSequencer frame_sequencer_;
+};  // Pipeline
+
+typedef Pipeline<VideoCapture, DynamicScaler, DynamicOverlay, JpegCodec,
+	Packetizer, PacketSender> RuntimePipeline;
+
+template <typename Source, typename Scaler, typename Overlay, typename Codec,
+	typename Packetizer, typename Transport>
+Pipeline<Source, Scaler, Overlay, Codec, Packetizer, Transport>::Pipeline(
+	Source source,
+	const Scaler& scaler,
+	const Overlay& overlay,
+	std::unique_ptr<Transport> transport,
+	const QoSClass qos_class,
+	const std::string& name)
+	: source_(std::move(source)), scaler_(scaler), overlay_(overlay),
+	  transport_(std::move(transport)), qos_class_(qos_class),
+	  latency_stats_(name) {
+
+	transport_->SetQoSClass(qos_class_);
+}
+
+template <typename Source, typename Scaler, typename Overlay, typename Codec,
+	typename Packetizer, typename Transport>
+void Pipeline<Source, Scaler, Overlay, Codec, Packetizer, Transport>::Run(
+	const int node) {
+
+	// Captured frames are counted to pick the previews, and receiver reports
+	// to put each new one into the stats.
+	unsigned int frame_number = 0;
+	long long num_receiver_reports = 0;
 	while (true) {  // TODO: break out cleanly when done.
-		protocol_data.SetImage(video_capture.GetFrameFromCamera());
-		socket.SendPacket(protocol_data.PackageData());
+		TRACE_SCOPE("send frame");
+		transport_->PollFeedback(&bandwidth_estimator_);
+		const double estimate = bandwidth_estimator_.GetEstimate();
+		GetTransmitScheduler().SetStreamEstimate(&bandwidth_estimator_, estimate);
+		const ReceiverReportTracker* receiver_reports = transport_->ReceiverReports();
+		if (receiver_reports != nullptr &&
+			receiver_reports->NumReports() != num_receiver_reports) {
+			num_receiver_reports = receiver_reports->NumReports();
+			receiver_reports->ReportStats(&latency_stats_);
+		}
+		const bool send_preview = transport_->HasFeedbackChannel() &&
+			frame_number++ % kPreviewFrameInterval == 0;
+		const bool send_frame = !transport_->WantsOnlyPreviews();
+		if (!send_frame && !send_preview) {
+			// Keep the camera from falling behind, but leave the frame be.
+			source_.ReadFrame();
+			continue;
+		}
+		const unsigned int ticket = frame_sequencer_.NextTicket();
+		RawFrame raw_frame = source_.ReadFrame();
+		const size_t max_bytes = FrameByteBudget(
+			transport_->MaxPayloadSize(), estimate);
+		const FrameRegion region = transport_->RequestedRegion();
+		GetTaskPool().Submit([this, ticket, max_bytes, send_frame, send_preview,
+			region, raw_frame = std::move(raw_frame)]() mutable {
+			const VideoFrame video_frame = source_.PrepareFrame(
+				std::move(raw_frame), scaler_, overlay_, region);
+			std::vector<unsigned char> jpeg;
+			if (send_frame) {
+				jpeg = codec_.Encode(video_frame, max_bytes);
+			}
+			std::vector<unsigned char> preview;
+			if (send_preview) {
+				preview = codec_.EncodePreview(video_frame);
+			}
+			FrameTrace trace = video_frame.GetTrace();
+			trace.stage_end_us[kStageEncode] =
+				static_cast<unsigned int>(NowMicroseconds()) - trace.capture_start_us;
+			// The packetizer and the table stripper follow the frames in
+			// order, so the rest runs in sequence.
+			frame_sequencer_.Complete(ticket, [this, trace, jpeg = std::move(jpeg),
+				preview = std::move(preview)]() mutable {
+				unsigned char probe_cluster = 0;
+				if (transport_->HasFeedbackChannel() &&
+					bandwidth_estimator_.StartProbeCluster(NowMicroseconds(), &probe_cluster)) {
+					GetTransmitScheduler().EnqueueProbeCluster(
+						transport_.get(), &bandwidth_estimator_, qos_class_,
+						packetizer_.MakeProbeCluster(probe_cluster));
+				}
+				if (!preview.empty()) {
+					// The previews go out on the same flow, ahead of the frame.
+					// Their latencies count when nothing else is sent.
+					FrameTrace preview_trace = trace;
+					std::vector<std::vector<unsigned char>> packets =
+						packetizer_.PacketizePreview(
+							preview, &preview_trace, transport_->MaxPayloadSize());
+					StreamLatencyStats* preview_stats = nullptr;
+					if (jpeg.empty()) {
+						RecordTracedStages(preview_trace, &latency_stats_);
+						preview_stats = &latency_stats_;
+					}
+					GetTransmitScheduler().EnqueueFrame(
+						transport_.get(), &bandwidth_estimator_, preview_stats,
+						preview_trace.capture_start_us +
+							preview_trace.stage_end_us[kStagePacketize],
+						qos_class_, std::move(packets));
+				}
+				if (jpeg.empty()) {
+					return;
+				}
+				const bool abbreviate = kUseAbbreviatedJPEG && !kUseSharedMemoryTransport;
+				unsigned char table_id = kNoTableId;
+				const std::vector<unsigned char> frame = abbreviate
+					? table_stripper_.StripTables(jpeg, NowMicroseconds(), &table_id, &table_payload_)
+					: jpeg;
+				// The tables go out right in front of the first frame that
+				// needs them, queued apart from it so that they are sent even
+				// if the frame is dropped.
+				std::vector<unsigned char> table_packet;
+				if (abbreviate && !table_payload_.empty()) {
+					table_packet = packetizer_.MakeTablePacket(table_payload_);
+				}
+				std::vector<std::vector<unsigned char>> packets =
+					packetizer_.PacketizeFrame(frame, table_id, &trace, transport_->MaxPayloadSize());
+				if (!table_packet.empty()) {
+					GetTransmitScheduler().EnqueueTables(
+						transport_.get(), &bandwidth_estimator_, qos_class_,
+						std::move(table_packet));
+				}
+				RecordTracedStages(trace, &latency_stats_);
+				GetTransmitScheduler().EnqueueFrame(
+					transport_.get(), &bandwidth_estimator_, &latency_stats_,
+					trace.capture_start_us + trace.stage_end_us[kStagePacketize],
+					qos_class_, std::move(packets));
+			});
+		}, node);
 	}
 }
 
-void send3() {
+// Captures frames from the given camera, scaled by the given scale and with
+// the time drawn into them if draw_timestamp is set, and streams them to the
+// receiver at the given address until the process exits.
+void SendStream(
+	const std::string ip_address,
+	const int port,
+	const QoSClass qos_class,
+	const int camera,
+	const float scale,
+	const bool draw_timestamp) {
 
+	TRACE_THREAD_NAME("send to port " + std::to_string(port));
+	// The streams are spread over the NUMA nodes by camera. The frames are
+	// captured, prepared and encoded on the cores and memory of that node.
+	const int node = camera % NumaNodeCount();
+	PinThreadToNode(node);
 	WORD socketVersion = MAKEWORD(2, 2);
 	WSADATA wsaData;
 	if (WSAStartup(socketVersion, &wsaData) != 0)
@@ -372,27 +4702,60 @@ void send3() {
 		exit(0);
 	}
 
-	const int port = 4000;
-
-	//std::string ip_address = "127.0.0.1";  // Localhost
-	std::string ip_address = "192.168.1.3";
-
-	const SenderSocket socket(ip_address, port);
 	std::cout << "Sending to " << ip_address
 		<< " on port " << port << "." << std::endl;
-	VideoCapture video_capture(false, 0.6, 2);
-	BasicProtocolData protocol_data;
-	while (true) {  // TODO: break out cleanly when done.
-		protocol_data.SetImage(video_capture.GetFrameFromCamera());
-		socket.SendPacket(protocol_data.PackageData());
+	const std::string name =
+		"stream to " + ip_address + ":" + std::to_string(port);
+	// The usual configurations run on pipelines compiled for their stages, any
+	// other one on the stages configured at runtime.
+	if (!kReplayFileName.empty()) {
+		// A replayed file is sent as it is, without scaling it or drawing into
+		// it, so that its JPEGs are passed through.
+		Pipeline<VideoCapture, NoScaler, NoOverlay, JpegCodec, Packetizer,
+			StreamTransport> pipeline(
+				VideoCapture(false, 1.0, kReplayFileName, false),
+				NoScaler(), NoOverlay(),
+				MakeTransport<StreamTransport>(ip_address, port), qos_class, name);
+		pipeline.Run(node);
+	} else if (scale < 1.0 && draw_timestamp) {
+		Pipeline<VideoCapture, ResizeScaler, TimestampOverlay, JpegCodec,
+			Packetizer, StreamTransport> pipeline(
+				VideoCapture(false, scale, camera),
+				ResizeScaler(scale), TimestampOverlay(),
+				MakeTransport<StreamTransport>(ip_address, port), qos_class, name);
+		pipeline.Run(node);
+	} else {
+		RuntimePipeline pipeline(
+			VideoCapture(false, scale, camera, draw_timestamp),
+			DynamicScaler(scale), DynamicOverlay(draw_timestamp),
+			MakeTransport<PacketSender>(ip_address, port), qos_class, name);
+		pipeline.Run(node);
 	}
 }
 
+// Streams of higher classes keep their frame rate when the uplink is
+// saturated. Use "127.0.0.1" as the address for a receiver on this machine.
+void send1() {
+	SendStream("192.168.43.168", 6000, QoSClass::kCritical, 0, 0.6f, true);
+}
+
+void send2() {
+	SendStream("192.168.43.168", 5000, QoSClass::kVideo, 1, 0.6f, true);
+}
+
+void send3() {
+	SendStream("192.168.1.3", 4000, QoSClass::kBestEffort, 2, 0.6f, true);
+}
+
 int main()
 {
-	//ϵͳ˶̹߳ܣͬʱòͬͷָIPͶ˿ڷƵ
-	//ÿ̷߳ͶƵݣ
-	//ڴsendдкᷢ󣬹ʷֱsend1 send2 send3
+	//系统加入了多线程功能，可以同时调用不同的摄像头给指定的IP和端口发送视频
+	//每个线程发送独立的视频数据，互不干扰
+	//由于带参数的send写入下列函数会发生错误，故分别定义了send1函数 send2函数 send3函数
+	// Press Ctrl+Break to print the latency histograms of all streams, and to
+	// write the trace when ENABLE_TRACING is defined.
+	SetConsoleCtrlHandler(OnConsoleControl, TRUE);
+
 	std::thread send1(send1);
 	std::thread send2(send2);
 	std::thread send3(send3);